@@ -1,6 +1,8 @@
 #include "dht.h"
 #include "utils.h"
 #include "../webserver.h"
+#include <netdb.h>
+#include <arpa/inet.h>
 
 dht_neighbor* dht_neighbor_init(char *neighbor_id, char* neighbor_ip, char* neighbor_port) {
     if (neighbor_port == NULL || neighbor_ip == NULL) {
@@ -13,14 +15,70 @@ dht_neighbor* dht_neighbor_init(char *neighbor_id, char* neighbor_ip, char* neig
         return NULL;
     }
 
+    uint16_t id = 0;
+    if (neighbor_id != NULL) id = strtol(neighbor_id, NULL, 10);
+
+    struct sockaddr_in addr;
+    if (dht_address_resolve(neighbor_ip, neighbor_port, &addr) != 0) {
+        perror("Invalid DHT IP or Port.");
+        return NULL;
+    }
+
+    return dht_neighbor_create(id, &addr);
+}
+
+int dht_address_resolve(const char *ip, const char *port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(strtol(port, NULL, 10));
+    if (inet_pton(AF_INET, ip, &(addr->sin_addr)) == 1) return 0;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if (getaddrinfo(ip, port, &hints, &res) != 0) return -1;
+    memcpy(addr, res->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+dht_neighbor* dht_neighbor_create(uint16_t id, const struct sockaddr_in *addr) {
     dht_neighbor *neighbor = calloc(1, sizeof(dht_neighbor));
-    if (neighbor_id != NULL) neighbor->ID = strtol(neighbor_id, NULL, 10);
-    neighbor->PORT = neighbor_port;
-    neighbor->IP = neighbor_ip;
+    if (neighbor == NULL) return NULL;
+
+    neighbor->ID = id;
+    neighbor->addr = *addr;
+
+    // the strings are only needed for redirects, they are built once here
+    neighbor->IP = calloc(INET_ADDRSTRLEN, sizeof(char));
+    neighbor->PORT = calloc(7, sizeof(char));
+    if (neighbor->IP == NULL || neighbor->PORT == NULL) {
+        dht_neighbor_free(neighbor);
+        return NULL;
+    }
+
+    inet_ntop(AF_INET, &(addr->sin_addr), neighbor->IP, INET_ADDRSTRLEN);
+    snprintf(neighbor->PORT, 7, "%u", ntohs(addr->sin_port));
 
     return neighbor;
 }
 
+int dht_neighbor_equals(dht_neighbor *neighbor, uint16_t id, const struct sockaddr_in *addr) {
+    return neighbor != NULL && neighbor->ID == id && neighbor->addr.sin_addr.s_addr == addr->sin_addr.s_addr
+        && neighbor->addr.sin_port == addr->sin_port;
+}
+
+void dht_neighbor_free(dht_neighbor *neighbor) {
+    if (neighbor == NULL) return;
+
+    free(neighbor->IP);
+    free(neighbor->PORT);
+    free(neighbor);
+}
+
 dht_node* dht_node_init(char *dht_node_id, char *dht_anchor_ip, char *dht_anchor_port) {
     if (str_is_uint16(dht_node_id) < 0) {
         perror("Invalid DHT Node ID.");
@@ -30,6 +88,7 @@ dht_node* dht_node_init(char *dht_node_id, char *dht_anchor_ip, char *dht_anchor
     dht_node *node = calloc(1, sizeof(dht_node));
     node->ID = strtol(dht_node_id, NULL, 10);
     node->status = OK;
+    node->pred_seen = time_now_ms();
 
     node->pred = NULL;
     node->succ = NULL;
@@ -59,19 +118,47 @@ dht_node* dht_node_init(char *dht_node_id, char *dht_anchor_ip, char *dht_anchor
         }
     }
 
-    node->lookup_cache = calloc(1, sizeof(dht_lookup_cache));
-    for (int i = 0; i < LOOKUP_CACHE_SIZE; i++) node->lookup_cache->hashes[i] = -1;
+    int cache_size = LOOKUP_CACHE_SIZE;
+    if (getenv("LOOKUP_CACHE_SIZE") != NULL && strtol(getenv("LOOKUP_CACHE_SIZE"), NULL, 10) > 0) {
+        cache_size = strtol(getenv("LOOKUP_CACHE_SIZE"), NULL, 10);
+    }
+
+    uint64_t cache_ttl = LOOKUP_CACHE_TTL;
+    if (getenv("LOOKUP_CACHE_TTL") != NULL && strtol(getenv("LOOKUP_CACHE_TTL"), NULL, 10) > 0) {
+        cache_ttl = strtol(getenv("LOOKUP_CACHE_TTL"), NULL, 10);
+    }
+
+    node->lookup_cache = dht_lookup_cache_create(cache_size, cache_ttl);
+    if (node->lookup_cache == NULL) {
+        perror("Could not create lookup cache.");
+        return NULL;
+    }
+
+    node->udp_fd = -1;
+    pthread_mutex_init(&(node->lock), NULL);
 
     return node;
 }
 
 void dht_node_free(dht_node *node) {
-    if (node->pred != NULL) free(node->pred);
-    if (node->succ != NULL)free(node->succ);
-    free(node->lookup_cache);
+    dht_neighbor_free(node->pred);
+    dht_neighbor_free(node->succ);
+    dht_neighbor_free(node->failed);
+    for (int i = 0; i < FINGER_TABLE_SIZE; i++) dht_neighbor_free(node->fingers[i]);
+    for (int k = 0; k < SUCCESSOR_LIST_SIZE; k++) dht_neighbor_free(node->succ_list[k]);
+    dht_lookup_cache_free(node->lookup_cache);
+    pthread_mutex_destroy(&(node->lock));
     free(node);
 }
 
+void dht_node_lock(dht_node *node) {
+    pthread_mutex_lock(&(node->lock));
+}
+
+void dht_node_unlock(dht_node *node) {
+    pthread_mutex_unlock(&(node->lock));
+}
+
 unsigned short dht_node_is_responsible(dht_node *node, uint16_t hash) {
     if (node->pred == NULL) return 1;
 
@@ -88,35 +175,345 @@ unsigned short dht_node_is_responsible(dht_node *node, uint16_t hash) {
     return 0;
 }
 
+dht_node *dht_nodes_following(dht_node **nodes, int num_nodes, uint16_t hash) {
+    dht_node *closest = nodes[0];
+    for (int i = 1; i < num_nodes; i++) {
+        if ((uint16_t) (nodes[i]->ID - hash) < (uint16_t) (closest->ID - hash)) closest = nodes[i];
+    }
+    return closest;
+}
+
+dht_node *dht_nodes_preceding(dht_node **nodes, int num_nodes, uint16_t hash) {
+    // a node whose ID equals the hash is the furthest away
+    dht_node *closest = nodes[0];
+    for (int i = 1; i < num_nodes; i++) {
+        if ((uint16_t) (hash - nodes[i]->ID - 1) < (uint16_t) (hash - closest->ID - 1)) closest = nodes[i];
+    }
+    return closest;
+}
+
+unsigned short dht_in_range(uint16_t id, uint16_t from, uint16_t to) {
+    if (from == to) return 1;
+
+    // distances along the ring, so the interval may wrap around 0
+    return (uint16_t) (id - from - 1) < (uint16_t) (to - from);
+}
+
+uint16_t dht_finger_start(dht_node *node, int i) {
+    return (uint16_t) (node->ID + (1u << i));
+}
+
+/**
+ * Replaces the neighbor stored in *slot by a copy of the given neighbor data, unless they are equal.
+ */
+static void dht_neighbor_set(dht_neighbor **slot, uint16_t id, const struct sockaddr_in *addr) {
+    if (dht_neighbor_equals(*slot, id, addr)) return;
+
+    dht_neighbor *neighbor = dht_neighbor_create(id, addr);
+    if (neighbor == NULL) return;
+
+    dht_neighbor_free(*slot);
+    *slot = neighbor;
+}
+
+void dht_node_set_finger(dht_node *node, int i, uint16_t id, const struct sockaddr_in *addr) {
+    dht_neighbor_set(&(node->fingers[i]), id, addr);
+}
+
+void dht_node_update_fingers(dht_node *node, uint16_t from, uint16_t id, const struct sockaddr_in *addr) {
+    for (int i = 0; i < FINGER_TABLE_SIZE; i++) {
+        if (dht_in_range(dht_finger_start(node, i), from, id)) dht_node_set_finger(node, i, id, addr);
+    }
+}
+
+dht_neighbor* dht_node_find_finger(dht_node *node, uint16_t hash) {
+    for (int i = 0; i < FINGER_TABLE_SIZE; i++) {
+        dht_neighbor *finger = node->fingers[i];
+        if (finger == NULL || finger->ID == node->ID) continue;
+
+        // nothing lies between the finger's start and the finger, so it is responsible for all of it
+        uint16_t start = dht_finger_start(node, i);
+        if ((uint16_t) (hash - start) <= (uint16_t) (finger->ID - start)) return finger;
+    }
+
+    return NULL;
+}
+
+void dht_node_set_successor(dht_node *node, int k, uint16_t id, const struct sockaddr_in *addr) {
+    if (dht_neighbor_equals(node->succ_list[k], id, addr)) return;
+
+    dht_neighbor_set(&(node->succ_list[k]), id, addr);
+
+    // the entries following it were learned from the previous k-th successor
+    dht_node_truncate_successors(node, k + 1);
+}
+
+void dht_node_truncate_successors(dht_node *node, int k) {
+    for (; k < SUCCESSOR_LIST_SIZE; k++) {
+        dht_neighbor_free(node->succ_list[k]);
+        node->succ_list[k] = NULL;
+    }
+}
+
+int dht_node_replace_failed_successor(dht_node *node) {
+    if (node->succ == NULL || node->succ_list[0] == NULL) return -1;
+
+    dht_neighbor *failed = node->succ;
+    dht_neighbor_free(node->failed);
+    node->failed = failed;
+    node->failed_since = time_now_ms();
+
+    node->succ = node->succ_list[0];
+    memmove(node->succ_list, node->succ_list + 1, (SUCCESSOR_LIST_SIZE - 1) * sizeof(dht_neighbor*));
+    node->succ_list[SUCCESSOR_LIST_SIZE - 1] = NULL;
+
+    // no message is routed to the failed node any longer
+    for (int i = 0; i < FINGER_TABLE_SIZE; i++) {
+        if (node->fingers[i] == NULL || !dht_neighbor_equals(node->fingers[i], failed->ID, &(failed->addr))) continue;
+
+        dht_neighbor_free(node->fingers[i]);
+        node->fingers[i] = NULL;
+    }
+
+    for (int k = 0; k < SUCCESSOR_LIST_SIZE; k++) {
+        if (!dht_neighbor_equals(node->succ_list[k], failed->ID, &(failed->addr))) continue;
+
+        // the list wrapped around the ring, the rest of it is unreliable
+        dht_node_truncate_successors(node, k);
+        break;
+    }
+
+    node->stabilize_sent = 0;
+    node->stabilize_retries = 0;
+    return 0;
+}
+
+int dht_node_is_failed(dht_node *node, uint16_t id, const struct sockaddr_in *addr) {
+    if (node->failed == NULL || time_now_ms() - node->failed_since >= FAILED_NODE_TIMEOUT) return 0;
+
+    return dht_neighbor_equals(node->failed, id, addr);
+}
+
+dht_neighbor* dht_node_next_hop(dht_node *node, uint16_t hash) {
+    for (int i = FINGER_TABLE_SIZE - 1; i >= 0; i--) {
+        dht_neighbor *finger = node->fingers[i];
+        if (finger == NULL) continue;
+
+        // the finger has to lie strictly between this node and the hash
+        if (finger->ID != hash && dht_in_range(finger->ID, node->ID, hash)) return finger;
+    }
+
+    return node->succ;
+}
+
+dht_lookup_cache* dht_lookup_cache_create(int capacity, uint64_t ttl) {
+    dht_lookup_cache *cache = calloc(1, sizeof(dht_lookup_cache));
+    if (cache == NULL) return NULL;
+
+    cache->capacity = capacity;
+    cache->ttl = ttl;
+    cache->num_buckets = 1;
+    while (cache->num_buckets < capacity) cache->num_buckets *= 2;
+
+    cache->entries = calloc(capacity, sizeof(dht_lookup_cache_entry));
+    cache->buckets = malloc(cache->num_buckets * sizeof(int));
+    if (cache->entries == NULL || cache->buckets == NULL) {
+        dht_lookup_cache_free(cache);
+        return NULL;
+    }
+
+    for (int i = 0; i < cache->num_buckets; i++) cache->buckets[i] = -1;
+
+    // all entries start out in the list of unused entries
+    for (int i = 0; i < capacity; i++) {
+        cache->entries[i].lru_prev = -1;
+        cache->entries[i].lru_next = (i + 1 < capacity) ? i + 1 : -1;
+    }
+    cache->free_head = 0;
+    cache->lru_head = -1;
+    cache->lru_tail = -1;
+
+    return cache;
+}
+
+void dht_lookup_cache_free(dht_lookup_cache *cache) {
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache);
+}
+
+/**
+ * Unlinks an entry from the cache's LRU list.
+ */
+static void dht_lookup_cache_unlink(dht_lookup_cache *cache, int i) {
+    dht_lookup_cache_entry *e = &(cache->entries[i]);
+
+    if (e->lru_prev != -1) cache->entries[e->lru_prev].lru_next = e->lru_next;
+    else cache->lru_head = e->lru_next;
+
+    if (e->lru_next != -1) cache->entries[e->lru_next].lru_prev = e->lru_prev;
+    else cache->lru_tail = e->lru_prev;
+
+    e->lru_prev = -1;
+    e->lru_next = -1;
+}
+
+/**
+ * Links an (unlinked) entry into the cache's LRU list as the most recently used one.
+ */
+static void dht_lookup_cache_push(dht_lookup_cache *cache, int i) {
+    dht_lookup_cache_entry *e = &(cache->entries[i]);
+
+    e->lru_prev = -1;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head != -1) cache->entries[cache->lru_head].lru_prev = i;
+    cache->lru_head = i;
+    if (cache->lru_tail == -1) cache->lru_tail = i;
+}
+
+/**
+ * Makes a used entry the most recently used one.
+ */
+static void dht_lookup_cache_touch(dht_lookup_cache *cache, int i) {
+    if (cache->lru_head == i) return;
+
+    dht_lookup_cache_unlink(cache, i);
+    dht_lookup_cache_push(cache, i);
+}
+
+/**
+ * Finds an entry by hash via the index.
+ * @return the entry's index, -1 if the hash is not in the cache.
+ */
+static int dht_lookup_cache_find(dht_lookup_cache *cache, uint16_t hash) {
+    int i = cache->buckets[hash & (cache->num_buckets - 1)];
+    while (i != -1 && cache->entries[i].hash != hash) i = cache->entries[i].bucket_next;
+
+    return i;
+}
+
+/**
+ * Removes an entry from the index and the LRU list and returns it to the unused entries.
+ */
+static void dht_lookup_cache_remove(dht_lookup_cache *cache, int i) {
+    dht_lookup_cache_entry *e = &(cache->entries[i]);
+
+    int *link = &(cache->buckets[e->hash & (cache->num_buckets - 1)]);
+    while (*link != i) link = &(cache->entries[*link].bucket_next);
+    *link = e->bucket_next;
+
+    dht_lookup_cache_unlink(cache, i);
+    if (e->state == LOOKUP_CACHE_PENDING) cache->num_pending--;
+
+    e->state = LOOKUP_CACHE_UNUSED;
+    e->lru_next = cache->free_head;
+    cache->free_head = i;
+}
+
 short dht_lookup_cache_add_hash(dht_node *node, uint16_t hash) {
-    for (int i = 0; i < LOOKUP_CACHE_SIZE; i++) {
-        if (node->lookup_cache->nodes[i] != NULL) continue;
+    dht_lookup_cache *cache = node->lookup_cache;
+    uint64_t now = time_now_ms();
+
+    int i = dht_lookup_cache_find(cache, hash);
+    if (i != -1) {
+        dht_lookup_cache_entry *e = &(cache->entries[i]);
+
+        // lookups that got no reply in time are sent again
+        if (e->state == LOOKUP_CACHE_PENDING && now - e->time < LOOKUP_TIMEOUT) return 1;
+        if (e->state != LOOKUP_CACHE_PENDING) cache->num_pending++;
 
-        node->lookup_cache->hashes[i] = hash;
+        e->state = LOOKUP_CACHE_PENDING;
+        e->time = now;
+        dht_lookup_cache_touch(cache, i);
         return 0;
     }
 
-    // replacing the oldest cache entry
-    node->lookup_cache->hashes[0] = hash;
-    free(node->lookup_cache->nodes[0]->IP);
-    free(node->lookup_cache->nodes[0]->PORT);
-    free(node->lookup_cache->nodes[0]);
+    // replacing the least recently used entry when the cache is full
+    if (cache->free_head == -1) {
+        dht_lookup_cache_remove(cache, cache->lru_tail);
+        cache->evictions++;
+    }
+
+    i = cache->free_head;
+    dht_lookup_cache_entry *e = &(cache->entries[i]);
+    cache->free_head = e->lru_next;
+
+    e->hash = hash;
+    e->state = LOOKUP_CACHE_PENDING;
+    e->time = now;
+    cache->num_pending++;
+
+    int *bucket = &(cache->buckets[hash & (cache->num_buckets - 1)]);
+    e->bucket_next = *bucket;
+    *bucket = i;
 
-    return -1;
+    dht_lookup_cache_push(cache, i);
+    return 0;
 }
 
-int dht_lookup_cache_find_empty(dht_node *node) {
-    for (int i = 0; i < LOOKUP_CACHE_SIZE; i++) {
-        if (node->lookup_cache->hashes[i] != -1 && node->lookup_cache->nodes[i] == NULL) return i;
+int dht_lookup_cache_resolve(dht_node *node, uint16_t from, uint16_t id, const struct sockaddr_in *addr) {
+    dht_lookup_cache *cache = node->lookup_cache;
+    uint64_t now = time_now_ms();
+
+    // the reply is the freshest information there is, so resolved entries in the range are
+    // overwritten as well, e.g. ones still naming a node that has failed since
+    int num_resolved = 0;
+    for (int i = cache->lru_head; i != -1; i = cache->entries[i].lru_next) {
+        dht_lookup_cache_entry *e = &(cache->entries[i]);
+        if (e->state == LOOKUP_CACHE_UNUSED || !dht_in_range(e->hash, from, id)) continue;
+
+        // an unchanged entry only starts its TTL over
+        if (e->state == LOOKUP_CACHE_RESOLVED && dht_neighbor_equals(&(e->node), id, addr)) {
+            e->time = now;
+            continue;
+        }
+
+        if (e->state == LOOKUP_CACHE_PENDING) {
+            cache->num_pending--;
+            num_resolved++;
+        }
+
+        e->state = LOOKUP_CACHE_RESOLVED;
+        e->time = now;
+        e->node.ID = id;
+        e->node.addr = *addr;
+        inet_ntop(AF_INET, &(addr->sin_addr), e->ip, sizeof(e->ip));
+        snprintf(e->port, sizeof(e->port), "%u", ntohs(addr->sin_port));
+        e->node.IP = e->ip;
+        e->node.PORT = e->port;
     }
 
-    return -1;
+    return num_resolved;
 }
 
 dht_neighbor* dht_lookup_cache_find_node(dht_node *node, uint16_t hash) {
-    for (int i = LOOKUP_CACHE_SIZE-1; i >= 0; i--) {
-        if (node->lookup_cache->hashes[i] == hash) return node->lookup_cache->nodes[i];
+    dht_lookup_cache *cache = node->lookup_cache;
+
+    int i = dht_lookup_cache_find(cache, hash);
+    if (i == -1 || cache->entries[i].state != LOOKUP_CACHE_RESOLVED) {
+        cache->misses++;
+        return NULL;
     }
 
-    return NULL;
+    dht_lookup_cache_entry *e = &(cache->entries[i]);
+    if (time_now_ms() - e->time >= cache->ttl) {
+        dht_lookup_cache_remove(cache, i);
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    dht_lookup_cache_touch(cache, i);
+    return &(e->node);
+}
+
+void dht_lookup_cache_invalidate(dht_node *node) {
+    dht_lookup_cache *cache = node->lookup_cache;
+
+    int i = cache->lru_head;
+    while (i != -1) {
+        int next = cache->entries[i].lru_next;
+        if (cache->entries[i].state == LOOKUP_CACHE_RESOLVED) dht_lookup_cache_remove(cache, i);
+        i = next;
+    }
 }
@@ -2,9 +2,19 @@
 #define RN_PRAXIS_DHT_H
 
 #include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
 
-#define LOOKUP_CACHE_SIZE 10
-#define STABILIZE_INTERVAL 1000
+#define LOOKUP_CACHE_SIZE 1024 // Default number of lookup-cache entries, can be overridden via env LOOKUP_CACHE_SIZE
+#define LOOKUP_CACHE_TTL 5000 // Default time (ms) a looked up node is cached, can be overridden via env LOOKUP_CACHE_TTL
+#define FINGER_TABLE_SIZE 16 // One finger per bit of the ID space
+#define STABILIZE_INTERVAL 1000 // Time (ms) between two stabilize rounds
+#define LOOKUP_TIMEOUT 500 // Max. time (ms) a request waits for the reply to its lookup before it is answered with 503
+#define SUCCESSOR_LIST_SIZE 4 // Number of successors known beyond the immediate one
+#define SUCCESSOR_TIMEOUT 300 // Time (ms) after which an unanswered STABILIZE is sent again
+#define SUCCESSOR_RETRIES 2 // Number of resent STABILIZEs after which the successor is considered failed
+#define PREDECESSOR_TIMEOUT 2500 // Time (ms) without a STABILIZE after which the predecessor is considered failed
+#define FAILED_NODE_TIMEOUT 5000 // Time (ms) a failed successor isn't accepted as successor again
 
 typedef enum dht_node_status {
     JOINING,
@@ -16,11 +26,47 @@ typedef struct dht_neighbor {
     uint16_t ID;
     char* IP;
     char* PORT;
+    struct sockaddr_in addr; // IP and PORT resolved once, DHT messages are sent to it
 } dht_neighbor;
 
+typedef enum dht_lookup_cache_state {
+    LOOKUP_CACHE_UNUSED,
+    LOOKUP_CACHE_PENDING, // a lookup has been sent, the reply is outstanding
+    LOOKUP_CACHE_RESOLVED
+} dht_lookup_cache_state;
+
+typedef struct dht_lookup_cache_entry {
+    uint16_t hash;
+    dht_lookup_cache_state state;
+    uint64_t time; // when the lookup was sent (PENDING) or answered (RESOLVED)
+    dht_neighbor node; // the responsible node (RESOLVED), its IP and PORT point to ip and port
+    char ip[INET_ADDRSTRLEN];
+    char port[8];
+    int bucket_next; // next entry in the same bucket, -1 if none
+    // LRU list of used entries (most recently used first) or list of unused entries
+    int lru_prev;
+    int lru_next;
+} dht_lookup_cache_entry;
+
+/**
+ * Cache of the nodes responsible for recently requested hashes, including the lookups still outstanding.
+ * Entries are found via a hash index (chained buckets) and evicted in LRU order when the cache is full.
+ * Resolved entries expire after ttl ms.
+ */
 typedef struct dht_lookup_cache {
-    int hashes[LOOKUP_CACHE_SIZE];
-    dht_neighbor* nodes[LOOKUP_CACHE_SIZE];
+    dht_lookup_cache_entry *entries;
+    int capacity;
+    int *buckets; // first entry of each bucket, -1 if none
+    int num_buckets; // power of 2
+    int lru_head;
+    int lru_tail;
+    int free_head; // first unused entry
+    int num_pending;
+    uint64_t ttl;
+    // statistics
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 } dht_lookup_cache;
 
 /**
@@ -29,10 +75,23 @@ typedef struct dht_lookup_cache {
  */
 typedef struct dht_node {
     uint16_t ID;
+    struct sockaddr_in addr; // this node's own address, as named in its messages
     dht_neighbor* pred;
     dht_neighbor* succ;
     dht_lookup_cache* lookup_cache;
+    // fingers[i] is the node responsible for ID + 2^i (NULL while unknown), refreshed every stabilize round
+    dht_neighbor* fingers[FINGER_TABLE_SIZE];
+    // succ_list[0] is succ's successor, succ_list[k] the successor of succ_list[k-1] (NULL while unknown),
+    // the successor is replaced by succ_list[0] when it fails
+    dht_neighbor* succ_list[SUCCESSOR_LIST_SIZE];
+    uint64_t stabilize_sent; // time the unanswered STABILIZE was sent, 0 if it has been answered
+    int stabilize_retries; // number of times the unanswered STABILIZE has been resent
+    uint64_t pred_seen; // time of the last STABILIZE received from pred
+    dht_neighbor* failed; // the successor that failed last (NULL if none)
+    uint64_t failed_since;
     dht_node_status status;
+    int udp_fd; // the node's own UDP socket (owned by worker 0), -1 if it has none
+    pthread_mutex_t lock; // guards all of the above when the node is shared between worker threads
 } dht_node;
 
 /**
@@ -44,6 +103,34 @@ typedef struct dht_node {
  */
 dht_neighbor* dht_neighbor_init(char *neighbor_id, char* neighbor_ip, char* neighbor_port);
 
+/**
+ * Resolves an IPv4 address and port into a socket address. Numeric addresses are converted
+ * right away, only host names are looked up.
+ * @param ip The IP (or host name) to resolve.
+ * @param port The port to resolve.
+ * @param addr The socket address to fill.
+ * @return 0 on success, -1 if the address can't be resolved.
+ */
+int dht_address_resolve(const char *ip, const char *port, struct sockaddr_in *addr);
+
+/**
+ * Creates a new dht_neighbor-object for the node with the given ID and address, its IP and PORT are set from the address.
+ * @return A dht_neighbor object on success, NULL on error.
+ */
+dht_neighbor* dht_neighbor_create(uint16_t id, const struct sockaddr_in *addr);
+
+/**
+ * Determines whether a neighbor is the node with the given ID and address.
+ * @return 1 if it is, 0 if not (or if neighbor is NULL).
+ */
+int dht_neighbor_equals(dht_neighbor *neighbor, uint16_t id, const struct sockaddr_in *addr);
+
+/**
+ * Frees the given dht_neighbor-object (including its IP and PORT). Does nothing if neighbor is NULL.
+ * @param neighbor The neighbor to be freed.
+ */
+void dht_neighbor_free(dht_neighbor *neighbor);
+
 /**
  * Initializes a new dht_node-object from a given ID.
  * @param ws the webserver to initialize the dht_node for
@@ -58,6 +145,18 @@ dht_node* dht_node_init(char *dht_node_id, char *dht_anchor_ip, char *dht_anchor
  */
 void dht_node_free(dht_node *node);
 
+/**
+ * Locks the given node for exclusive access.
+ * @param node the node to be locked.
+ */
+void dht_node_lock(dht_node *node);
+
+/**
+ * Releases a lock taken with dht_node_lock.
+ * @param node the node to be unlocked.
+ */
+void dht_node_unlock(dht_node *node);
+
 /**
  * Decides whether a given DHT Node is responsible for
  * the given resource (in hash-form, i.e. the first 16bit of a SHA256 hash)
@@ -68,28 +167,161 @@ void dht_node_free(dht_node *node);
 unsigned short dht_node_is_responsible(dht_node *node, uint16_t hash);
 
 /**
- * Adds a given hash to the DHT Node's lookup-cache.
- * When there is no free spot, the first entry's hash is replaced and it's saved Node is discarded.
+ * Finds the one of a server's (virtual) nodes whose ID follows the hash most closely (or equals it),
+ * i.e. the only one of them that may be responsible for it.
+ * Only the nodes' IDs are read, so they don't have to be locked.
+ * @param nodes the server's nodes.
+ * @param num_nodes the number of nodes (at least 1).
+ * @param hash the hash.
+ * @return the node.
+ */
+dht_node *dht_nodes_following(dht_node **nodes, int num_nodes, uint16_t hash);
+
+/**
+ * Finds the one of a server's (virtual) nodes whose ID precedes the hash most closely, i.e. the one whose
+ * successor may be responsible for it and whose fingers lead the furthest towards it.
+ * Only the nodes' IDs are read, so they don't have to be locked.
+ * @param nodes the server's nodes.
+ * @param num_nodes the number of nodes (at least 1).
+ * @param hash the hash.
+ * @return the node.
+ */
+dht_node *dht_nodes_preceding(dht_node **nodes, int num_nodes, uint16_t hash);
+
+/**
+ * Decides whether an ID lies in the interval (from, to] of the ring.
+ * The interval covers the whole ring if from == to.
+ * @return 1 if it does, 0 else
+ */
+unsigned short dht_in_range(uint16_t id, uint16_t from, uint16_t to);
+
+/**
+ * Returns the start of a finger's interval, i.e. the ID the finger is responsible for.
+ * @param node the node the finger belongs to.
+ * @param i the finger's index.
+ * @return node's ID + 2^i
+ */
+uint16_t dht_finger_start(dht_node *node, int i);
+
+/**
+ * Sets the node's i-th finger to a copy of the given neighbor data.
+ * @param node the node whose finger is set.
+ * @param i the finger's index.
+ * @param id the ID of the responsible node.
+ * @param addr the address of the responsible node.
+ */
+void dht_node_set_finger(dht_node *node, int i, uint16_t id, const struct sockaddr_in *addr);
+
+/**
+ * Sets all fingers whose start lies in the interval (from, id], i.e. the ones
+ * a node with the given ID and predecessor `from` is responsible for.
+ * @param node the node whose fingers are updated.
+ * @param from the ID of the responsible node's predecessor.
+ * @param id the ID of the responsible node.
+ * @param addr the address of the responsible node.
+ */
+void dht_node_update_fingers(dht_node *node, uint16_t from, uint16_t id, const struct sockaddr_in *addr);
+
+/**
+ * Finds the finger that is known to be responsible for a hash, i.e. one whose interval
+ * [start, finger's ID] covers it.
+ * @param node the node whose fingers to search.
+ * @param hash the hash to search for.
+ * @return the responsible finger, NULL if no finger covers the hash.
+ */
+dht_neighbor* dht_node_find_finger(dht_node *node, uint16_t hash);
+
+/**
+ * Sets the k-th entry of the node's successor list to a copy of the given neighbor data.
+ * If the entry changes, the entries following it are dropped.
+ * @param node the node whose successor list is set.
+ * @param k the entry's index.
+ * @param id the ID of the successor.
+ * @param addr the address of the successor.
+ */
+void dht_node_set_successor(dht_node *node, int k, uint16_t id, const struct sockaddr_in *addr);
+
+/**
+ * Drops the entries of the node's successor list from the k-th one on.
+ * @param node the node whose successor list is truncated.
+ * @param k the index of the first entry to drop.
+ */
+void dht_node_truncate_successors(dht_node *node, int k);
+
+/**
+ * Replaces the node's failed successor by the first entry of its successor list.
+ * The failed node is removed from the fingers and successor list, and won't be
+ * accepted as successor for FAILED_NODE_TIMEOUT ms.
+ * @param node the node whose successor failed.
+ * @return 0 on success, -1 if no other successor is known (succ is kept then).
+ */
+int dht_node_replace_failed_successor(dht_node *node);
+
+/**
+ * Determines whether the given node is the successor that failed recently.
+ * @return 1 if it is, 0 if not.
+ */
+int dht_node_is_failed(dht_node *node, uint16_t id, const struct sockaddr_in *addr);
+
+/**
+ * Finds the node's closest known predecessor of a hash, which messages about
+ * the hash are routed to. That is the finger closest to (but not past) the hash,
+ * or the successor if no finger lies between the node and the hash.
+ * @param node the node to route from.
+ * @param hash the hash to route to.
+ * @return the next hop, NULL if the node has no successor.
+ */
+dht_neighbor* dht_node_next_hop(dht_node *node, uint16_t hash);
+
+/**
+ * Creates a new, empty lookup-cache.
+ * @param capacity The max. number of entries.
+ * @param ttl The time (ms) after which resolved entries expire.
+ * @return The cache, NULL on error.
+ */
+dht_lookup_cache* dht_lookup_cache_create(int capacity, uint64_t ttl);
+
+/**
+ * Frees the given lookup-cache.
+ * @param cache The cache to be freed.
+ */
+void dht_lookup_cache_free(dht_lookup_cache *cache);
+
+/**
+ * Marks a lookup for the given hash as outstanding in the DHT Node's lookup-cache.
+ * When the cache is full, the least recently used entry is evicted.
  * @param node The node who's lookup-cache is to be used.
  * @param hash The hash to add.
- * @return 0 on success, -1 on error.
+ * @return 0 if the lookup has to be sent, 1 if one has been sent less than LOOKUP_TIMEOUT ms ago.
  */
 short dht_lookup_cache_add_hash(dht_node *node, uint16_t hash);
 
 /**
- * Finds an entry in the node's lookup-cache that has a hash but no associated node.
- * @param node The node who's lookup-cache to search.
- * @return The cache-entry's index on success, -1 if no such entry could be found.
+ * Resolves all outstanding lookups in the node's lookup-cache whose hash lies in the interval (from, to],
+ * i.e. the ones the given node is responsible for. Resolved entries in the interval are updated as well.
+ * @param node The node who's lookup-cache is to be used.
+ * @param from The ID of the responsible node's predecessor.
+ * @param id The ID of the responsible node.
+ * @param addr The address of the responsible node.
+ * @return The number of resolved outstanding lookups.
  */
-int dht_lookup_cache_find_empty(dht_node *node);
+int dht_lookup_cache_resolve(dht_node *node, uint16_t from, uint16_t id, const struct sockaddr_in *addr);
 
 /**
  * Finds a lookup-cache entry by hash and returns the associated node.
+ * Counts as a use of the entry (for LRU) and as a hit or miss.
  * @param node The node who's lookup-cache to search.
  * @param hash The hash to search for.
  * @return The node corresponding to the hash,
- * NULL if the hash is not in the cache or when it has no associated node.
+ * NULL if the hash is not in the cache, its lookup is still outstanding or its entry has expired.
  */
 dht_neighbor* dht_lookup_cache_find_node(dht_node *node, uint16_t hash);
 
+/**
+ * Drops all resolved entries of the node's lookup-cache, e.g. when the node's neighborhood has changed.
+ * Outstanding lookups are kept.
+ * @param node The node who's lookup-cache is to be invalidated.
+ */
+void dht_lookup_cache_invalidate(dht_node *node);
+
 #endif //RN_PRAXIS_DHT_H
@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include "event.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+event_loop *event_loop_create(event_backend backend) {
+    event_loop *loop = calloc(1, sizeof(event_loop));
+    if (loop == NULL) return NULL;
+
+    loop->epoll_fd = -1;
+    loop->ready = calloc(EVENT_MAX_BATCH, sizeof(event));
+    if (loop->ready == NULL) {
+        free(loop);
+        return NULL;
+    }
+
+#ifdef __linux__
+    if (backend == EVENT_BACKEND_EPOLL) {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) perror("epoll_create1, falling back to poll");
+    }
+#endif
+
+    if (loop->epoll_fd >= 0) {
+        loop->backend = EVENT_BACKEND_EPOLL;
+        return loop;
+    }
+
+    loop->backend = EVENT_BACKEND_POLL;
+    loop->cap_pollfds = EVENT_INITIAL_CAPACITY;
+    loop->pollfds = calloc(loop->cap_pollfds, sizeof(struct pollfd));
+    loop->cap_poll_index = EVENT_INITIAL_CAPACITY;
+    loop->poll_index = calloc(loop->cap_poll_index, sizeof(int));
+
+    if (loop->pollfds == NULL || loop->poll_index == NULL) {
+        event_loop_free(loop);
+        return NULL;
+    }
+
+    for (int i = 0; i < loop->cap_poll_index; i++) loop->poll_index[i] = -1;
+
+    return loop;
+}
+
+#ifdef __linux__
+/**
+ * Translates poll-style events into an epoll event mask.
+ */
+static uint32_t event_to_epoll(short events, int edge_triggered) {
+    uint32_t ev = 0;
+    if (events & POLLIN) ev |= EPOLLIN | EPOLLRDHUP;
+    if (events & POLLOUT) ev |= EPOLLOUT;
+    if (edge_triggered) ev |= EPOLLET;
+
+    return ev;
+}
+
+/**
+ * Translates an epoll event mask into poll-style events.
+ */
+static short event_from_epoll(uint32_t ev) {
+    short events = 0;
+    if (ev & EPOLLIN) events |= POLLIN;
+    if (ev & EPOLLOUT) events |= POLLOUT;
+    if (ev & EPOLLERR) events |= POLLERR;
+    if (ev & (EPOLLHUP | EPOLLRDHUP)) events |= POLLHUP;
+
+    return events;
+}
+
+/**
+ * Performs an epoll_ctl operation with poll-style events.
+ */
+static int event_epoll_ctl(event_loop *loop, int op, int fd, short events, int edge_triggered) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = event_to_epoll(events, edge_triggered);
+    ev.data.fd = fd;
+
+    return epoll_ctl(loop->epoll_fd, op, fd, &ev);
+}
+#endif
+
+int event_loop_add(event_loop *loop, int fd, short events, int edge_triggered) {
+    if (fd < 0) return -1;
+
+#ifdef __linux__
+    if (loop->backend == EVENT_BACKEND_EPOLL) {
+        return event_epoll_ctl(loop, EPOLL_CTL_ADD, fd, events, edge_triggered);
+    }
+#endif
+
+    // growing the fd -> index map
+    if (fd >= loop->cap_poll_index) {
+        int new_cap = loop->cap_poll_index;
+        while (new_cap <= fd) new_cap *= 2;
+
+        int *new_index = realloc(loop->poll_index, new_cap * sizeof(int));
+        if (new_index == NULL) return -1;
+
+        for (int i = loop->cap_poll_index; i < new_cap; i++) new_index[i] = -1;
+        loop->poll_index = new_index;
+        loop->cap_poll_index = new_cap;
+    }
+
+    if (loop->poll_index[fd] != -1) return -1; // already registered
+
+    // growing the pollfd array
+    if (loop->num_pollfds == loop->cap_pollfds) {
+        struct pollfd *new_pollfds = realloc(loop->pollfds, 2 * loop->cap_pollfds * sizeof(struct pollfd));
+        if (new_pollfds == NULL) return -1;
+
+        loop->pollfds = new_pollfds;
+        loop->cap_pollfds *= 2;
+    }
+
+    struct pollfd *pfd = &(loop->pollfds[loop->num_pollfds]);
+    pfd->fd = fd;
+    pfd->events = events;
+    pfd->revents = 0;
+    loop->poll_index[fd] = loop->num_pollfds;
+    loop->num_pollfds++;
+
+    return 0;
+}
+
+int event_loop_modify(event_loop *loop, int fd, short events, int edge_triggered) {
+    if (fd < 0) return -1;
+
+#ifdef __linux__
+    if (loop->backend == EVENT_BACKEND_EPOLL) {
+        return event_epoll_ctl(loop, EPOLL_CTL_MOD, fd, events, edge_triggered);
+    }
+#endif
+
+    if (fd >= loop->cap_poll_index || loop->poll_index[fd] == -1) return -1;
+
+    loop->pollfds[loop->poll_index[fd]].events = events;
+    return 0;
+}
+
+int event_loop_remove(event_loop *loop, int fd) {
+    if (fd < 0) return -1;
+
+#ifdef __linux__
+    if (loop->backend == EVENT_BACKEND_EPOLL) {
+        return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+#endif
+
+    if (fd >= loop->cap_poll_index || loop->poll_index[fd] == -1) return -1;
+
+    // moving the last entry into the freed spot to keep the array dense
+    int i = loop->poll_index[fd];
+    int last = loop->num_pollfds - 1;
+    if (i != last) {
+        loop->pollfds[i] = loop->pollfds[last];
+        loop->poll_index[loop->pollfds[i].fd] = i;
+    }
+
+    loop->poll_index[fd] = -1;
+    loop->num_pollfds--;
+
+    return 0;
+}
+
+int event_loop_wait(event_loop *loop, int timeout_ms, event **ready) {
+    *ready = loop->ready;
+
+#ifdef __linux__
+    if (loop->backend == EVENT_BACKEND_EPOLL) {
+        struct epoll_event evs[EVENT_MAX_BATCH];
+
+        int n = epoll_wait(loop->epoll_fd, evs, EVENT_MAX_BATCH, timeout_ms);
+        if (n < 0) return -1;
+
+        for (int i = 0; i < n; i++) {
+            loop->ready[i].fd = evs[i].data.fd;
+            loop->ready[i].events = event_from_epoll(evs[i].events);
+        }
+
+        return n;
+    }
+#endif
+
+    int n = poll(loop->pollfds, loop->num_pollfds, timeout_ms);
+    if (n <= 0) return n;
+
+    int num_ready = 0;
+    for (int i = 0; i < loop->num_pollfds && num_ready < EVENT_MAX_BATCH; i++) {
+        if (loop->pollfds[i].revents == 0) continue;
+
+        loop->ready[num_ready].fd = loop->pollfds[i].fd;
+        loop->ready[num_ready].events = loop->pollfds[i].revents;
+        num_ready++;
+    }
+
+    return num_ready;
+}
+
+int event_wakeup_create(int *read_fd, int *write_fd) {
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) return -1;
+
+    *read_fd = fd;
+    *write_fd = fd;
+    return 0;
+#else
+    int fds[2];
+    if (pipe(fds) < 0) return -1;
+
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    *read_fd = fds[0];
+    *write_fd = fds[1];
+    return 0;
+#endif
+}
+
+void event_wakeup_signal(int write_fd) {
+    // a full eventfd / pipe is already readable, so a failed write loses nothing
+    uint64_t one = 1;
+    ssize_t n = write(write_fd, &one, sizeof(one));
+    (void) n;
+}
+
+void event_wakeup_drain(int read_fd) {
+    uint64_t buf[16];
+    while (read(read_fd, buf, sizeof(buf)) > 0);
+}
+
+void event_wakeup_free(int read_fd, int write_fd) {
+    close(read_fd);
+    if (write_fd != read_fd) close(write_fd);
+}
+
+void event_loop_free(event_loop *loop) {
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+
+    free(loop->pollfds);
+    free(loop->poll_index);
+    free(loop->ready);
+    free(loop);
+}
@@ -0,0 +1,107 @@
+#ifndef RN_PRAXIS_EVENT_H
+#define RN_PRAXIS_EVENT_H
+
+#include <poll.h>
+
+#define EVENT_MAX_BATCH 256 // Max. number of ready events returned by one event_loop_wait
+#define EVENT_INITIAL_CAPACITY 64
+
+typedef enum event_backend {
+    EVENT_BACKEND_EPOLL,
+    EVENT_BACKEND_POLL
+} event_backend;
+
+/**
+ * A single readiness-notification.
+ * The events use the poll-constants (POLLIN, POLLOUT, POLLERR, POLLHUP) regardless of the backend.
+ */
+typedef struct event {
+    int fd;
+    short events;
+} event;
+
+typedef struct event_loop {
+    event_backend backend;
+    int epoll_fd;
+    // poll-fallback: dense array of registered fds and an index from fd to position in that array
+    struct pollfd *pollfds;
+    int num_pollfds;
+    int cap_pollfds;
+    int *poll_index; // indexed by fd, -1 if the fd is not registered
+    int cap_poll_index;
+    // Buffer of ready events filled by event_loop_wait. Length: EVENT_MAX_BATCH
+    event *ready;
+} event_loop;
+
+/**
+ * Creates a new event loop.
+ * When the epoll backend is requested but not available, the poll backend is used instead.
+ * @param backend the preferred backend.
+ * @return the event loop, NULL on error.
+ */
+event_loop *event_loop_create(event_backend backend);
+
+/**
+ * Registers a file descriptor with the event loop.
+ * @param loop the event loop.
+ * @param fd the file descriptor to watch.
+ * @param events the events of interest (POLLIN and/or POLLOUT).
+ * @param edge_triggered 1 if the fd should only be reported on state changes (epoll only, ignored by poll),
+ * in which case the caller has to drain the fd until EAGAIN.
+ * @return 0 on success, -1 on error.
+ */
+int event_loop_add(event_loop *loop, int fd, short events, int edge_triggered);
+
+/**
+ * Changes the events of interest of an already registered file descriptor.
+ * @return 0 on success, -1 on error.
+ */
+int event_loop_modify(event_loop *loop, int fd, short events, int edge_triggered);
+
+/**
+ * Unregisters a file descriptor from the event loop. The fd is not closed.
+ * @return 0 on success, -1 on error.
+ */
+int event_loop_remove(event_loop *loop, int fd);
+
+/**
+ * Waits for events on the registered file descriptors.
+ * @param loop the event loop.
+ * @param timeout_ms max. time to wait in milliseconds, -1 to wait indefinitely.
+ * @param ready is set to the loop's buffer of ready events.
+ * @return the number of ready events (0 on timeout), -1 on error.
+ */
+int event_loop_wait(event_loop *loop, int timeout_ms, event **ready);
+
+/**
+ * Creates a wakeup channel, through which other threads can interrupt an event_loop_wait:
+ * writing to write_fd makes read_fd readable. On Linux both are the same eventfd,
+ * elsewhere they are the two ends of a pipe. Both are non-blocking.
+ * @param read_fd is set to the descriptor to be watched for POLLIN.
+ * @param write_fd is set to the descriptor to be signaled.
+ * @return 0 on success, -1 on error.
+ */
+int event_wakeup_create(int *read_fd, int *write_fd);
+
+/**
+ * Makes the read end of a wakeup channel readable. Safe to call from any thread.
+ */
+void event_wakeup_signal(int write_fd);
+
+/**
+ * Consumes all pending signals of a wakeup channel, so its read end is no longer readable.
+ */
+void event_wakeup_drain(int read_fd);
+
+/**
+ * Closes a wakeup channel created with event_wakeup_create.
+ */
+void event_wakeup_free(int read_fd, int write_fd);
+
+/**
+ * Frees the given event loop. Registered file descriptors are not closed.
+ * @param loop the event loop to be freed.
+ */
+void event_loop_free(event_loop *loop);
+
+#endif //RN_PRAXIS_EVENT_H
@@ -22,37 +22,133 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "./filesystem.h"
 
-file_system* fs_create(uint32_t size) {
-	file_system* new_fs = calloc(1, sizeof(file_system));
-	if (new_fs == NULL) exit(1);
+/*
+	* Offsets of the structures within the region, each aligned to a cache line
+	* (the data blocks to a page)
+*/
+typedef struct fs_layout {
+	size_t block_bitmap;
+	size_t inode_bitmap;
+	size_t inodes;
+	size_t name_index;
+	size_t data_blocks;
+	size_t total;
+} fs_layout;
 
-	new_fs->s_block = calloc(1, sizeof(superblock));
-	if(new_fs->s_block == NULL) exit(1);
+#define FS_ALIGN(x, a) (((x) + (a) - 1) / (a) * (a))
 
-	new_fs->s_block->num_blocks = size;
-	new_fs->s_block->free_blocks = size;
-	
-	// Create free list and set every entry to 1 (= free block)
-	new_fs->free_list = calloc(1, size);
-	if (new_fs->free_list == NULL) exit(1);
+static uint32_t fs_name_index_slots(uint32_t size) {
+	// at least twice as many slots as inodes (load factor <= 0.5)
+	uint32_t slots = 2;
+	while (slots < 2 * size) slots *= 2;
+	return slots;
+}
+
+static fs_layout fs_compute_layout(uint32_t size) {
+	size_t bitmap_bytes = (size_t) (size + 63) / 64 * sizeof(uint64_t);
+
+	fs_layout l;
+	l.block_bitmap = FS_ALIGN(sizeof(superblock), 64);
+	l.inode_bitmap = FS_ALIGN(l.block_bitmap + bitmap_bytes, 64);
+	l.inodes = FS_ALIGN(l.inode_bitmap + bitmap_bytes, 64);
+	l.name_index = FS_ALIGN(l.inodes + (size_t) size * sizeof(inode), 64);
+	l.data_blocks = FS_ALIGN(l.name_index + (size_t) fs_name_index_slots(size) * sizeof(int), 4096);
+	l.total = l.data_blocks + (size_t) size * sizeof(data_block);
+	return l;
+}
+
+size_t fs_region_size(uint32_t size) {
+	return fs_compute_layout(size).total;
+}
+
+file_system *fs_attach(uint8_t *region, size_t region_size) {
+	superblock *s_block = (superblock *) region;
+	if (region_size < sizeof(superblock) || s_block->magic != FS_MAGIC || s_block->version != FS_VERSION) return NULL;
+	if (s_block->num_blocks == 0 || fs_region_size(s_block->num_blocks) != region_size) return NULL;
+
+	file_system* fs = calloc(1, sizeof(file_system));
+	if (fs == NULL) return NULL;
+
+	uint32_t size = s_block->num_blocks;
+	fs_layout l = fs_compute_layout(size);
+
+	fs->region = region;
+	fs->region_size = region_size;
+	fs->s_block = s_block;
+	fs->bitmap_words = (size + 63) / 64;
+	fs->block_bitmap = (uint64_t *) (region + l.block_bitmap);
+	fs->inode_bitmap = (uint64_t *) (region + l.inode_bitmap);
+	fs->inodes = (inode *) (region + l.inodes);
+	fs->name_index = (int *) (region + l.name_index);
+	fs->name_index_mask = fs_name_index_slots(size) - 1;
+	fs->data_blocks = (data_block *) (region + l.data_blocks);
+	fs->root_node = 0;
+	fs->log_fd = -1;
+
+	// generations continue after the highest one in the region, so they identify a version across restarts
+	for (uint32_t i=0; i<size; i++) {
+		if (fs->inodes[i].generation > fs->generation) fs->generation = fs->inodes[i].generation;
+	}
+
+	fs->epoch = 1;
+	fs->cow_node = -1;
+	fs->readers = aligned_alloc(64, FS_MAX_READERS * sizeof(fs_reader));
+	fs->pins = calloc(size, sizeof(uint32_t));
+	fs->block_txn = calloc(size, sizeof(uint32_t));
+	if (fs->readers == NULL || fs->pins == NULL || fs->block_txn == NULL || pthread_rwlock_init(&(fs->lock), NULL) != 0) {
+		free(fs->readers);
+		free(fs->pins);
+		free(fs->block_txn);
+		free(fs);
+		return NULL;
+	}
+	memset(fs->readers, 0, FS_MAX_READERS * sizeof(fs_reader));
+
+	return fs;
+}
+
+file_system* fs_create(uint32_t size) {
+	// one anonymous mapping for all structures, its pages are only backed once touched
+	size_t region_size = fs_region_size(size);
+	uint8_t *region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (region == MAP_FAILED) exit(1);
 
-	for (int i=0; i<size; i++) new_fs->free_list[i] = 1;
+	superblock *s_block = (superblock *) region;
+	s_block->magic = FS_MAGIC;
+	s_block->version = FS_VERSION;
+	s_block->num_blocks = size;
+	s_block->free_blocks = size;
+	s_block->checkpoint = 0;
 
-	// Create Inodes and initialize them
-	new_fs->inodes = calloc(size, sizeof(inode));
-	if(new_fs->inodes == NULL) exit(1);
+	file_system* new_fs = fs_attach(region, region_size);
+	if (new_fs == NULL) exit(1);
+	
+	// Set the bit of every block / inode to 1 (= free)
+	for (uint32_t i=0; i<size/64; i++) {
+		new_fs->block_bitmap[i] = UINT64_MAX;
+		new_fs->inode_bitmap[i] = UINT64_MAX;
+	}
+	if (size % 64 != 0) {
+		// bits beyond the last block stay 0, so they are never handed out
+		new_fs->block_bitmap[size/64] = (UINT64_C(1) << (size % 64)) - 1;
+		new_fs->inode_bitmap[size/64] = (UINT64_C(1) << (size % 64)) - 1;
+	}
 
-	for (int i=0; i<size; i++) inode_init(&(new_fs->inodes[i]));
+	// Initialize inodes
+	for (uint32_t i=0; i<size; i++) inode_init(&(new_fs->inodes[i]));
 	
 	// First inode = Root ('/')
+	new_fs->inode_bitmap[0] &= ~UINT64_C(1);
 	new_fs->inodes[0].n_type = dir;
 	strncpy(new_fs->inodes[0].name,"/",NAME_MAX_LENGTH);
-	new_fs->root_node = 0;
 
-	new_fs->data_blocks = calloc(size,sizeof(data_block));
-	if(new_fs->data_blocks == NULL) exit(1);
+	// Empty name index
+	memset(new_fs->name_index, -1, (size_t) (new_fs->name_index_mask + 1) * sizeof(int));
 
 	return new_fs;
 }
@@ -62,21 +158,655 @@ void inode_init(inode *i) {
 	i->size=0;
 	memset(i->name,0,NAME_MAX_LENGTH);
 	memset(i->direct_blocks, -1, DIRECT_BLOCKS_COUNT*sizeof(int));
+	i->indirect_block = -1;
+	i->double_indirect_block = -1;
 	i->parent = -1; //meaning it has no parent
+	i->slot = 0;
 }
 
-int find_free_inode(file_system *fs) {
-	for (int i=0; i<fs->s_block->num_blocks; i++) {
-		if(fs->inodes[i].n_type==free_block) return i;
+/*
+	* Finds a set bit in a bitmap, clears it and returns its index or -1 if no bit is set.
+	* The search starts at word *hint (next fit) and updates it.
+*/
+static int fs_bitmap_take(uint64_t *bitmap, uint32_t num_words, uint32_t *hint) {
+	for (uint32_t n=0; n<num_words; n++) {
+		uint32_t w = (*hint + n) % num_words;
+		if (bitmap[w] == 0) continue;
+
+		int bit = __builtin_ctzll(bitmap[w]);
+		bitmap[w] &= bitmap[w] - 1; // clearing the lowest set bit
+		*hint = w;
+		return (int) (w * 64 + bit);
 	}
 
 	return -1;
 }
 
+int fs_alloc_inode(file_system *fs) {
+	return fs_bitmap_take(fs->inode_bitmap, fs->bitmap_words, &(fs->inode_hint));
+}
+
+void fs_free_inode(file_system *fs, int inode_index) {
+	inode_init(&(fs->inodes[inode_index]));
+	fs->inode_bitmap[inode_index / 64] |= UINT64_C(1) << (inode_index % 64);
+}
+
+int fs_alloc_block(file_system *fs) {
+	int block_index = fs_bitmap_take(fs->block_bitmap, fs->bitmap_words, &(fs->block_hint));
+	if (block_index != -1) {
+		fs->s_block->free_blocks--;
+		fs->block_txn[block_index] = fs->txn;
+	}
+
+	return block_index;
+}
+
+/*
+	* Returns 1 if a block may be written in place, 0 if the current copy-on-write change has to copy it
+*/
+static int fs_block_private(file_system *fs, int block_index) {
+	return fs->cow_node == -1 || fs->block_txn[block_index] == fs->txn;
+}
+
+/*
+	* Adds an entry to the list of retired things. Entries of a copy-on-write change
+	* only get their epoch once the change is published
+*/
+static void fs_retire(file_system *fs, int ino, int block) {
+	if (fs->num_retired == fs->retired_capacity) {
+		size_t new_capacity = fs->retired_capacity ? 2 * fs->retired_capacity : 64;
+		fs_retired *new_retired = realloc(fs->retired, new_capacity * sizeof(fs_retired));
+		if (new_retired == NULL) {
+			// leaking is the only safe option left, the space comes back with the next restart from an image
+			perror("Could not retire");
+			return;
+		}
+
+		fs->retired = new_retired;
+		fs->retired_capacity = new_capacity;
+	}
+
+	fs_retired *r = &(fs->retired[fs->num_retired++]);
+	r->epoch = UINT64_MAX;
+	r->ino = ino;
+	r->block = block;
+	r->successor = -1;
+}
+
+/*
+	* Stamps all unpublished retired entries with the current epoch and starts a new one.
+	* Called after a change has been published, so readers that start from now on can't reach them
+*/
+static void fs_retire_publish(file_system *fs) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t epoch = __atomic_load_n(&(fs->epoch), __ATOMIC_RELAXED);
+
+	for (size_t i=fs->num_retired; i>0 && fs->retired[i-1].epoch == UINT64_MAX; i--) fs->retired[i-1].epoch = epoch;
+	__atomic_store_n(&(fs->epoch), epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+void fs_free_block(file_system *fs, int block_index) {
+	// a block shared with the previous version of the file may still be read through it
+	if (!fs_block_private(fs, block_index)) {
+		fs_retire(fs, fs->cow_node, block_index);
+		return;
+	}
+
+	fs->block_bitmap[block_index / 64] |= UINT64_C(1) << (block_index % 64);
+	fs->s_block->free_blocks++;
+}
+
+/*
+	* Allocates the data-block goal if it is free, any free data-block otherwise
+*/
+static int fs_alloc_block_near(file_system *fs, int goal) {
+	if (goal >= 0 && (uint32_t) goal < fs->s_block->num_blocks) {
+		uint64_t bit = UINT64_C(1) << (goal % 64);
+		if (fs->block_bitmap[goal / 64] & bit) {
+			fs->block_bitmap[goal / 64] &= ~bit;
+			fs->s_block->free_blocks--;
+			fs->block_txn[goal] = fs->txn;
+			return goal;
+		}
+	}
+
+	return fs_alloc_block(fs);
+}
+
+static int32_t *fs_pointers(file_system *fs, int block_index) {
+	return (int32_t *) fs->data_blocks[block_index].block;
+}
+
+/*
+	* Returns the entries of the indirect block *ptr references, ready to be changed:
+	* during a copy-on-write change a block shared with the previous version is copied first (updating *ptr).
+	* Returns NULL if no block is available for the copy
+*/
+static int32_t *fs_pointers_mut(file_system *fs, int *ptr) {
+	if (!fs_block_private(fs, *ptr)) {
+		int copy = fs_alloc_block(fs);
+		if (copy == -1) return NULL;
+
+		memcpy(fs->data_blocks[copy].block, fs->data_blocks[*ptr].block, BLOCK_SIZE);
+		fs_free_block(fs, *ptr);
+		*ptr = copy;
+	}
+
+	return fs_pointers(fs, *ptr);
+}
+
+/*
+	* Makes sure *ptr references an indirect block (all entries -1 when new).
+	* Returns 0 on success, -1 if it doesn't exist and alloc isn't set or no block is available
+*/
+static int fs_pointer_block(file_system *fs, int *ptr, int alloc) {
+	if (*ptr != -1) return 0;
+	if (!alloc) return -1;
+
+	int block_index = fs_alloc_block(fs);
+	if (block_index == -1) return -1;
+
+	memset(fs->data_blocks[block_index].block, 0xff, BLOCK_SIZE);
+	*ptr = block_index;
+	return 0;
+}
+
+enum fs_slot_mode {
+	FS_SLOT_READ, //the slot is only read
+	FS_SLOT_CHANGE, //the slot is going to be changed, missing indirect blocks aren't allocated
+	FS_SLOT_ALLOC //the slot is going to be changed, missing indirect blocks are allocated
+};
+
+/*
+	* Returns the entries of the indirect block *ptr references (see fs_slot_mode), NULL if there is none
+*/
+static int32_t *fs_pointers_for(file_system *fs, int *ptr, enum fs_slot_mode mode) {
+	if (fs_pointer_block(fs, ptr, mode == FS_SLOT_ALLOC) < 0) return NULL;
+	return (mode == FS_SLOT_READ) ? fs_pointers(fs, *ptr) : fs_pointers_mut(fs, ptr);
+}
+
+/*
+	* Returns a pointer to the slot holding the block number of logical block n of a node,
+	* NULL if n is out of range or an indirect block is missing (and can't be allocated in mode FS_SLOT_ALLOC)
+*/
+static int *fs_block_slot(file_system *fs, inode *node, uint64_t n, enum fs_slot_mode mode) {
+	if (n < DIRECT_BLOCKS_COUNT) return &(node->direct_blocks[n]);
+	n -= DIRECT_BLOCKS_COUNT;
+
+	if (n < POINTERS_PER_BLOCK) {
+		int32_t *pointers = fs_pointers_for(fs, &(node->indirect_block), mode);
+		return (pointers == NULL) ? NULL : pointers + n;
+	}
+	n -= POINTERS_PER_BLOCK;
+
+	if (n < POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) {
+		int32_t *indirect = fs_pointers_for(fs, &(node->double_indirect_block), mode);
+		if (indirect == NULL) return NULL;
+
+		int32_t *pointers = fs_pointers_for(fs, indirect + n / POINTERS_PER_BLOCK, mode);
+		return (pointers == NULL) ? NULL : pointers + n % POINTERS_PER_BLOCK;
+	}
+
+	return NULL;
+}
+
+int fs_block_index(file_system *fs, inode *node, uint64_t n, int alloc) {
+	int *slot = fs_block_slot(fs, node, n, alloc ? FS_SLOT_ALLOC : FS_SLOT_READ);
+	if (slot == NULL) return -1;
+	if (!alloc || (*slot != -1 && fs_block_private(fs, *slot))) return *slot;
+
+	// placing the block right behind its predecessor keeps the contents contiguous
+	int goal = -1;
+	if (n > 0) {
+		int prev = fs_block_index(fs, node, n - 1, 0);
+		if (prev != -1) goal = prev + 1;
+	}
+
+	int block_index = fs_alloc_block_near(fs, goal);
+	if (block_index == -1) return -1;
+
+	if (*slot == -1) {
+		memset(fs->data_blocks[block_index].block, 0, BLOCK_SIZE);
+	} else {
+		// the block is shared with the previous version of the file, which keeps the original
+		memcpy(fs->data_blocks[block_index].block, fs->data_blocks[*slot].block, BLOCK_SIZE);
+		fs_free_block(fs, *slot);
+	}
+
+	*slot = block_index;
+	return block_index;
+}
+
+void fs_free_blocks_from(file_system *fs, inode *node, uint64_t n) {
+	uint64_t used = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (uint64_t i=n; i<used; i++) {
+		int *slot = fs_block_slot(fs, node, i, FS_SLOT_CHANGE);
+		if (slot == NULL || *slot == -1) continue;
+
+		fs_free_block(fs, *slot);
+		*slot = -1;
+	}
+
+	// freeing the indirect blocks that don't reference any block anymore
+	if (n <= DIRECT_BLOCKS_COUNT && node->indirect_block != -1) {
+		fs_free_block(fs, node->indirect_block);
+		node->indirect_block = -1;
+	}
+
+	if (node->double_indirect_block != -1) {
+		uint64_t first = 0; // first entry of the double indirect block whose blocks are all freed
+		if (n > DIRECT_BLOCKS_COUNT + POINTERS_PER_BLOCK) {
+			first = (n - DIRECT_BLOCKS_COUNT - POINTERS_PER_BLOCK + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK;
+		}
+
+		// a double indirect block that is freed as a whole doesn't have to be changed
+		int32_t *indirect = (first == 0) ? fs_pointers(fs, node->double_indirect_block) : fs_pointers_mut(fs, &(node->double_indirect_block));
+		for (uint64_t i=first; indirect != NULL && i<POINTERS_PER_BLOCK; i++) {
+			if (indirect[i] == -1) continue;
+
+			fs_free_block(fs, indirect[i]);
+			if (first > 0) indirect[i] = -1;
+		}
+
+		if (first == 0) {
+			fs_free_block(fs, node->double_indirect_block);
+			node->double_indirect_block = -1;
+		}
+	}
+}
+
+uint32_t fs_dir_count(inode *dir_node) {
+	return dir_node->size / sizeof(int32_t);
+}
+
+/*
+	* Returns a pointer to a dir's k-th entry, NULL if its block doesn't exist
+*/
+static int32_t *fs_dir_entry_ptr(file_system *fs, inode *dir_node, uint32_t k, int alloc) {
+	int block_index = fs_block_index(fs, dir_node, k / POINTERS_PER_BLOCK, alloc);
+	if (block_index == -1) return NULL;
+
+	return fs_pointers(fs, block_index) + k % POINTERS_PER_BLOCK;
+}
+
+int fs_dir_entry(file_system *fs, inode *dir_node, uint32_t k) {
+	int32_t *entry = fs_dir_entry_ptr(fs, dir_node, k, 0);
+	return (entry == NULL) ? -1 : *entry;
+}
+
+int fs_dir_add(file_system *fs, int dir_index, int child_index) {
+	inode *dir_node = &(fs->inodes[dir_index]);
+	uint32_t k = fs_dir_count(dir_node);
+
+	int32_t *entry = fs_dir_entry_ptr(fs, dir_node, k, 1);
+	if (entry == NULL) return -1;
+
+	*entry = child_index;
+	fs->inodes[child_index].slot = k;
+	dir_node->size += sizeof(int32_t);
+	return 0;
+}
+
+void fs_dir_remove(file_system *fs, int child_index) {
+	inode *child = &(fs->inodes[child_index]);
+	if (child->parent == -1) return;
+
+	inode *dir_node = &(fs->inodes[child->parent]);
+	uint32_t last = fs_dir_count(dir_node) - 1;
+
+	// moving the last entry into the freed slot keeps the list dense
+	if (child->slot != last) {
+		int moved = fs_dir_entry(fs, dir_node, last);
+		*fs_dir_entry_ptr(fs, dir_node, child->slot, 0) = moved;
+		fs->inodes[moved].slot = child->slot;
+	}
+
+	uint64_t new_size = (uint64_t) last * sizeof(int32_t);
+	fs_free_blocks_from(fs, dir_node, (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	dir_node->size = new_size;
+}
+
+/*
+	* FNV-1a hash of a directory entry (parent inode number & name)
+*/
+static uint32_t fs_index_hash(int parent, const char *name, size_t name_len) {
+	uint32_t h = 2166136261u;
+	for (size_t i=0; i<sizeof(int); i++) {
+		h ^= (uint8_t) (parent >> (8 * i));
+		h *= 16777619u;
+	}
+	for (size_t i=0; i<name_len; i++) {
+		h ^= (uint8_t) name[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static uint32_t fs_index_slot(file_system *fs, int inode_index) {
+	inode *node = &(fs->inodes[inode_index]);
+	return fs_index_hash(node->parent, node->name, strlen(node->name)) & fs->name_index_mask;
+}
+
+/*
+	* Slots of the name index are read by lock-free readers, so they are accessed atomically
+*/
+static int fs_index_get(file_system *fs, uint32_t slot) {
+	return __atomic_load_n(&(fs->name_index[slot]), __ATOMIC_RELAXED);
+}
+
+static void fs_index_set(file_system *fs, uint32_t slot, int inode_index) {
+	__atomic_store_n(&(fs->name_index[slot]), inode_index, __ATOMIC_RELAXED);
+}
+
+/*
+	* Makes index_seq odd before the name index is changed, so concurrent readers retry
+*/
+static void fs_index_write_begin(file_system *fs) {
+	__atomic_store_n(&(fs->index_seq), fs->index_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void fs_index_write_end(file_system *fs) {
+	__atomic_store_n(&(fs->index_seq), fs->index_seq + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t fs_index_read_begin(file_system *fs) {
+	uint32_t seq;
+	while ((seq = __atomic_load_n(&(fs->index_seq), __ATOMIC_ACQUIRE)) & 1) sched_yield();
+	return seq;
+}
+
+int fs_index_read_valid(file_system *fs, uint32_t seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&(fs->index_seq), __ATOMIC_RELAXED) == seq;
+}
+
+int fs_index_find(file_system *fs, int parent, const char *name, size_t name_len) {
+	if (name_len == 0 || name_len >= NAME_MAX_LENGTH) return -1;
+
+	uint32_t slot = fs_index_hash(parent, name, name_len) & fs->name_index_mask;
+	for (uint32_t n=0; n<=fs->name_index_mask; n++) {
+		int index = fs_index_get(fs, slot);
+		if (index == -1) break;
+
+		inode *node = &(fs->inodes[index]);
+		if (node->parent == parent && strncmp(node->name, name, name_len) == 0 && node->name[name_len] == '\0') {
+			return index;
+		}
+
+		slot = (slot + 1) & fs->name_index_mask;
+	}
+
+	return -1;
+}
+
+void fs_index_insert(file_system *fs, int inode_index) {
+	uint32_t slot = fs_index_slot(fs, inode_index);
+	while (fs->name_index[slot] != -1) slot = (slot + 1) & fs->name_index_mask;
+
+	fs_index_write_begin(fs);
+	fs_index_set(fs, slot, inode_index);
+	fs_index_write_end(fs);
+}
+
+/*
+	* Returns the slot of an inode in the name index, -1 if it isn't indexed
+*/
+static int64_t fs_index_position(file_system *fs, int inode_index) {
+	uint32_t slot = fs_index_slot(fs, inode_index);
+	while (fs->name_index[slot] != inode_index) {
+		if (fs->name_index[slot] == -1) return -1;
+		slot = (slot + 1) & fs->name_index_mask;
+	}
+
+	return slot;
+}
+
+void fs_index_remove(file_system *fs, int inode_index) {
+	int64_t slot = fs_index_position(fs, inode_index);
+	if (slot == -1) return;
+
+	fs_index_write_begin(fs);
+
+	// shifting following entries back into the gap, so no probe sequence is interrupted (no tombstones needed)
+	uint32_t gap = slot;
+	uint32_t next = (gap + 1) & fs->name_index_mask;
+	while (fs->name_index[next] != -1) {
+		uint32_t home = fs_index_slot(fs, fs->name_index[next]);
+
+		// the entry may only move to the gap if the gap lies between its home slot and its current slot
+		if (((next - home) & fs->name_index_mask) >= ((next - gap) & fs->name_index_mask)) {
+			fs_index_set(fs, gap, fs->name_index[next]);
+			gap = next;
+		}
+
+		next = (next + 1) & fs->name_index_mask;
+	}
+
+	fs_index_set(fs, gap, -1);
+	fs_index_write_end(fs);
+}
+
+/*
+	* Lets new_index take index's place in its parent's list of children and in the name index
+*/
+static void fs_swap_node(file_system *fs, int index, int new_index) {
+	inode *node = &(fs->inodes[index]);
+	inode *new_node = &(fs->inodes[new_index]);
+
+	new_node->parent = node->parent;
+	memcpy(new_node->name, node->name, NAME_MAX_LENGTH);
+	new_node->slot = node->slot;
+	*fs_dir_entry_ptr(fs, &(fs->inodes[node->parent]), node->slot, 0) = new_index;
+
+	// the new node has the same parent and name, so it takes the very same slot
+	int64_t slot = fs_index_position(fs, index);
+	fs_index_write_begin(fs);
+	fs_index_set(fs, slot, new_index);
+	fs_index_write_end(fs);
+}
+
+int fs_cow_begin(file_system *fs, int index) {
+	int new_index = fs_alloc_inode(fs);
+	if (new_index == -1) return -1;
+
+	fs->inodes[new_index] = fs->inodes[index];
+	fs->inodes[new_index].generation = ++fs->generation;
+
+	// blocks allocated from now on belong to the new version only
+	if (++fs->txn == 0) {
+		memset(fs->block_txn, 0, fs->s_block->num_blocks * sizeof(uint32_t));
+		fs->txn = 1;
+	}
+	fs->cow_node = index;
+
+	return new_index;
+}
+
+void fs_cow_commit(file_system *fs, int index, int new_index) {
+	fs->cow_node = -1;
+	fs_swap_node(fs, index, new_index);
+
+	// the blocks both versions share are freed with the new version, which has to outlive the old one
+	__atomic_add_fetch(&(fs->pins[new_index]), 1, __ATOMIC_RELAXED);
+	fs_retire(fs, index, FS_RETIRED_NODE);
+	fs->retired[fs->num_retired - 1].successor = new_index;
+
+	fs_retire_publish(fs);
+}
+
+void fs_replace_node(file_system *fs, int index, int new_index) {
+	fs_swap_node(fs, index, new_index);
+	fs_retire(fs, index, FS_RETIRED_NODE_AND_BLOCKS);
+	fs_retire_publish(fs);
+}
+
+void fs_retire_node(file_system *fs, int index) {
+	fs_retire(fs, index, FS_RETIRED_NODE_AND_BLOCKS);
+	fs_retire_publish(fs);
+}
+
+static int fs_num_reader_slots = 0; //fs_reader slots handed out to threads so far (in every fs)
+static _Thread_local int fs_reader_slot = -1; //the calling thread's fs_reader slot
+
+void fs_reclaim(file_system *fs) {
+	if (fs->num_retired == 0 || fs->cow_node != -1) return;
+
+	// the oldest epoch a reader may still be in
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t oldest = UINT64_MAX;
+	int num_readers = __atomic_load_n(&fs_num_reader_slots, __ATOMIC_ACQUIRE);
+	if (num_readers > FS_MAX_READERS) num_readers = FS_MAX_READERS;
+	for (int i=0; i<num_readers; i++) {
+		uint64_t epoch = __atomic_load_n(&(fs->readers[i].epoch), __ATOMIC_ACQUIRE);
+		if (epoch != 0 && epoch < oldest) oldest = epoch;
+	}
+
+	size_t kept = 0;
+	for (size_t i=0; i<fs->num_retired; i++) {
+		fs_retired r = fs->retired[i];
+		if (r.epoch >= oldest || __atomic_load_n(&(fs->pins[r.ino]), __ATOMIC_ACQUIRE) != 0) {
+			fs->retired[kept++] = r;
+			continue;
+		}
+
+		if (r.block >= 0) {
+			fs_free_block(fs, r.block);
+			continue;
+		}
+
+		inode *node = &(fs->inodes[r.ino]);
+		if (r.block == FS_RETIRED_NODE_AND_BLOCKS) fs_free_blocks_from(fs, node, 0);
+		fs_free_inode(fs, r.ino);
+		node->generation = ++fs->generation;
+
+		if (r.successor != -1) __atomic_sub_fetch(&(fs->pins[r.successor]), 1, __ATOMIC_RELEASE);
+	}
+
+	fs->num_retired = kept;
+}
+
+int fs_reclaim_until(file_system *fs, uint32_t free_blocks) {
+	fs_reclaim(fs);
+
+	while (fs->s_block->free_blocks < free_blocks && fs->cow_node == -1) {
+		// what isn't pinned is freed once the readers of older epochs are done, which doesn't take long
+		// (they never wait for writers), what is pinned may take as long as a client does
+		int unpinned = 0;
+		for (size_t i=0; i<fs->num_retired && !unpinned; i++) {
+			unpinned = __atomic_load_n(&(fs->pins[fs->retired[i].ino]), __ATOMIC_ACQUIRE) == 0;
+		}
+		if (!unpinned) break;
+
+		sched_yield();
+		fs_reclaim(fs);
+	}
+
+	return fs->s_block->free_blocks >= free_blocks;
+}
+
+/*
+	* Marks all blocks of a node in a bitmap (as free), returns their number
+*/
+static uint32_t fs_mark_node_blocks(file_system *fs, inode *node, uint64_t *bitmap) {
+	uint32_t marked = 0;
+
+	uint64_t used = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (uint64_t n=0; n<used; n++) {
+		int block_index = fs_block_index(fs, node, n, 0);
+		if (block_index == -1) continue;
+
+		bitmap[block_index / 64] |= UINT64_C(1) << (block_index % 64);
+		marked++;
+	}
+
+	int pointer_blocks[1 + 1 + POINTERS_PER_BLOCK];
+	int num_pointer_blocks = 0;
+	if (node->indirect_block != -1) pointer_blocks[num_pointer_blocks++] = node->indirect_block;
+	if (node->double_indirect_block != -1) {
+		pointer_blocks[num_pointer_blocks++] = node->double_indirect_block;
+
+		int32_t *indirect = fs_pointers(fs, node->double_indirect_block);
+		for (uint32_t i=0; i<POINTERS_PER_BLOCK; i++) {
+			if (indirect[i] != -1) pointer_blocks[num_pointer_blocks++] = indirect[i];
+		}
+	}
+
+	for (int i=0; i<num_pointer_blocks; i++) {
+		bitmap[pointer_blocks[i] / 64] |= UINT64_C(1) << (pointer_blocks[i] % 64);
+		marked++;
+	}
+
+	return marked;
+}
+
+uint32_t fs_retired_mark_free(file_system *fs, uint64_t *block_bitmap, uint64_t *inode_bitmap) {
+	uint32_t marked = 0;
+
+	for (size_t i=0; i<fs->num_retired; i++) {
+		fs_retired *r = &(fs->retired[i]);
+		if (r->block >= 0) {
+			block_bitmap[r->block / 64] |= UINT64_C(1) << (r->block % 64);
+			marked++;
+			continue;
+		}
+
+		inode_bitmap[r->ino / 64] |= UINT64_C(1) << (r->ino % 64);
+		if (r->block == FS_RETIRED_NODE_AND_BLOCKS) marked += fs_mark_node_blocks(fs, &(fs->inodes[r->ino]), block_bitmap);
+	}
+
+	return marked;
+}
+
+void fs_read_begin(file_system *fs) {
+	if (fs_reader_slot == -1) fs_reader_slot = __atomic_fetch_add(&fs_num_reader_slots, 1, __ATOMIC_SEQ_CST);
+
+	// threads beyond FS_MAX_READERS exclude writers instead
+	if (fs_reader_slot >= FS_MAX_READERS) {
+		pthread_rwlock_rdlock(&(fs->lock));
+		return;
+	}
+
+	// writers don't free anything retired in (or after) this epoch until the reader is done
+	fs_reader *reader = &(fs->readers[fs_reader_slot]);
+	__atomic_store_n(&(reader->epoch), __atomic_load_n(&(fs->epoch), __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void fs_read_end(file_system *fs) {
+	if (fs_reader_slot >= FS_MAX_READERS) {
+		pthread_rwlock_unlock(&(fs->lock));
+		return;
+	}
+
+	__atomic_store_n(&(fs->readers[fs_reader_slot].epoch), 0, __ATOMIC_RELEASE);
+}
+
+void fs_pin(file_system *fs, int index) {
+	__atomic_add_fetch(&(fs->pins[index]), 1, __ATOMIC_RELAXED);
+}
+
+void fs_unpin(file_system *fs, int index) {
+	__atomic_sub_fetch(&(fs->pins[index]), 1, __ATOMIC_RELEASE);
+}
+
+void fs_lock_write(file_system *fs) {
+	pthread_rwlock_wrlock(&(fs->lock));
+}
+
+void fs_unlock(file_system *fs) {
+	pthread_rwlock_unlock(&(fs->lock));
+}
+
 void fs_free(file_system *fs){
-	free(fs->s_block);
-	free(fs->inodes);
-	free(fs->free_list);
-	free(fs->data_blocks);
+	pthread_rwlock_destroy(&(fs->lock));
+	free(fs->readers);
+	free(fs->pins);
+	free(fs->block_txn);
+	free(fs->retired);
+	if (fs->log_fd >= 0) close(fs->log_fd);
+	munmap(fs->region, fs->region_size);
+	free(fs->image_path);
 	free(fs);
 }
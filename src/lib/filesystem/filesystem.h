@@ -6,10 +6,19 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #define BLOCK_SIZE 1024
 #define NAME_MAX_LENGTH 32
 #define DIRECT_BLOCKS_COUNT 12
+#define POINTERS_PER_BLOCK (BLOCK_SIZE / sizeof(int32_t)) //block numbers held by an indirect block
+#define MAX_FILE_BLOCKS (DIRECT_BLOCKS_COUNT + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+#define FS_DEFAULT_NUM_BLOCKS 16384 //can be overridden via env FS_NUM_BLOCKS
+#define FS_MAGIC 0x53465052 //identifies a file system region / image ("RPFS")
+#define FS_VERSION 1
+#define FS_MAX_READERS 128 //threads that read without locking, further ones take the lock for reading
+#define FS_RETIRED_NODE -1 //fs_retired.block of a retired node whose blocks live on in its successor
+#define FS_RETIRED_NODE_AND_BLOCKS -2 //fs_retired.block of a retired node that owns all of its blocks
 
 enum node_type{
 	fil=1,
@@ -17,34 +26,104 @@ enum node_type{
 	free_block=3
 };
 
+/*
+ * Data blocks carry no header, so all of them form one contiguous region
+ * and a run of consecutive blocks is one contiguous range of bytes
+ */
 typedef struct data_block {
-	size_t size;
 	uint8_t block[BLOCK_SIZE];
 } data_block;
 
 /*
- * The direct_blocks can either point to other inode, in case this inode is a dir
- * or to data_blocks, in case this is a regular file
+ * Files and dirs both keep their contents in data_blocks: a file its bytes,
+ * a dir the list of its children's inode numbers (int32_t each).
+ * Logical block n of a node is found via direct_blocks (n < 12), the indirect block
+ * or the double indirect block, which hold further block numbers.
  */
 typedef struct inode {
 	enum node_type n_type;
-	uint16_t size;
+	uint64_t size; //length of the contents in bytes
 	char name[NAME_MAX_LENGTH];
 	int direct_blocks[DIRECT_BLOCKS_COUNT]; //Block numbers. -1 if there is no block
+	int indirect_block; //Block number of a block of POINTERS_PER_BLOCK block numbers. -1 if there is none
+	int double_indirect_block; //Block number of a block of POINTERS_PER_BLOCK indirect blocks. -1 if there is none
 	int parent; //inode number of parent
+	uint32_t slot; //position of the node in its parent's list of children
+	uint32_t generation; //changes whenever the node is created, written or removed (not reset by inode_init)
 } inode;
 
+/*
+ * The superblock, bitmaps, inode table, name index and data blocks live in one
+ * contiguous region (in this order) that can be mapped from / written to an image file as is.
+ * Everything in it refers to inodes and blocks by number, never by pointer.
+ */
 typedef struct superblock {
+	uint32_t magic; //FS_MAGIC
+	uint32_t version; //FS_VERSION
 	uint32_t num_blocks;
 	uint32_t free_blocks;
+	uint64_t checkpoint; //number of the checkpoint the region was written by, 0 if never
 } superblock;
 
+/*
+ * Epoch a thread announced when it started reading (fs_read_begin), 0 while it isn't reading.
+ * Padded to a cache line, so readers don't write to each other's lines
+ */
+typedef struct fs_reader {
+	uint64_t epoch;
+	uint8_t padding[56];
+} fs_reader;
+
+/*
+ * A removed or replaced node (or one of its blocks) that readers may still use.
+ * It is freed once every reader has left the epoch it was retired in and nothing pins the node
+ */
+typedef struct fs_retired {
+	uint64_t epoch; //UINT64_MAX until the change that retired it is published
+	int ino; //the node, or the version of a file the block belongs to
+	int block; //FS_RETIRED_NODE, FS_RETIRED_NODE_AND_BLOCKS or the number of a single block
+	int successor; //version of a file that shares the node's blocks (pinned by it), -1 if none
+} fs_retired;
+
+/*
+ * Readers (GET) never lock: they resolve paths under a seqlock on the name index (index_seq),
+ * announce an epoch while they do, and pin the file they are going to send.
+ * Writers serialize on lock and never change a published file: new contents go to a new inode
+ * (copy-on-write, sharing the blocks that stay the same), which takes the old one's place at once.
+ * What the old version used is retired and freed once no reader can reach it anymore.
+ */
 typedef struct file_system {
+	uint8_t * region; //mapping holding all of the structures below
+	size_t region_size;
 	struct superblock* s_block;
-    uint8_t * free_list; //free == 1
+    uint64_t * block_bitmap; //one bit per data-block, free == 1
+    uint64_t * inode_bitmap; //one bit per inode, free == 1
+    uint32_t bitmap_words; //number of words in each bitmap
+    uint32_t block_hint; //word of block_bitmap the next search starts at
+    uint32_t inode_hint; //word of inode_bitmap the next search starts at
     struct inode * inodes;
     struct data_block* data_blocks;
     int root_node; //inode-number of root node
+    uint32_t generation; //last generation handed out to an inode
+    int * name_index; //open-addressing hash table of all inodes but root, keyed by (parent, name). -1 == empty slot
+    uint32_t name_index_mask; //number of slots - 1 (number of slots is a power of 2)
+    pthread_rwlock_t lock; //taken by writers, and by readers that didn't get an fs_reader
+    // persistence (see persistence.h), unused for a purely in-memory fs
+    char * image_path; //NULL if the fs has no image
+    int log_fd; //write-ahead log, -1 if changes aren't logged
+    uint64_t log_size;
+    int log_sync; //1 if every log record is synced to disk before the operation returns
+    // lock-free reading, not part of the region
+    uint64_t epoch; //advanced whenever something is retired, starts at 1
+    fs_reader * readers; //FS_MAX_READERS slots
+    uint32_t index_seq; //odd while the name index is being changed
+    uint32_t * pins; //per inode: readers sending it + newer versions sharing its blocks
+    fs_retired * retired;
+    size_t num_retired;
+    size_t retired_capacity;
+    uint32_t * block_txn; //per data-block: copy-on-write change it was allocated in
+    uint32_t txn; //current (or last) copy-on-write change
+    int cow_node; //node being copied-on-write, -1 if none
 } file_system;
 
 
@@ -57,14 +136,180 @@ typedef struct file_system {
 **/
 file_system *fs_create(uint32_t size);
 
+/*
+	* Returns the size of the region (see superblock) of a file system with the given amount of blocks
+*/
+size_t fs_region_size(uint32_t size);
+
+/*
+	* Creates a file system object on top of an existing region, e.g. one mapped from an image.
+	* The region is validated (magic, version, size) and owned by the fs afterwards (munmap'd by fs_free).
+	* Returns NULL if the region isn't a valid file system
+*/
+file_system *fs_attach(uint8_t *region, size_t region_size);
+
 /*
 	* Initialize an empty inode
 */
 void inode_init(inode* i);
 /*
-	* find free inode and return its number or -1 if there is no free inode
+	* find free inode, mark it as used and return its number or -1 if there is no free inode
+	* O(1) amortized: the bitmap is searched word-wise, starting where the last search stopped
+*/
+int fs_alloc_inode(file_system* fs);
+
+/*
+	* reset an inode (inode_init) and mark it as free
+*/
+void fs_free_inode(file_system* fs, int inode_index);
+
+/*
+	* find free data-block, mark it as used and return its number or -1 if there is no free data-block
+	* O(1) amortized, like fs_alloc_inode
+*/
+int fs_alloc_block(file_system* fs);
+
+/*
+	* mark a data-block as free
+*/
+void fs_free_block(file_system* fs, int block_index);
+
+/*
+	* Returns the block number of logical block n of a node.
+	* If alloc is set, missing blocks (incl. indirect blocks) are allocated, preferably right behind
+	* the node's logical block n-1 so sequential contents stay contiguous. New data blocks are zeroed.
+	* alloc means the block is going to be written, so during a copy-on-write change a block
+	* (and indirect block) shared with the previous version is copied first.
+	* Returns -1 if the block doesn't exist (and couldn't be allocated) or n >= MAX_FILE_BLOCKS
+*/
+int fs_block_index(file_system* fs, inode* node, uint64_t n, int alloc);
+
+/*
+	* Frees all blocks of a node from logical block n on, incl. indirect blocks that aren't needed anymore.
+	* Does not change the node's size
+*/
+void fs_free_blocks_from(file_system* fs, inode* node, uint64_t n);
+
+/*
+	* Returns the number of children of a dir
+*/
+uint32_t fs_dir_count(inode* dir_node);
+
+/*
+	* Returns the inode number of a dir's k-th child
+*/
+int fs_dir_entry(file_system* fs, inode* dir_node, uint32_t k);
+
+/*
+	* Appends a child to a dir's list of children. Returns 0 on success, -1 if no block is available
+*/
+int fs_dir_add(file_system* fs, int dir_index, int child_index);
+
+/*
+	* Removes a child from its parent's list of children (the last child takes its slot)
+*/
+void fs_dir_remove(file_system* fs, int child_index);
+
+/*
+	* Finds the inode with the given parent and name (name_len bytes, not necessarily \0-terminated)
+	* via the name index. Returns its number or -1 if there is no such inode
+*/
+int fs_index_find(file_system* fs, int parent, const char* name, size_t name_len);
+
+/*
+	* Starts reading the name index without a lock (it is a seqlock):
+	* returns the sequence to be passed to fs_index_read_valid
+*/
+uint32_t fs_index_read_begin(file_system* fs);
+
+/*
+	* Returns 1 if the name index hasn't been changed since fs_index_read_begin
+	* (so everything found in between is consistent), 0 if the read has to be repeated
+*/
+int fs_index_read_valid(file_system* fs, uint32_t seq);
+
+/*
+	* Adds an inode to the name index. Its parent and name have to be set
+*/
+void fs_index_insert(file_system* fs, int inode_index);
+
+/*
+	* Removes an inode from the name index. Has to be called before its parent or name are reset
+*/
+void fs_index_remove(file_system* fs, int inode_index);
+
+/*
+	* Starts a copy-on-write change of a file: returns a new inode sharing all of the file's blocks
+	* (its next version) or -1 if no inode is available. Until fs_cow_commit, blocks of the new version
+	* are copied before they are written, and blocks it stops using are retired instead of freed
+*/
+int fs_cow_begin(file_system* fs, int index);
+
+/*
+	* Ends a copy-on-write change: the new version takes the file's place, the old one is retired
+*/
+void fs_cow_commit(file_system* fs, int index, int new_index);
+
+/*
+	* Lets a new node (with the same name and parent) take an existing node's place,
+	* the old node is retired with all of its blocks
+*/
+void fs_replace_node(file_system* fs, int index, int new_index);
+
+/*
+	* Retires a node that has been unlinked (fs_dir_remove, fs_index_remove), incl. all of its blocks
+*/
+void fs_retire_node(file_system* fs, int index);
+
+/*
+	* Frees what has been retired and can't be reached by readers anymore.
+	* Called by writers before they change the fs
+*/
+void fs_reclaim(file_system* fs);
+
+/*
+	* Frees what has been retired until the given number of blocks is free, waiting for readers that
+	* are still in an epoch. Returns 1 if that many blocks are free, 0 if what is left is pinned
+*/
+int fs_reclaim_until(file_system* fs, uint32_t free_blocks);
+
+/*
+	* Marks everything that has been retired as free in copies of the fs' bitmaps,
+	* so an image of the fs doesn't contain it. Returns the number of blocks marked
+*/
+uint32_t fs_retired_mark_free(file_system* fs, uint64_t* block_bitmap, uint64_t* inode_bitmap);
+
+/*
+	* Starts reading without a lock: nodes (and their blocks) found until fs_read_end
+	* stay valid until then, even if they are removed or replaced meanwhile. Not nestable
+*/
+void fs_read_begin(file_system* fs);
+
+/*
+	* Ends reading started with fs_read_begin
+*/
+void fs_read_end(file_system* fs);
+
+/*
+	* Keeps a node found between fs_read_begin and fs_read_end valid (and unchanged) after fs_read_end,
+	* until fs_unpin
+*/
+void fs_pin(file_system* fs, int index);
+
+/*
+	* Releases a node pinned with fs_pin
+*/
+void fs_unpin(file_system* fs, int index);
+
+/*
+	* Locks the file system for writing (exclusive with other writers; readers aren't blocked)
+*/
+void fs_lock_write(file_system* fs);
+
+/*
+	* Releases the lock taken by fs_lock_write
 */
-int find_free_inode(file_system* fs);
+void fs_unlock(file_system* fs);
 
 /*
 	* frees up memory
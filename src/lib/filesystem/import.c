@@ -0,0 +1,294 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./import.h"
+#include "./operations.h"
+#include "./persistence.h"
+#include "../utils.h"
+
+/*
+ * A file found by the walk. Its contents are read by a reader thread
+ */
+typedef struct import_entry {
+	char *int_path;
+	char *ext_path;
+	uint8_t *data; //contents, NULL if the file is empty
+	size_t len;
+	int mapped; //1 if data is mapped, 0 if it is malloc'd
+	int state; //0 == not read yet, 1 == read, -1 == unreadable
+} import_entry;
+
+typedef struct import_context {
+	file_system *fs;
+	import_entry *entries;
+	size_t num_entries;
+	size_t entries_capacity;
+	size_t skipped;
+
+	// shared with the reader threads
+	pthread_mutex_t mutex;
+	pthread_cond_t ready; //an entry has been read
+	pthread_cond_t space; //an entry has been consumed
+	size_t next; //next entry to be read
+	size_t consumed; //number of entries copied into the fs
+} import_context;
+
+/*
+	* Joins a path and a name, returns a new string or NULL
+*/
+static char *import_join(const char *path, const char *name) {
+	size_t path_len = strlen(path);
+	int slash = (path_len == 0 || path[path_len - 1] != '/');
+
+	char *joined = malloc(path_len + slash + strlen(name) + 1);
+	if (joined == NULL) return NULL;
+
+	sprintf(joined, slash ? "%s/%s" : "%s%s", path, name);
+	return joined;
+}
+
+static int import_add_entry(import_context *ctx, char *int_path, char *ext_path) {
+	if (ctx->num_entries == ctx->entries_capacity) {
+		size_t new_capacity = ctx->entries_capacity ? 2 * ctx->entries_capacity : 1024;
+		import_entry *new_entries = realloc(ctx->entries, new_capacity * sizeof(import_entry));
+		if (new_entries == NULL) return -1;
+
+		ctx->entries = new_entries;
+		ctx->entries_capacity = new_capacity;
+	}
+
+	import_entry *e = &(ctx->entries[ctx->num_entries++]);
+	memset(e, 0, sizeof(import_entry));
+	e->int_path = int_path;
+	e->ext_path = ext_path;
+	return 0;
+}
+
+/*
+	* Walks a host dir, creating its subdirs in the fs and collecting its files.
+	* Returns -1 if the dir can't be read
+*/
+static int import_walk(import_context *ctx, const char *ext_dir, const char *int_dir) {
+	DIR *d = opendir(ext_dir);
+	if (d == NULL) return -1;
+
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+		if (strlen(de->d_name) >= NAME_MAX_LENGTH) {
+			ctx->skipped++;
+			continue;
+		}
+
+		int type = de->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			// links to files are followed like the readers do, links to dirs aren't (they may form a cycle)
+			struct stat st;
+			int is_link = (type == DT_LNK);
+			if (!is_link && fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) is_link = S_ISLNK(st.st_mode);
+
+			if (fstatat(dirfd(d), de->d_name, &st, 0) != 0) type = DT_UNKNOWN;
+			else if (S_ISDIR(st.st_mode)) type = is_link ? DT_UNKNOWN : DT_DIR;
+			else if (S_ISREG(st.st_mode)) type = DT_REG;
+			else type = DT_UNKNOWN;
+		}
+
+		if (type != DT_DIR && type != DT_REG) {
+			ctx->skipped++;
+			continue;
+		}
+
+		char *ext_path = import_join(ext_dir, de->d_name);
+		char *int_path = import_join(int_dir, de->d_name);
+		if (ext_path == NULL || int_path == NULL) {
+			free(ext_path);
+			free(int_path);
+			closedir(d);
+			return -1;
+		}
+
+		if (type == DT_REG) {
+			if (import_add_entry(ctx, int_path, ext_path) != 0) {
+				free(ext_path);
+				free(int_path);
+				closedir(d);
+				return -1;
+			}
+			continue;
+		}
+
+		// dirs are created during the walk, so they exist before any of their files are written
+		int index = fs_lookup(ctx->fs, int_path);
+		if ((index == -1 && fs_mkdir(ctx->fs, int_path) != 0) || (index != -1 && ctx->fs->inodes[index].n_type != dir)) {
+			debug_print("ERR: Could not create dir.");
+			ctx->skipped++;
+		} else if (import_walk(ctx, ext_path, int_path) != 0) {
+			ctx->skipped++;
+		}
+
+		free(ext_path);
+		free(int_path);
+	}
+
+	closedir(d);
+	return 0;
+}
+
+/*
+	* Reads a file into memory. Large files are mapped with their pages read ahead;
+	* small ones are read into a buffer, as mapping and unmapping them from several
+	* threads costs more than the copy (every munmap flushes all threads' TLBs)
+*/
+static void import_read(import_entry *e) {
+	e->state = -1;
+
+	int fd = open(e->ext_path, O_RDONLY);
+	if (fd < 0) return;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	e->len = st.st_size;
+	if (e->len >= FS_IMPORT_MMAP_THRESHOLD) {
+		e->data = mmap(NULL, e->len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (e->data == MAP_FAILED) {
+			e->data = NULL;
+			close(fd);
+			return;
+		}
+		e->mapped = 1;
+	} else if (e->len > 0) {
+		e->data = malloc(e->len);
+		size_t done = 0;
+		while (e->data != NULL && done < e->len) {
+			ssize_t n = pread(fd, e->data + done, e->len - done, done);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) {
+				free(e->data);
+				e->data = NULL;
+				break;
+			}
+			done += n;
+		}
+		if (e->data == NULL) {
+			close(fd);
+			return;
+		}
+	}
+
+	close(fd);
+	e->state = 1;
+}
+
+static void *import_reader_run(void *arg) {
+	import_context *ctx = arg;
+
+	pthread_mutex_lock(&(ctx->mutex));
+	while (1) {
+		// staying at most FS_IMPORT_WINDOW files ahead of the thread copying them
+		while (ctx->next < ctx->num_entries && ctx->next >= ctx->consumed + FS_IMPORT_WINDOW)
+			pthread_cond_wait(&(ctx->space), &(ctx->mutex));
+		if (ctx->next >= ctx->num_entries) break;
+
+		import_entry *e = &(ctx->entries[ctx->next++]);
+		pthread_mutex_unlock(&(ctx->mutex));
+
+		import_entry result = *e;
+		import_read(&result);
+
+		pthread_mutex_lock(&(ctx->mutex));
+		*e = result;
+		pthread_cond_broadcast(&(ctx->ready));
+	}
+	pthread_mutex_unlock(&(ctx->mutex));
+
+	return NULL;
+}
+
+int fs_import_tree(file_system *fs, const char *int_path, const char *ext_dir, int num_threads) {
+	int base = fs_lookup(fs, int_path);
+	if (base == -1 || fs->inodes[base].n_type != dir) return -1;
+
+	if (num_threads < 1) num_threads = 1;
+	if (num_threads > FS_IMPORT_MAX_THREADS) num_threads = FS_IMPORT_MAX_THREADS;
+
+	import_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fs = fs;
+
+	// one checkpoint afterwards is cheaper than logging every file
+	int log_fd = fs->log_fd;
+	fs->log_fd = -1;
+
+	if (import_walk(&ctx, ext_dir, int_path) != 0) {
+		fs->log_fd = log_fd;
+		for (size_t i=0; i<ctx.num_entries; i++) {
+			free(ctx.entries[i].int_path);
+			free(ctx.entries[i].ext_path);
+		}
+		free(ctx.entries);
+		return -1;
+	}
+
+	pthread_mutex_init(&(ctx.mutex), NULL);
+	pthread_cond_init(&(ctx.ready), NULL);
+	pthread_cond_init(&(ctx.space), NULL);
+
+	pthread_t threads[FS_IMPORT_MAX_THREADS];
+	int num_started = 0;
+	for (; num_started < num_threads; num_started++) {
+		if (pthread_create(&(threads[num_started]), NULL, import_reader_run, &ctx) != 0) break;
+	}
+	if (num_started == 0) {
+		// reading the files on this thread instead
+		for (size_t i=0; i<ctx.num_entries; i++) import_read(&(ctx.entries[i]));
+	}
+
+	// the files are copied in walk order by this thread only, so the fs needs no lock
+	int imported = 0;
+	for (size_t i=0; i<ctx.num_entries; i++) {
+		import_entry *e = &(ctx.entries[i]);
+
+		pthread_mutex_lock(&(ctx.mutex));
+		while (e->state == 0) pthread_cond_wait(&(ctx.ready), &(ctx.mutex));
+		pthread_mutex_unlock(&(ctx.mutex));
+
+		if (e->state == 1) {
+			int ret = fs_replace(fs, e->int_path, e->data, e->len);
+			if (ret >= 0) imported++;
+			else ctx.skipped++;
+			if (ret == -2) debug_print("ERR: File system is full.");
+		} else ctx.skipped++;
+
+		if (e->mapped) munmap(e->data, e->len);
+		else free(e->data);
+		free(e->int_path);
+		free(e->ext_path);
+
+		pthread_mutex_lock(&(ctx.mutex));
+		ctx.consumed++;
+		pthread_cond_broadcast(&(ctx.space));
+		pthread_mutex_unlock(&(ctx.mutex));
+	}
+
+	for (int i=0; i<num_started; i++) pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&(ctx.space));
+	pthread_cond_destroy(&(ctx.ready));
+	pthread_mutex_destroy(&(ctx.mutex));
+	free(ctx.entries);
+
+	if (ctx.skipped > 0) fprintf(stderr, "Skipped %zu entries of %s.\n", ctx.skipped, ext_dir);
+
+	fs->log_fd = log_fd;
+	if (fs_checkpoint(fs) != 0) fprintf(stderr, "Imported files are not persisted.\n");
+
+	return imported;
+}
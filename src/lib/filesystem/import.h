@@ -0,0 +1,26 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include "filesystem.h"
+
+#define FS_IMPORT_WINDOW 256 //max. number of source files held in memory at the same time
+#define FS_IMPORT_MAX_THREADS 64
+#define FS_IMPORT_MMAP_THRESHOLD (256 * 1024) //smaller files are read instead of mapped
+
+/**
+	* Imports a whole directory tree of the host into the file system under int_path,
+	* e.g. <ext_dir>/a/b becomes <int_path>/a/b. Existing files are replaced, existing dirs merged.
+	* The tree is walked once, dirs are created right away and files are handed to
+	* num_threads reader threads, which read (or map and prefetch) them in parallel while the calling
+	* thread copies them into the fs in the order they were found.
+	* The changes aren't logged one by one; a persistent fs is checkpointed once afterwards.
+	* Entries that aren't regular files or dirs (or whose names don't fit) are skipped.
+	* Must be called before the fs is shared with other threads.
+	* @param char* int_path existing dir in the fs
+	* @param const char* ext_dir dir on the host
+	* @param int num_threads number of reader threads
+	* @return number of imported files, -1 if ext_dir or int_path can't be used
+**/
+int fs_import_tree(file_system *fs, const char *int_path, const char *ext_dir, int num_threads);
+
+#endif //IMPORT_H
@@ -23,6 +23,7 @@ SOFTWARE.
 */
 
 #include "./operations.h"
+#include "./persistence.h"
 #include "../utils.h"
 
 /**
@@ -36,25 +37,21 @@ void fs_free_target_node(target_node *tnode) {
 }
 
 /**
- * Validates a given path by traversing and searching inodes
- * with corresponding names in the current inode's direct_nodes
+ * Validates a given path by resolving its components one by one
+ * in the fs' name index (no copy of the path is made)
  * and returns the target_inode (index & name) and it's parent (index & name).
  * Also checks for: leading slash (required)
  * @param fs pointer to a valid file_system
  * @param path pointer to a path-string
+ * @param n_type required type of the target, ignored if any_type is set
+ * @param any_type 1 if the target may be of any type
  * @returns target_node (tnode) with the target's & it's parent's inode index &
  * name
  */
-target_node *fs_parse_path(file_system *fs, char *path, enum node_type n_type) {
-  // duplicating input-path for use with strtok
-  char *p_validate = strdup(path);
-  if (!p_validate)
-    return NULL;
-
+static target_node *fs_resolve_path(file_system *fs, const char *path, enum node_type n_type, int any_type) {
   // paths have to be absolute (starting with '/')
-  if (strncmp(p_validate, "/", 1) != 0) {
+  if (strncmp(path, "/", 1) != 0) {
     debug_print("ERR: Path is invalid. Must be absolute. (no-leading-slash)");
-    free(p_validate);
     return NULL;
   }
 
@@ -66,104 +63,166 @@ target_node *fs_parse_path(file_system *fs, char *path, enum node_type n_type) {
   tnode->parent_index = fs->root_node;
 
   // "empty" path (only '/')
-  if (strcmp(p_validate, "/") == 0) {
+  if (strcmp(path, "/") == 0) {
     tnode->target_index = 0;
     tnode->parent_index = fs->root_node;
     *(tnode->target_name) = '/';
     *(tnode->parent_name) = '/';
 
-    free(p_validate);
     return tnode;
   }
 
   // validating the given path
-  char *tok = strtok(p_validate, "/");
-  while (tok) {
-    char *next = strtok(NULL, "/");
-
-    // finding the inode where name == token
-    int index = -1;
-    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-      index = fs->inodes[tnode->parent_index].direct_blocks[i];
-      if (index == -1)
-        continue;
-      
-      if (strcmp(fs->inodes[index].name, tok) == 0) {
-        if (next) {
-	  if (fs->inodes[index].n_type == dir) break;
-	  else continue;
-	} else if (fs->inodes[index].n_type == n_type) break;
-      }
-    }
+  const char *tok = path;
+  while (*tok == '/') tok++;
+
+  while (*tok) {
+    size_t tok_len = strcspn(tok, "/");
+    const char *next = tok + tok_len;
+    while (*next == '/') next++;
+
+    // finding the inode where name == token, in O(1)
+    int index = fs_index_find(fs, tnode->parent_index, tok, tok_len);
 
-    if (next) { // path has not been fully traversed -> inode has to be a dir
-      if (index == -1) {
-	    debug_print("ERR: Path is invalid. (path-invalid)");
+    if (*next) { // path has not been fully traversed -> inode has to be a dir
+      if (index == -1 || fs->inodes[index].n_type != dir) {
+        debug_print("ERR: Path is invalid. (path-invalid)");
         fs_free_target_node(tnode);
-        free(p_validate);
         return NULL;
       }
       tnode->parent_index = index;
     } else {
+      if (tok_len >= NAME_MAX_LENGTH) {
+        debug_print("ERR: Name is too long. (name-too-long)");
+        fs_free_target_node(tnode);
+        return NULL;
+      }
+
+      if (index != -1 && !any_type && fs->inodes[index].n_type != n_type) index = -1;
       tnode->target_index = index;
-      strncpy(tnode->target_name, tok, strlen(tok));
+      memcpy(tnode->target_name, tok, tok_len);
     }
 
     tok = next;
   }
 
-  free(p_validate);
-
   strncpy(tnode->parent_name, fs->inodes[tnode->parent_index].name, NAME_MAX_LENGTH);
 
   return tnode;
 }
 
+target_node *fs_parse_path(file_system *fs, char *path, enum node_type n_type) {
+  return fs_resolve_path(fs, path, n_type, 0);
+}
+
+/**
+ * Resolves a path to the inode number of its target in a single pass over the name index.
+ */
+static int fs_lookup_once(file_system *fs, const char *path) {
+  int index = fs->root_node;
+  const char *tok = path;
+
+  while (1) {
+    while (*tok == '/') tok++;
+    if (*tok == '\0')
+      return index;
+
+    // only dirs have children
+    if (fs->inodes[index].n_type != dir)
+      return -1;
+
+    size_t tok_len = strcspn(tok, "/");
+    index = fs_index_find(fs, index, tok, tok_len);
+    if (index == -1)
+      return -1;
+
+    tok += tok_len;
+  }
+}
+
+int fs_lookup(file_system *fs, const char *path) {
+  if (strncmp(path, "/", 1) != 0)
+    return -1;
+
+  // readers don't lock, so a lookup that overlapped a change of the name index is repeated
+  int index;
+  uint32_t seq;
+  do {
+    seq = fs_index_read_begin(fs);
+    index = fs_lookup_once(fs, path);
+  } while (!fs_index_read_valid(fs, seq));
+
+  return index;
+}
+
+/**
+ * Allocates and initializes a node that isn't reachable yet (see fs_link_node).
+ * @returns the inode number, -1 if no inode is available
+ */
+static int fs_alloc_node(file_system *fs, int parent, const char *name, enum node_type n_type) {
+  int index = fs_alloc_inode(fs);
+  if (index == -1) {
+    debug_print("ERR: No inode Available. (exhausted-inodes)");
+    return -1;
+  }
+
+  // a free inode may still hold the sizes & block numbers of an earlier node, e.g. in an image
+  inode *node = &(fs->inodes[index]);
+  inode_init(node);
+  strncpy(node->name, name, NAME_MAX_LENGTH);
+  node->n_type = n_type;
+  node->parent = parent;
+  node->generation = ++fs->generation;
+  return index;
+}
+
+/**
+ * Makes a node reachable (for readers too): adds it to its parent's children and to the name index.
+ * @returns 0 on success, -1 if the parent has no space left (the node and its blocks are freed)
+ */
+static int fs_link_node(file_system *fs, int index) {
+  if (fs_dir_add(fs, fs->inodes[index].parent, index) < 0) {
+    debug_print("ERR: No more space in target dir. (exhausted-blocks)");
+    fs_free_blocks_from(fs, &(fs->inodes[index]), 0);
+    fs_free_inode(fs, index);
+    return -1;
+  }
+
+  fs_index_insert(fs, index);
+  return 0;
+}
+
 /**
  * Creates a new node (file or dir) in the file system
  * - finds free inode
  * - sets reference to it in the parent (given by tnode)
+ * - adds it to the name index
+ * Names are unique within a dir, regardless of the node's type.
  * @param fs Pointer to a file_system object
  * @param tnode Pointer to a target_node object with target_name & parent_index
  * set
  * @param n_type node_type value for the node that is to be created (fil or
  * dir)
- * @returns 0 on success, -1 on failure
+ * @returns the new node's inode number on success, -1 on failure
  */
 int fs_new_node(file_system *fs, target_node *tnode, enum node_type n_type) {
-  // finding a free inode for the new dir
-  int dir_inode_index = find_free_inode(fs);
-  if (dir_inode_index == -1) {
-    debug_print("ERR: No inode Available. (exhausted-inodes)");
+  if (fs_index_find(fs, tnode->parent_index, tnode->target_name, strlen(tnode->target_name)) != -1) {
+    debug_print("ERR: A node with this name already exists. (name-taken)");
+    fs_free_target_node(tnode);
     return -1;
   }
 
-  // Initializing dir-inode
-  inode *dir_inode = &(fs->inodes[dir_inode_index]);
-  strncpy(dir_inode->name, tnode->target_name, NAME_MAX_LENGTH);
-  dir_inode->n_type = n_type;
-  dir_inode->parent = tnode->parent_index;
-
-  // finding free direct-block on parent
-  int index = -1;
-  for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-    if (fs->inodes[tnode->parent_index].direct_blocks[i] == -1) {
-      index = i;
-      break;
-    }
-  }
-  if (index == -1) {
-    debug_print("ERR: No more space in target dir. (exhausted-direct-blocks)");
+  int index = fs_alloc_node(fs, tnode->parent_index, tnode->target_name, n_type);
+  fs_free_target_node(tnode);
+  if (index == -1 || fs_link_node(fs, index) < 0)
     return -1;
-  }
 
-  // setting required values on new_dir parent
-  fs->inodes[tnode->parent_index].direct_blocks[index] = dir_inode_index;
-  fs_free_target_node(tnode);
-  return 0;
+  return index;
 }
 
 int fs_mkdir(file_system *fs, char *path) {
+  fs_reclaim(fs);
+
   // validating path & getting target_name and parent_index
   target_node *tnode = fs_parse_path(fs, path, dir);
   if (tnode == NULL) return -1;
@@ -174,10 +233,16 @@ int fs_mkdir(file_system *fs, char *path) {
     return -1;
   }
 
-  return fs_new_node(fs, tnode, dir);
+  if (fs_new_node(fs, tnode, dir) < 0)
+    return -1;
+
+  fs_log(fs, FS_LOG_MKDIR, path, NULL, 0, 0);
+  return 0;
 }
 
 int fs_mkfile(file_system *fs, char *path_and_name) {
+  fs_reclaim(fs);
+
   // validating path & getting target_name and parent_index
   target_node *tnode = fs_parse_path(fs, path_and_name, fil);
   if (tnode == NULL)
@@ -189,7 +254,11 @@ int fs_mkfile(file_system *fs, char *path_and_name) {
     return -2;
   }
 
-  return fs_new_node(fs, tnode, fil);
+  if (fs_new_node(fs, tnode, fil) < 0)
+    return -1;
+
+  fs_log(fs, FS_LOG_MKFILE, path_and_name, NULL, 0, 0);
+  return 0;
 }
 
 int cpmint(const void *a, const void *b) { return (*(int *)a) - (*(int *)b); }
@@ -201,148 +270,285 @@ char *fs_list(file_system *fs, char *path) {
  
   if (tnode->target_index == -1) {
     debug_print("ERR: Directory not found.");
+    fs_free_target_node(tnode);
     return NULL;
   }
 
   // assembling array of the inode-indices of the target's children
-  int child_inodes[DIRECT_BLOCKS_COUNT];
-  int child_count = 0;
-
-  for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-    int index = fs->inodes[tnode->target_index].direct_blocks[i];
-    if (index == -1 || fs->inodes[index].n_type == free_block)
-      continue;
-
-    child_inodes[child_count++] = index;
+  inode *dir_inode = &(fs->inodes[tnode->target_index]);
+  uint32_t child_count = fs_dir_count(dir_inode);
+  int *child_inodes = (int *)calloc(child_count + 1, sizeof(int));
+
+  size_t bufsize = 1;
+  for (uint32_t i = 0; i < child_count; i++) {
+    child_inodes[i] = fs_dir_entry(fs, dir_inode, i);
+    // line_len = name_len + (3 chars (DIR or FIL) + space + newline = 5)
+    bufsize += strlen(fs->inodes[child_inodes[i]].name) + 5;
   }
 
   // sorting child-inode-indices
   qsort(child_inodes, child_count, sizeof(int), cpmint);
 
   // assembling output string
-  int bufsize = 0;
   char *string = (char *)calloc(bufsize, sizeof(char));
+  size_t len = 0;
 
-  for (int i = 0; i < child_count; i++) {
+  for (uint32_t i = 0; i < child_count && string; i++) {
     int index = child_inodes[i];
-    // line_len = name_len + (3 chars (DIR or FIL) + space + newline = 6)
-    int line_len = strlen(fs->inodes[index].name) + 6;
-
-    bufsize += line_len;
-    string = realloc(string, bufsize);
-    if (!string) {
-      fs_free_target_node(tnode);
-      return NULL;
-    }
-
-    snprintf(string + strlen(string), line_len, "%s %s\n",
+    len += snprintf(string + len, bufsize - len, "%s %s\n",
              (fs->inodes[index].n_type == dir) ? "DIR" : "FIL",
              fs->inodes[index].name);
   }
 
+  free(child_inodes);
   fs_free_target_node(tnode);
   return string;
 }
 
 /**
- * Finds the first free data-block in the file-system.
- * @param fs Pointer to a file_system object
- * @returns index of the data-block for reference in fs->data_blocks 
+ * Writes len bytes to a node's contents at offset, allocating blocks as needed.
+ * Each block is filled with a single memcpy.
+ * @returns number of written bytes (less than len if the file system is full
+ * or the file has reached its maximum size)
  */
-int fs_find_block(file_system *fs) {
-  int block_index = -1;
-  for (int i = 0; i < (int)fs->s_block->num_blocks; i++) {
-    block_index = i;
-    if (fs->free_list[block_index] == 1)
+static size_t fs_write_at(file_system *fs, inode *node, uint64_t offset, const uint8_t *buf, size_t len) {
+  size_t written = 0;
+
+  while (written < len) {
+    int block_index = fs_block_index(fs, node, offset / BLOCK_SIZE, 1);
+    if (block_index == -1)
       break;
+
+    size_t in_block = offset % BLOCK_SIZE;
+    size_t n = MIN(BLOCK_SIZE - in_block, len - written);
+    memcpy(fs->data_blocks[block_index].block + in_block, buf + written, n);
+
+    written += n;
+    offset += n;
   }
 
-  return block_index;
+  if (written > 0 && offset > node->size)
+    node->size = offset;
+  node->generation = ++fs->generation;
+
+  return written;
+}
+
+/**
+ * Removes a node, its contents and (if it is a dir) all of its children.
+ * @param fs Pointer to a file_system object
+ * @param index inode number of the node to be removed
+ */
+static void fs_rm_node(file_system *fs, int index) {
+  inode *target_inode = &(fs->inodes[index]);
+
+  // removing children (recursive), last one first, so the list of children just shrinks
+  if (target_inode->n_type == dir) {
+    while (fs_dir_count(target_inode) > 0)
+      fs_rm_node(fs, fs_dir_entry(fs, target_inode, fs_dir_count(target_inode) - 1));
+  }
+
+  // removing ref in parent & name index
+  fs_dir_remove(fs, index);
+  fs_index_remove(fs, index);
+
+  // readers may still be sending it, so its inode & blocks are only freed once they are done
+  fs_retire_node(fs, index);
+}
+
+/**
+ * Resolves filename to a file's inode.
+ * @returns the inode or NULL if there is no such file
+ */
+static inode *fs_find_file(file_system *fs, char *filename) {
+  int index = fs_lookup(fs, filename);
+  if (index == -1 || fs->inodes[index].n_type != fil) {
+    debug_print("ERR: File not found.");
+    return NULL;
+  }
+
+  return &(fs->inodes[index]);
 }
 
-int fs_writef(file_system *fs, char *filename, char *text) {
+int fs_pwrite(file_system *fs, char *filename, const void *buf, size_t len, uint64_t offset) {
+  fs_reclaim(fs);
+
+  inode *target_inode = fs_find_file(fs, filename);
+  if (target_inode == NULL)
+    return -1;
+
   // empty data; write nothing; return instantly...
-  if (strlen(text) == 0)
+  if (len == 0)
     return 0;
 
-  // validating path & getting target_name and parent_index
-  target_node *tnode = fs_parse_path(fs, filename, fil);
-  if (tnode == NULL)
+  // the file is changed copy-on-write: only the blocks written are copied, readers keep the old version
+  int index = target_inode - fs->inodes;
+  int new_index = fs_cow_begin(fs, index);
+  if (new_index == -1) {
+    debug_print("ERR: No inode Available. (exhausted-inodes)");
+    return -2;
+  }
+
+  size_t written = fs_write_at(fs, &(fs->inodes[new_index]), offset, buf, len);
+  fs_cow_commit(fs, index, new_index);
+
+  if (written < len) {
+    debug_print("ERR: Not all bytes could be written.");
+    // the bytes that did fit stay in the file
+    if (written > 0)
+      fs_log(fs, FS_LOG_PWRITE, filename, buf, written, offset);
+    return -2;
+  }
+
+  fs_log(fs, FS_LOG_PWRITE, filename, buf, len, offset);
+  return written;
+}
+
+int fs_writef(file_system *fs, char *filename, const void *buf, size_t len) {
+  inode *target_inode = fs_find_file(fs, filename);
+  if (target_inode == NULL)
     return -1;
-  if (tnode->target_index == -1) {
-    debug_print("ERR: File not found.");
-    fs_free_target_node(tnode);
+
+  return fs_pwrite(fs, filename, buf, len, target_inode->size);
+}
+
+/**
+ * Sets a node's size, freeing the blocks behind the new end.
+ * Bytes behind the end of a file are always zero, so growing it later reads zeros.
+ */
+static void fs_truncate_node(file_system *fs, inode *node, uint64_t size) {
+  if (size < node->size) {
+    uint64_t keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    fs_free_blocks_from(fs, node, keep);
+
+    // (a copy of) the last block, unless it is a hole
+    int last = (keep > 0 && size % BLOCK_SIZE != 0) ? fs_block_index(fs, node, keep - 1, 0) : -1;
+    if (last != -1)
+      last = fs_block_index(fs, node, keep - 1, 1);
+    if (last != -1)
+      memset(fs->data_blocks[last].block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+  }
+
+  node->size = size;
+  node->generation = ++fs->generation;
+}
+
+int fs_truncate(file_system *fs, char *filename, uint64_t size) {
+  fs_reclaim(fs);
+
+  inode *target_inode = fs_find_file(fs, filename);
+  if (target_inode == NULL)
     return -1;
+
+  if (size > (uint64_t) MAX_FILE_BLOCKS * BLOCK_SIZE)
+    return -2;
+
+  int index = target_inode - fs->inodes;
+  int new_index = fs_cow_begin(fs, index);
+  if (new_index == -1) {
+    debug_print("ERR: No inode Available. (exhausted-inodes)");
+    return -2;
   }
 
-  int data_size = strlen(text);
+  fs_truncate_node(fs, &(fs->inodes[new_index]), size);
+  fs_cow_commit(fs, index, new_index);
+  fs_log(fs, FS_LOG_TRUNCATE, filename, NULL, 0, size);
+  return 0;
+}
 
-  // 2D Array of the structure { {block_id, available_space}, ... }
-  int blocks[DIRECT_BLOCKS_COUNT][2];
-  // initializing block_id with -1
-  for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++)
-    blocks[i][0] = -1;
+/**
+ * Returns the number of blocks (incl. indirect blocks) a file of the given size occupies.
+ */
+static uint64_t fs_blocks_needed(uint64_t size) {
+  uint64_t n = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  uint64_t blocks = n;
 
-  // Gathering blocks according to the data_size
-  // If file has blocks assigned and they have space: use them
-  // if not: find a new, free block
-  int leftovers = data_size;
-  int i = 0;
-  while (leftovers > 0 && i < DIRECT_BLOCKS_COUNT) {
-    int index = fs->inodes[tnode->target_index].direct_blocks[i];
+  if (n > DIRECT_BLOCKS_COUNT)
+    blocks++; // indirect block
+  if (n > DIRECT_BLOCKS_COUNT + POINTERS_PER_BLOCK)
+    blocks += 1 + (n - DIRECT_BLOCKS_COUNT - POINTERS_PER_BLOCK + POINTERS_PER_BLOCK - 1) / POINTERS_PER_BLOCK;
 
-    if (index == -1)
-      index = fs_find_block(fs);
+  return blocks;
+}
 
-    if (index == -1) {
-      debug_print("ERR: No free data-block available.");
-      fs_free_target_node(tnode);
-      return -1;
-    }
+int fs_replace(file_system *fs, char *path, const void *buf, size_t len) {
+  fs_reclaim(fs);
+
+  if (len > (uint64_t) MAX_FILE_BLOCKS * BLOCK_SIZE)
+    return -2;
 
-    int space = BLOCK_SIZE - fs->data_blocks[index].size;
-    if (space > 0) {
-      blocks[i][0] = index;
-      blocks[i][1] = MIN(leftovers, space);
-      leftovers -= blocks[i][1];
+  int index = fs_lookup(fs, path);
+  if (index != -1 && fs->inodes[index].n_type != fil) {
+    debug_print("ERR: Target is not a file.");
+    return -1;
+  }
 
-      if (fs->free_list[index] != 0) {
-        fs->s_block->free_blocks--;
-        fs->free_list[index] = 0;
-      }
+  // the new contents always go to new blocks, the old ones are freed once no reader is sending them anymore.
+  // Earlier versions that are retired by now count as free space, as soon as their readers are done
+  if (!fs_reclaim_until(fs, fs_blocks_needed(len))) {
+    debug_print("ERR: Not enough free data-blocks.");
+    return -2;
+  }
+
+  int new_index;
+  if (index != -1) {
+    new_index = fs_alloc_node(fs, fs->inodes[index].parent, fs->inodes[index].name, fil);
+  } else {
+    // the file doesn't exist yet
+    target_node *tnode = fs_parse_path(fs, path, fil);
+    if (tnode == NULL)
+      return -1;
+
+    if (fs_index_find(fs, tnode->parent_index, tnode->target_name, strlen(tnode->target_name)) != -1) {
+      debug_print("ERR: A node with this name already exists. (name-taken)");
+      fs_free_target_node(tnode);
+      return -1;
     }
 
-    i++;
+    new_index = fs_alloc_node(fs, tnode->parent_index, tnode->target_name, fil);
+    fs_free_target_node(tnode);
   }
 
-  // Write the corresponding part of the data to the blocks
-  // Data can be split between blocks
-  // Assuming there is only ever one block containing data that still has space
-  int written = 0;
-  for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-    if (blocks[i][0] == -1)
-      continue;
-
-    data_block *dblock = &(fs->data_blocks[blocks[i][0]]);
-    // setting remainings of block to 0
-    memset(dblock->block + dblock->size, 0, BLOCK_SIZE - dblock->size);
-    // copying data
-    memcpy(dblock->block + dblock->size, text + written, blocks[i][1]);
-
-    dblock->size += blocks[i][1];
-    fs->inodes[tnode->target_index].direct_blocks[i] = blocks[i][0];
-    written += blocks[i][1];
+  if (new_index == -1)
+    return -2;
+
+  // the new node is only made reachable once it has its full contents
+  inode *new_inode = &(fs->inodes[new_index]);
+  if (fs_write_at(fs, new_inode, 0, buf, len) < len) {
+    fs_free_blocks_from(fs, new_inode, 0);
+    fs_free_inode(fs, new_index);
+    return -2;
   }
-  fs->inodes[tnode->target_index].size = written;
 
-  if (written < data_size) {
-    debug_print("ERR: Not all bytes could be written.");
-    fs_free_target_node(tnode);
+  if (index != -1) {
+    fs_replace_node(fs, index, new_index);
+  } else if (fs_link_node(fs, new_index) < 0) {
     return -1;
   }
 
-  fs_free_target_node(tnode);
-  return written;
+  fs_log(fs, FS_LOG_REPLACE, path, buf, len, 0);
+  return (index != -1) ? 0 : 1;
+}
+
+/**
+ * Copies len bytes of a node's contents starting at offset into buf,
+ * one memcpy per run of contiguous blocks.
+ */
+static void fs_read_at(file_system *fs, inode *node, uint64_t offset, uint8_t *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    int block_index = fs_block_index(fs, node, offset / BLOCK_SIZE, 0);
+    size_t in_block = offset % BLOCK_SIZE;
+    size_t n = MIN(BLOCK_SIZE - in_block, len - done);
+
+    // a missing block (hole) reads as zeros
+    if (block_index == -1) memset(buf + done, 0, n);
+    else memcpy(buf + done, fs->data_blocks[block_index].block + in_block, n);
+
+    done += n;
+    offset += n;
+  }
 }
 
 uint8_t *fs_readf(file_system *fs, char *filename, int *file_size) {
@@ -356,45 +562,60 @@ uint8_t *fs_readf(file_system *fs, char *filename, int *file_size) {
     return NULL;
   }
 
+  inode *target_inode = &(fs->inodes[tnode->target_index]);
+  fs_free_target_node(tnode);
+
+  if (target_inode->size == 0 || target_inode->size > INT32_MAX)
+    return NULL;
+
   // initialising buffer array
-  size_t bufsize = fs->inodes[tnode->target_index].size + 1;
-  uint8_t *buf = (uint8_t *) calloc(bufsize, sizeof(uint8_t));
+  uint8_t *buf = (uint8_t *) malloc(target_inode->size + 1);
+  if (buf == NULL)
+    return NULL;
 
-  for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-    int index = fs->inodes[tnode->target_index].direct_blocks[i];
-    if (index == -1)
-      continue;
+  fs_read_at(fs, target_inode, 0, buf, target_inode->size);
+  buf[target_inode->size] = 0;
+  *file_size = target_inode->size;
+
+  return buf;
+}
+
+int fs_read_iov(file_system *fs, int index, uint32_t generation, size_t offset, struct iovec *iov, int max_iov) {
+  static uint8_t zero_block[BLOCK_SIZE]; // stands in for missing blocks (holes)
+
+  inode *target_inode = &(fs->inodes[index]);
+  if (target_inode->n_type != fil || target_inode->generation != generation)
+    return -1;
 
-    data_block *dblock = &(fs->data_blocks[index]);
+  int iovcnt = 0;
+  while (offset < target_inode->size) {
+    int block_index = fs_block_index(fs, target_inode, offset / BLOCK_SIZE, 0);
+    size_t in_block = offset % BLOCK_SIZE;
+    size_t n = MIN(BLOCK_SIZE - in_block, target_inode->size - offset);
 
-    // copying bytes from dblock to buffer array (bytewise)
-    for (int ci = 0; ci < (int)dblock->size; ci++) {
-      memcpy(buf + *file_size + ci * sizeof(uint8_t),
-	     dblock->block + ci * sizeof(uint8_t), 1);
+    uint8_t *start = (block_index == -1) ? zero_block : fs->data_blocks[block_index].block + in_block;
+
+    // consecutive blocks form one contiguous range, so they share an iovec
+    if (iovcnt > 0 && block_index != -1 && (uint8_t *) iov[iovcnt-1].iov_base + iov[iovcnt-1].iov_len == start) {
+      iov[iovcnt-1].iov_len += n;
+    } else {
+      if (iovcnt == max_iov)
+        break;
+
+      iov[iovcnt].iov_base = start;
+      iov[iovcnt].iov_len = n;
+      iovcnt++;
     }
-    *file_size += dblock->size;
-  }
 
-  if (*file_size == 0) {
-    fs_free_target_node(tnode);
-    return NULL;
+    offset += n;
   }
 
-  fs_free_target_node(tnode);
-  return buf;
+  return iovcnt;
 }
 
 target_node * fs_find_target(file_system * fs, char* path) {
-  target_node * tnode;
-  tnode = fs_parse_path(fs, path, dir);
-  if (tnode != NULL && tnode->target_name != NULL && tnode->target_index != -1) {
-    return tnode;
-  }
-
-  if (tnode) fs_free_target_node(tnode);
-
-  tnode = fs_parse_path(fs, path, fil);
-  if (tnode != NULL && tnode->target_name != NULL && tnode->target_index != -1) {
+  target_node * tnode = fs_resolve_path(fs, path, dir, 1);
+  if (tnode != NULL && tnode->target_index != -1) {
     return tnode;
   }
 
@@ -404,61 +625,19 @@ target_node * fs_find_target(file_system * fs, char* path) {
 }
 
 int fs_rm(file_system *fs, char *path) {
-  // validating path
-  target_node *tnode = fs_find_target(fs, path);
-  if (tnode == NULL) return -1;
-
-  inode* target_inode = &(fs->inodes[tnode->target_index]);
-  inode* parent_inode = &(fs->inodes[tnode->parent_index]);
-
-  if (target_inode->n_type == fil) {
-    // resetting data-blocks
-    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-      int index = target_inode->direct_blocks[i];
-      if (index == -1)
-        continue;
-
-      fs->free_list[index] = 1;
-      fs->free_list[index] = 1;
-      fs->s_block->free_blocks++;
-      data_block *dblock = &(fs->data_blocks[index]);
-      memset(dblock->block, 0, dblock->size);
-    }
-
-  } else if (target_inode->n_type == dir) {
-    // removing children (recursive)
-    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-      int index = target_inode->direct_blocks[i];
-      if (index == -1)
-        continue;
-
-      // assembling child's path in fs
-      char *childPath = (char *) calloc(strlen(path) + NAME_MAX_LENGTH + 1, sizeof(char));
-      strncat(childPath, path, strlen(path));
-      strncat(childPath, "/", 1);
-      strncat(childPath, fs->inodes[index].name, strlen(fs->inodes[index].name));
-
-      fs_rm(fs, childPath);
-      free(childPath);
-    }
-  }
-
-  // resetting inode
-  inode_init(target_inode);
+  fs_reclaim(fs);
 
-  // removing ref in parent
-  for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
-    if (parent_inode->direct_blocks[i] == tnode->target_index) {
-      parent_inode->direct_blocks[i] = -1;
-    }
-  }
+  // validating path
+  int index = fs_lookup(fs, path);
+  if (index == -1 || index == fs->root_node) return -1;
 
-  fs_free_target_node(tnode);
+  fs_rm_node(fs, index);
+  fs_log(fs, FS_LOG_RM, path, NULL, 0, 0);
   return 0;
 }
 
 int fs_import(file_system *fs, char *int_path, char *ext_path) {
-  FILE *fp = fopen(ext_path, "r");
+  FILE *fp = fopen(ext_path, "rb");
   if (!fp) {
     debug_print("ERR: Problem opening external file. It probably doesn't exist.");
     return -1;
@@ -475,7 +654,7 @@ int fs_import(file_system *fs, char *int_path, char *ext_path) {
 
     int read_len = fread(file_contents, 1, len, fp);
     if (read_len == len)
-      retval = fs_writef(fs, int_path, file_contents);
+      retval = fs_writef(fs, int_path, file_contents, len);
 
     free(file_contents);
   }
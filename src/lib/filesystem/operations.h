@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 #include "filesystem.h"
 
@@ -17,12 +18,31 @@ typedef struct target_node {
 
 void fs_free_target_node(target_node *tnode);
 
-// TODO: Doc this
+/**
+ * Resolves a path to its target node (of type n_type) and the target's parent.
+ *
+ * @Returns:
+ * the target_node, with target_index == -1 if the parent exists but has no child of that name and type
+ * NULL if the path is invalid (not absolute, a parent doesn't exist or the name is too long)
+ */
 target_node *fs_parse_path(file_system *fs, char *path, enum node_type n_type);
 
-// TODO: Doc this
+/**
+ * Resolves a path to its target node, whatever its type.
+ *
+ * @Returns the target_node or NULL if the target doesn't exist
+ */
 target_node * fs_find_target(file_system * fs, char* path);
 
+/**
+ * Resolves a path to the inode number of its target, whatever its type.
+ * Takes O(number of path components) and allocates no memory.
+ * Safe to call without the write lock between fs_read_begin and fs_read_end.
+ *
+ * @Returns the inode number or -1 if the target doesn't exist
+ */
+int fs_lookup(file_system *fs, const char *path);
+
 /**
  * Creates a new dir under the given path
  *
@@ -60,15 +80,55 @@ int fs_mkfile(file_system *fs, char *path_and_name);
 char *fs_list(file_system *fs, char *path);
 
 /**
- * Write (append, not overwrite) @param text to a file pointed to by @param
- * filename The file must exist before it can be written to
+ * Write (append, not overwrite) len bytes of @param buf to a file pointed to by @param
+ * filename The file must exist before it can be written to. buf may contain any bytes (incl. \0)
+ *
+ * @Returns:
+ * number of written bytes on success
+ * -1 if the file is not available
+ *  -2 if the file is full
+ */
+int fs_writef(file_system *fs, char *filename, const void *buf, size_t len);
+
+/**
+ * Writes len bytes of @param buf to a file at @param offset, overwriting what is there
+ * and growing the file if necessary. A gap between the file's end and offset reads as zeros.
+ * The file gets a new inode that shares the blocks not written to with the old one (copy-on-write).
  *
  * @Returns:
- * number of written chars on success
+ * number of written bytes on success
  * -1 if the file is not available
  *  -2 if the file is full
  */
-int fs_writef(file_system *fs, char *filename, char *text);
+int fs_pwrite(file_system *fs, char *filename, const void *buf, size_t len, uint64_t offset);
+
+/**
+ * Sets a file's size to @param size: blocks behind it are freed,
+ * growing the file appends zeros (without allocating blocks).
+ * Copy-on-write like fs_pwrite.
+ *
+ * @Returns:
+ * 0 on success
+ * -1 if the file is not available
+ * -2 if size exceeds the maximum file size (or no inode is available)
+ */
+int fs_truncate(file_system *fs, char *filename, uint64_t size);
+
+/**
+ * Replaces a file's contents with len bytes of @param buf in a single pass,
+ * creating the file if it doesn't exist. The contents are written to a new inode
+ * and new blocks, which take the old file's place only once they are complete,
+ * so readers never see a partially written file. The old blocks are freed once
+ * no reader uses them anymore, so the new contents have to fit besides them.
+ * Nothing is changed if the contents don't fit.
+ *
+ * @Returns:
+ * 1 if the file has been created
+ * 0 if an existing file has been replaced
+ * -1 if the path is invalid or the target is not a file
+ * -2 if the contents don't fit into the file system
+ */
+int fs_replace(file_system *fs, char *path, const void *buf, size_t len);
 
 /**
  * Reads a file and allocates memory for a uint8_t buffer (array). Reads this
@@ -79,6 +139,23 @@ int fs_writef(file_system *fs, char *filename, char *text);
  */
 uint8_t *fs_readf(file_system *fs, char *filename, int *file_size);
 
+/**
+ * Maps a range of a file's contents onto iovecs that point directly into its
+ * data blocks, so nothing is copied. The file has to be pinned (fs_pin), its
+ * contents (and so the iovecs) stay valid until it is unpinned.
+ *
+ * @Param: int index inode index of the file
+ * @Param: uint32_t generation generation of the file the caller expects
+ * @Param: size_t offset first byte of the file to be mapped
+ * @Param: struct iovec* iov array to be filled
+ * @Param: int max_iov length of iov
+ *
+ * @Returns:
+ * number of filled iovecs (0 if offset is at the end of the file)
+ * -1 if the file has been written or removed since (generation mismatch)
+ */
+int fs_read_iov(file_system *fs, int index, uint32_t generation, size_t offset, struct iovec *iov, int max_iov);
+
 /**
  * Deletes a file or a dir recursively.
  *
@@ -0,0 +1,379 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "./persistence.h"
+#include "./operations.h"
+#include "../utils.h"
+
+#define FS_LOG_MAX_PATH 4096 //longer paths in a record mean it is corrupt
+
+/*
+	* CRC-32 (IEEE), continuing a previous crc
+*/
+static uint32_t fs_crc32(uint32_t crc, const void *data, size_t len) {
+	static uint32_t table[256];
+	static int table_ready = 0;
+
+	if (!table_ready) {
+		for (uint32_t i=0; i<256; i++) {
+			uint32_t c = i;
+			for (int k=0; k<8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		table_ready = 1;
+	}
+
+	const uint8_t *bytes = data;
+	crc = ~crc;
+	for (size_t i=0; i<len; i++) crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static uint32_t fs_log_record_crc(const fs_log_record *rec, const void *path, const void *data) {
+	uint32_t crc = fs_crc32(0, (const uint8_t *) rec + sizeof(rec->crc), sizeof(fs_log_record) - sizeof(rec->crc));
+	crc = fs_crc32(crc, path, rec->path_len);
+	return fs_crc32(crc, data, rec->data_len);
+}
+
+/*
+	* Writes all len bytes of buf at offset. Returns 0 on success, -1 on failure
+*/
+static int fs_pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	const uint8_t *bytes = buf;
+	while (len > 0) {
+		ssize_t n = pwrite(fd, bytes, len, offset);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		bytes += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/*
+	* Empties the log and starts it with a header for the fs' current checkpoint
+*/
+static int fs_log_reset(file_system *fs, int log_fd) {
+	fs_log_header header = { FS_LOG_MAGIC, FS_VERSION, fs->s_block->checkpoint };
+
+	if (ftruncate(log_fd, 0) != 0) return -1;
+	if (fs_pwrite_all(log_fd, &header, sizeof(header), 0) != 0) return -1;
+	if (fsync(log_fd) != 0) return -1;
+
+	fs->log_size = sizeof(header);
+	return 0;
+}
+
+/*
+	* Applies a record to the fs. Returns -1 if it is malformed
+*/
+static int fs_log_apply(file_system *fs, const fs_log_record *rec, char *path, const void *data) {
+	switch (rec->op) {
+		case FS_LOG_MKDIR: fs_mkdir(fs, path); break;
+		case FS_LOG_MKFILE: fs_mkfile(fs, path); break;
+		case FS_LOG_PWRITE: fs_pwrite(fs, path, data, rec->data_len, rec->offset); break;
+		case FS_LOG_TRUNCATE: fs_truncate(fs, path, rec->offset); break;
+		case FS_LOG_REPLACE: fs_replace(fs, path, data, rec->data_len); break;
+		case FS_LOG_RM: fs_rm(fs, path); break;
+		default: return -1;
+	}
+	return 0;
+}
+
+/*
+	* Replays the records of the log onto the fs (which must not log them again).
+	* Returns the offset behind the last intact record, 0 if the log doesn't belong to the fs' image
+*/
+static off_t fs_log_replay(file_system *fs, int log_fd) {
+	struct stat st;
+	if (fstat(log_fd, &st) != 0 || (size_t) st.st_size < sizeof(fs_log_header)) return 0;
+
+	uint8_t *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, log_fd, 0);
+	if (log == MAP_FAILED) return 0;
+
+	fs_log_header header;
+	memcpy(&header, log, sizeof(header));
+	if (header.magic != FS_LOG_MAGIC || header.version != FS_VERSION || header.checkpoint != fs->s_block->checkpoint) {
+		// the log has already been checkpointed into the image (or belongs to another one)
+		munmap(log, st.st_size);
+		return 0;
+	}
+
+	char path[FS_LOG_MAX_PATH + 1];
+	size_t pos = sizeof(header);
+
+	while (st.st_size - pos >= sizeof(fs_log_record)) {
+		fs_log_record rec;
+		memcpy(&rec, log + pos, sizeof(rec));
+
+		if (rec.path_len > FS_LOG_MAX_PATH || rec.data_len > st.st_size - pos - sizeof(rec) - rec.path_len) break;
+
+		const uint8_t *rec_path = log + pos + sizeof(rec);
+		const uint8_t *rec_data = rec_path + rec.path_len;
+		if (fs_log_record_crc(&rec, rec_path, rec_data) != rec.crc) break;
+
+		memcpy(path, rec_path, rec.path_len);
+		path[rec.path_len] = '\0';
+		if (fs_log_apply(fs, &rec, path, rec_data) != 0) break;
+
+		pos += sizeof(rec) + rec.path_len + rec.data_len;
+	}
+
+	if (pos < (size_t) st.st_size) fprintf(stderr, "Dropping %zu bytes of torn log records.\n", st.st_size - pos);
+
+	munmap(log, st.st_size);
+	return pos;
+}
+
+file_system *fs_open(const char *image_path, uint32_t size) {
+	file_system *fs;
+
+	int image_fd = open(image_path, O_RDONLY);
+	if (image_fd < 0) {
+		if (errno != ENOENT) {
+			perror("Could not open file system image");
+			return NULL;
+		}
+		fs = fs_create(size);
+	} else {
+		struct stat st;
+		if (fstat(image_fd, &st) != 0) {
+			perror("Could not stat file system image");
+			close(image_fd);
+			return NULL;
+		}
+
+		// pages are read from the image on first access, changes stay in memory until the next checkpoint
+		uint8_t *region = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, image_fd, 0);
+		close(image_fd);
+		if (region == MAP_FAILED) {
+			perror("Could not map file system image");
+			return NULL;
+		}
+
+		fs = fs_attach(region, st.st_size);
+		if (fs == NULL) {
+			fprintf(stderr, "%s is not a valid file system image.\n", image_path);
+			munmap(region, st.st_size);
+			return NULL;
+		}
+	}
+
+	fs->image_path = strdup(image_path);
+	char *log_path = malloc(strlen(image_path) + 5);
+	if (fs->image_path == NULL || log_path == NULL) {
+		free(log_path);
+		fs_free(fs);
+		return NULL;
+	}
+	sprintf(log_path, "%s.wal", image_path);
+
+	int log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	free(log_path);
+	if (log_fd < 0) {
+		perror("Could not open file system log");
+		fs_free(fs);
+		return NULL;
+	}
+
+	off_t log_end = fs_log_replay(fs, log_fd);
+	int err = (log_end == 0) ? fs_log_reset(fs, log_fd) : ftruncate(log_fd, log_end);
+	if (err != 0) {
+		perror("Could not prepare file system log");
+		close(log_fd);
+		fs_free(fs);
+		return NULL;
+	}
+	if (log_end != 0) fs->log_size = log_end;
+
+	fs->log_fd = log_fd;
+	fs->log_sync = getenv("FS_LOG_SYNC") != NULL;
+	return fs;
+}
+
+/*
+	* Writes the retired nodes into the image as free (initialized) nodes, like fs_free_inode leaves them,
+	* so their sizes & block numbers don't survive in the image
+*/
+static int fs_write_retired_nodes(file_system *fs, int fd) {
+	for (size_t i=0; i<fs->num_retired; i++) {
+		fs_retired *r = &(fs->retired[i]);
+		if (r->block >= 0) continue;
+
+		inode node = fs->inodes[r->ino];
+		inode_init(&node);
+		if (fs_pwrite_all(fd, &node, sizeof(node), (uint8_t *) &(fs->inodes[r->ino]) - fs->region) != 0) return -1;
+	}
+
+	return 0;
+}
+
+/*
+	* Writes the region to fd, skipping free data blocks (they read as zeros from the sparse file)
+*/
+static int fs_write_region(file_system *fs, int fd) {
+	if (ftruncate(fd, fs->region_size) != 0) return -1;
+
+	size_t meta_size = (uint8_t *) fs->data_blocks - fs->region;
+	if (fs_pwrite_all(fd, fs->region, meta_size, 0) != 0) return -1;
+
+	// nodes & blocks that are only kept for readers are free in the image
+	uint64_t *block_bitmap = fs->block_bitmap;
+	uint64_t *bitmaps = NULL;
+	if (fs->num_retired > 0) {
+		size_t bitmap_size = fs->bitmap_words * sizeof(uint64_t);
+		bitmaps = malloc(2 * bitmap_size);
+		if (bitmaps == NULL) return -1;
+
+		block_bitmap = bitmaps;
+		uint64_t *inode_bitmap = bitmaps + fs->bitmap_words;
+		memcpy(block_bitmap, fs->block_bitmap, bitmap_size);
+		memcpy(inode_bitmap, fs->inode_bitmap, bitmap_size);
+
+		superblock s_block = *(fs->s_block);
+		s_block.free_blocks += fs_retired_mark_free(fs, block_bitmap, inode_bitmap);
+
+		if (fs_pwrite_all(fd, &s_block, sizeof(s_block), 0) != 0
+				|| fs_pwrite_all(fd, block_bitmap, bitmap_size, (uint8_t *) fs->block_bitmap - fs->region) != 0
+				|| fs_pwrite_all(fd, inode_bitmap, bitmap_size, (uint8_t *) fs->inode_bitmap - fs->region) != 0
+				|| fs_write_retired_nodes(fs, fd) != 0) {
+			free(bitmaps);
+			return -1;
+		}
+	}
+
+	// writing runs of used blocks at once
+	uint32_t num_blocks = fs->s_block->num_blocks;
+	uint32_t i = 0;
+	int err = 0;
+	while (i < num_blocks && err == 0) {
+		if (block_bitmap[i / 64] & (UINT64_C(1) << (i % 64))) {
+			i++;
+			continue;
+		}
+
+		uint32_t start = i;
+		while (i < num_blocks && !(block_bitmap[i / 64] & (UINT64_C(1) << (i % 64)))) i++;
+
+		err = fs_pwrite_all(fd, &(fs->data_blocks[start]), (size_t) (i - start) * sizeof(data_block), meta_size + (size_t) start * sizeof(data_block));
+	}
+
+	free(bitmaps);
+	return (err == 0) ? fsync(fd) : -1;
+}
+
+/*
+	* Syncs the dir containing path, so a rename within it is durable
+*/
+static int fs_sync_dir(const char *path) {
+	char *copy = strdup(path);
+	if (copy == NULL) return -1;
+
+	int dir_fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+	free(copy);
+	if (dir_fd < 0) return -1;
+
+	int err = fsync(dir_fd);
+	close(dir_fd);
+	return err;
+}
+
+int fs_checkpoint(file_system *fs) {
+	if (fs->image_path == NULL) return 0;
+
+	char *tmp_path = malloc(strlen(fs->image_path) + 5);
+	if (tmp_path == NULL) return -1;
+	sprintf(tmp_path, "%s.tmp", fs->image_path);
+
+	fs->s_block->checkpoint++;
+
+	// the new image only replaces the old one once it is completely on disk
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int err = (fd < 0) ? -1 : fs_write_region(fs, fd);
+	if (fd >= 0 && close(fd) != 0) err = -1;
+	if (err == 0) err = rename(tmp_path, fs->image_path);
+
+	if (err != 0) {
+		perror("Could not write file system image");
+		unlink(tmp_path);
+		free(tmp_path);
+		fs->s_block->checkpoint--;
+		return -1;
+	}
+	free(tmp_path);
+
+	// from here on a crash leaves a log behind that doesn't match the image and is ignored
+	if (fs_sync_dir(fs->image_path) != 0) perror("Could not sync file system image dir");
+
+	if (fs->log_fd >= 0 && fs_log_reset(fs, fs->log_fd) != 0) {
+		perror("Could not reset file system log");
+		close(fs->log_fd);
+		fs->log_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void fs_log(file_system *fs, enum fs_log_op op, const char *path, const void *data, size_t data_len, uint64_t offset) {
+	if (fs->log_fd < 0) return;
+
+	fs_log_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.path_len = strlen(path);
+	rec.offset = offset;
+	rec.data_len = data_len;
+	rec.crc = fs_log_record_crc(&rec, path, data);
+
+	struct iovec iov[3] = {
+		{ &rec, sizeof(rec) },
+		{ (void *) path, rec.path_len },
+		{ (void *) data, data_len }
+	};
+	size_t total = sizeof(rec) + rec.path_len + data_len;
+
+	// the log is opened with O_APPEND, a short write is retried with the rest
+	size_t done = 0;
+	int err = 0;
+	while (done < total) {
+		ssize_t n;
+		if (done == 0) {
+			n = writev(fs->log_fd, iov, 3);
+		} else {
+			// rare: continuing after a partial writev
+			size_t skip = done;
+			int k = 0;
+			while (skip >= iov[k].iov_len) skip -= iov[k++].iov_len;
+			n = write(fs->log_fd, (uint8_t *) iov[k].iov_base + skip, iov[k].iov_len - skip);
+		}
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			err = -1;
+			break;
+		}
+		done += n;
+	}
+
+	if (err == 0 && fs->log_sync) err = fdatasync(fs->log_fd);
+	if (err == 0) {
+		fs->log_size += total;
+		if (fs->log_size >= FS_LOG_CHECKPOINT_SIZE) fs_checkpoint(fs);
+		return;
+	}
+
+	// a torn record is dropped on replay, so the change has to end up in a checkpoint instead
+	perror("Could not write file system log");
+	if (fs_checkpoint(fs) != 0) {
+		fprintf(stderr, "File system changes are no longer persisted.\n");
+		if (fs->log_fd >= 0) close(fs->log_fd);
+		fs->log_fd = -1;
+	}
+}
@@ -0,0 +1,78 @@
+#ifndef PERSISTENCE_H
+#define PERSISTENCE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "filesystem.h"
+
+/*
+ * A persistent file system consists of two files:
+ *	- the image (<path>): a copy of the fs' region as of the last checkpoint
+ *	- the log (<path>.wal): every change made since then, one record per operation
+ * The image is mapped privately, so it is only ever replaced as a whole (by a checkpoint)
+ * and a crash at any time leaves the last checkpoint plus a prefix of the log behind.
+ */
+
+#define FS_LOG_MAGIC 0x4c4f4752 //identifies a log file ("RGOL")
+#define FS_LOG_CHECKPOINT_SIZE (64 * 1024 * 1024) //size of the log that triggers a checkpoint
+
+enum fs_log_op {
+	FS_LOG_MKDIR=1,
+	FS_LOG_MKFILE=2,
+	FS_LOG_PWRITE=3,
+	FS_LOG_TRUNCATE=4,
+	FS_LOG_REPLACE=5,
+	FS_LOG_RM=6
+};
+
+/*
+ * First bytes of the log, tying it to the image it has to be applied to
+ */
+typedef struct fs_log_header {
+	uint32_t magic; //FS_LOG_MAGIC
+	uint32_t version; //FS_VERSION
+	uint64_t checkpoint; //checkpoint of the image the records follow
+} fs_log_header;
+
+/*
+ * Header of a log record, followed by path_len bytes of path and data_len bytes of data
+ */
+typedef struct fs_log_record {
+	uint32_t crc; //CRC-32 of the rest of the header, the path and the data
+	uint32_t op; //enum fs_log_op
+	uint32_t path_len;
+	uint32_t reserved;
+	uint64_t offset; //offset of FS_LOG_PWRITE, size of FS_LOG_TRUNCATE
+	uint64_t data_len;
+} fs_log_record;
+
+/**
+	* Opens the file system stored in the image at image_path, or creates a new one
+	* of size blocks if there is no image yet (size is ignored otherwise).
+	* Changes recorded in the log since the image's checkpoint are replayed,
+	* a torn record at the log's end (from a crash while writing it) is dropped.
+	* Every change made afterwards is logged.
+	* The log is synced to disk after every record if env FS_LOG_SYNC is set,
+	* otherwise it survives crashes of the process but not of the machine.
+	* @param const char* image_path path of the image
+	* @param uint32_t size Amount of 1024-Byte-Blocks of a new filesystem
+	* @return pointer to fs struct, NULL if the image or log can't be used
+**/
+file_system *fs_open(const char *image_path, uint32_t size);
+
+/*
+	* Writes the fs to a new image, atomically replaces the old one by it and empties the log.
+	* Has to be called with the fs locked for writing (or not shared).
+	* Does nothing for a file system without an image.
+	* Returns 0 on success, -1 on failure (the old image and log stay valid)
+*/
+int fs_checkpoint(file_system *fs);
+
+/*
+	* Appends a record of a successful change to the log. Called by the fs-operations,
+	* does nothing if the fs' changes aren't logged
+*/
+void fs_log(file_system *fs, enum fs_log_op op, const char *path, const void *data, size_t data_len, uint64_t offset);
+
+#endif //PERSISTENCE_H
@@ -1,14 +1,17 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include "utils.h"
 #include "http.h"
 #include "udp.h"
 #include "filesystem/operations.h"
 #include "socket.h"
+#include "proxy.h"
+#include "object_cache.h"
 
-http_request* request_create(char *method, char *URI, char *body) {
+http_request* request_create(char *method, char *URI, const char *body) {
     http_request_header *req_header = calloc(1, sizeof(http_request_header));
     req_header->method = calloc(HEADER_SPECS_LENGTH, sizeof(char));
     if (method != NULL) {
@@ -30,10 +33,8 @@ http_request* request_create(char *method, char *URI, char *body) {
     req->header = req_header;
 
     if (body != NULL) {
-        req->body = calloc(strlen(body) + 1, sizeof(char));
-        strncpy(req->body, body, strlen(body));
-    } else {
-        req->body = calloc(BODY_INITIAL_SIZE, sizeof(char));
+        req->body = body;
+        req->body_length = strlen(body);
     }
 
     return req;
@@ -46,7 +47,6 @@ void http_request_free(http_request *req) {
     free(req->header->URI);
 
     free(req->header);
-    free(req->body);
     free(req);
 }
 
@@ -74,12 +74,12 @@ http_response *http_response_create(int status_code, char *status_message, char
 
     http_response *res = calloc(1, sizeof(http_response));
     res->header = res_header;
+    res->body_inode = -1;
 
     if (body != NULL) {
-        res->body = calloc(strlen(body) + 1, sizeof(char));
-        strncpy(res->body, body, strlen(body));
-    } else {
-        res->body = calloc(BODY_INITIAL_SIZE, sizeof(char));
+        res->body_length = strlen(body);
+        res->body = calloc(res->body_length + 1, sizeof(char));
+        memcpy(res->body, body, res->body_length);
     }
 
     return res;
@@ -102,10 +102,13 @@ int http_add_header_field(void *ptr, char *name, char *value) {
     }
 
     // No empty field exists, so realloc ->fields and use a new one
-    int i = http_msg->header->num_fields + 1;
+    int i = http_msg->header->num_fields;
 
-    if (realloc(http_msg->header->fields, (http_msg->header->num_fields * 2) * sizeof(http_header_field)) == NULL) return -1;
+    http_header_field *new_fields = realloc(http_msg->header->fields, (http_msg->header->num_fields * 2) * sizeof(http_header_field));
+    if (new_fields == NULL) return -1;
 
+    memset(new_fields + i, 0, i * sizeof(http_header_field));
+    http_msg->header->fields = new_fields;
     http_msg->header->num_fields *= 2; // increase num_fields if realloc was successful
 
     strncpy(http_msg->header->fields[i].name, name, MIN(strlen(name), HEADER_FIELD_NAME_LENGTH-1));
@@ -130,87 +133,129 @@ int http_has_header_field(void *ptr, char *name, int *field_index) {
 }
 
 /**
- * Returns the size of the given response object.
- * @param res the response object to be measured.
- * @return the size of the response object.
+ * Returns the default reason phrase of a status code.
+ * @return the reason phrase, "" if the status code is unknown.
  */
-int http_response_bytesize(http_response *res) {
-    unsigned int size = 0;
-
-    size += strlen(res->header->protocol) + 1; // +1 for space
-    size += 3; // status code
-    size += strlen(res->header->status_message) + 2; // +2 for \r\n
-
-    char *body_bytesize_str = calloc(12, sizeof(char));
-    if (strlen(res->body) > 0) {
-        if (strlen(res->body) > 99999999999) {
-            perror("Body too large.");
-            return -1;
-        }
+static const char *http_reason_phrase(int status_code) {
+    switch (status_code) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 507: return "Insufficient Storage";
+        default: return "";
     }
+}
 
-    snprintf(body_bytesize_str, 12, "%lu", strlen(res->body));
-    http_add_header_field(res, "Content-Length", body_bytesize_str);
-    free(body_bytesize_str);
+/**
+ * Copies a string to dest without its \0.
+ * @return pointer to the byte following the copied string.
+ */
+static char *http_put(char *dest, const char *src, size_t len) {
+    memcpy(dest, src, len);
+    return dest + len;
+}
 
-    for (int i = 0; i < res->header->num_fields; i++) {
-        if (strlen(res->header->fields[i].name) == 0) continue;
+/**
+ * Appends the status line and header of a response (incl. Content-Length: res->body_length) to an output.
+ * A 304 has no Content-Length, as it would have to be the one of the unchanged object.
+ * @return 0 on success, -1 on error.
+ */
+static int http_response_write_head(http_response *res, http_output *out) {
+    http_response_header *header = res->header;
 
-        size += strlen(res->header->fields[i].name) + 1; // +1 for :
-        size += strlen(res->header->fields[i].value) + 2; // +2 for \r\n
-    }
+    int status_code = header->status_code;
+    if (status_code < 100 || status_code > 999) status_code = 500;
 
-    size += 2; // \r\n
-    size += strlen(res->body);
-    size += 3;
-    size += strlen(res->body);
+    const char *status_message = header->status_message;
+    if (status_message[0] == '\0') status_message = http_reason_phrase(status_code);
 
-    return size;
-}
+    char content_length[48];
+    int content_length_len = snprintf(content_length, sizeof(content_length), "%zu", res->body_length);
 
-char* http_response_stringify(http_response *res) {
-    int res_size = http_response_bytesize(res);
+    size_t protocol_len = strlen(header->protocol);
+    size_t status_message_len = strlen(status_message);
 
-    if (res_size == 0) { // response is empty
-        res_size = 1;
-    } else if (res_size < 0) {
-        perror("Could not stringify response.");
-        return NULL;
+    // determining the exact size of the head first, so it is formatted without any reallocation
+    size_t len = protocol_len + 1 + 3 + 1 + status_message_len + 2;
+    for (int i = 0; i < header->num_fields; i++) {
+        if (header->fields[i].name[0] == '\0') continue;
+        len += strlen(header->fields[i].name) + 2 + strlen(header->fields[i].value) + 2;
+    }
+    if (status_code != 304) len += 16 + content_length_len + 2; // Content-Length: <n>\r\n
+    len += 2;
+
+    char *head = http_output_reserve_head(out, len);
+    if (head == NULL) return -1;
+
+    char *p = head;
+    p = http_put(p, header->protocol, protocol_len);
+    *p++ = ' ';
+    *p++ = (char) ('0' + status_code / 100);
+    *p++ = (char) ('0' + status_code / 10 % 10);
+    *p++ = (char) ('0' + status_code % 10);
+    *p++ = ' ';
+    p = http_put(p, status_message, status_message_len);
+    p = http_put(p, "\r\n", 2);
+
+    for (int i = 0; i < header->num_fields; i++) {
+        if (header->fields[i].name[0] == '\0') continue;
+
+        p = http_put(p, header->fields[i].name, strlen(header->fields[i].name));
+        p = http_put(p, ": ", 2);
+        p = http_put(p, header->fields[i].value, strlen(header->fields[i].value));
+        p = http_put(p, "\r\n", 2);
     }
 
-    char *res_str = calloc(res_size, sizeof(char));
-    strcat(res_str, res->header->protocol);
-    strcat(res_str, " ");
-
-    char *status_code_str = calloc(4, sizeof(char));
-    snprintf(status_code_str, 4, "%d", res->header->status_code);
-    strcat(res_str, status_code_str);
-    free(status_code_str);
-
-    strcat(res_str, " ");
+    if (status_code != 304) {
+        p = http_put(p, "Content-Length: ", 16);
+        p = http_put(p, content_length, content_length_len);
+        p = http_put(p, "\r\n", 2);
+    }
+    p = http_put(p, "\r\n", 2);
 
-    strcat(res_str, res->header->status_message);
-    strcat(res_str, "\r\n");
+    return http_output_commit_head(out, p - head);
+}
 
-    for (int i = 0; i < res->header->num_fields; i++) {
-        if (strlen(res->header->fields[i].name) == 0) continue;
+int http_response_write(http_response *res, http_output *out) {
+    if (http_response_write_head(res, out) < 0) return -1;
 
-        strcat(res_str, res->header->fields[i].name);
-        strcat(res_str, ": ");
-        strcat(res_str, res->header->fields[i].value);
-        strcat(res_str, "\r\n");
+    if (res->body_inode != -1) {
+        // the output takes over the pin on the file
+        int ino = res->body_inode;
+        res->body_inode = -1;
+        return http_output_append_file(out, res->body_fs, ino, res->body_generation, res->body_length);
     }
 
-    strcat(res_str, "\r\n");
-
-    if (strlen(res->body) > 0) {
-        strcat(res_str, res->body);
+    if (res->body_entry != NULL) {
+        // the output takes over the reference on the entry
+        object_cache_entry *entry = res->body_entry;
+        res->body_entry = NULL;
+        return http_output_append_object(out, res->body_cache, entry);
     }
 
-    return res_str;
+    // the body is sent straight from its own memory, the output frees it once sent
+    char *body = res->body;
+    size_t body_length = res->body_length;
+    res->body = NULL;
+    res->body_length = 0;
+
+    return http_output_append_body(out, body, body_length);
 }
 
 void http_response_free(http_response *res) {
+    if (res->body_inode != -1) fs_unpin(res->body_fs, res->body_inode);
+    if (res->body_entry != NULL) object_cache_release(res->body_cache, res->body_entry);
+
     free(res->header->fields);
     free(res->header->protocol);
     free(res->header->status_message);
@@ -221,129 +266,72 @@ void http_response_free(http_response *res) {
 }
 
 /**
- * Parses header-fields from a given string into a request object.
- * @param header_string string to be parsed.
- * @param req request object to be filled
- * @return 0 on success, -1 on error
+ * Copies a span of the parser's buffer into a fixed-size, \0-terminated string.
+ * @return 0 on success, -1 if the span doesn't fit into dest.
  */
-int http_parse_request_headers(char* header_string, http_request *req) {
-    char *delim = "\r\n";
-    char *ptr = strtok(header_string, delim);
-
-    while (NULL != ptr) {
-        // finding separating ': ' in the line
-        char *value_start = strstr(ptr, ": ") + 2;
-        if (NULL == value_start) return -1;
-
-        // determining lengths of name and value
-        unsigned int value_len = strlen(ptr) - ((value_start) - ptr);
-        unsigned int name_len = strlen(ptr) - value_len - 2;
-
-        // copying to temporaries
-        char *name = calloc(HEADER_FIELD_NAME_LENGTH, sizeof(char));
-        char *value = calloc(HEADER_FIELD_VALUE_LENGTH, sizeof(char));
-        strncpy(name, ptr, MIN(HEADER_FIELD_NAME_LENGTH-1, name_len));
-        strncpy(value, value_start, MIN(HEADER_FIELD_VALUE_LENGTH-1, value_len));
-
-        if (0 != http_add_header_field(req, name, value)) {
-            free(name);
-            free(value);
-            return -1;
-        }
-        free(name);
-        free(value);
-
-        ptr = strtok(NULL, delim);
-    }
+static int http_copy_span(http_parser *parser, http_parser_span span, char *dest, size_t dest_size) {
+    if (span.length >= dest_size) return -1;
 
+    memcpy(dest, parser->buf + span.offset, span.length);
+    dest[span.length] = '\0';
     return 0;
 }
 
 /**
- * Validates the HTTP request header and fills a request object.
- * @param req_string request in string form as it came from the stream
+ * Fills a request object from the current (complete) message of a parser.
+ * @param parser parser in state HTTP_PARSER_DONE
  * @param req request object to be filled
  * @return 0 on success, -1 on error.
  */
-int http_parse_request(char *req_string, http_request *req) {
-    unsigned int endline_index = strstr(req_string, "\r\n") - req_string;
-    char* request_line = calloc(endline_index + 1, sizeof(char)); // + 1 for '\0'
-    request_line = strncpy(request_line, req_string, endline_index);
-
-    debug_printv("Header line:", request_line);
-
-    char *delimiter = " ";
-    char *ptr = strtok(request_line, delimiter);
+int http_parse_request(http_parser *parser, http_request *req) {
+    if (parser->state != HTTP_PARSER_DONE) return -1;
 
-    int request_line_field_num = 0;
-    while(ptr != NULL) {
-        // printf("%s ", ptr);
+    if (http_copy_span(parser, parser->method, req->header->method, HEADER_SPECS_LENGTH) != 0) return -1;
+    if (http_copy_span(parser, parser->URI, req->header->URI, HEADER_URI_LENGTH) != 0) return -1;
+    if (http_copy_span(parser, parser->protocol, req->header->protocol, HEADER_SPECS_LENGTH) != 0) return -1;
 
-        char *cpy_dest = NULL;
-        unsigned int field_max_length = HEADER_SPECS_LENGTH;
-        switch (request_line_field_num) {
-            case 0:
-                cpy_dest = req->header->method;
-                break;
+    debug_printv("Request URI:", req->header->URI);
 
-            case 1:
-                cpy_dest = req->header->URI;
-                field_max_length = HEADER_URI_LENGTH;
-                break;
+    char name[HEADER_FIELD_NAME_LENGTH];
+    char value[HEADER_FIELD_VALUE_LENGTH];
+    for (int i = 0; i < parser->num_fields; i++) {
+        if (http_copy_span(parser, parser->fields[i].name, name, HEADER_FIELD_NAME_LENGTH) != 0) return -1;
+        if (http_copy_span(parser, parser->fields[i].value, value, HEADER_FIELD_VALUE_LENGTH) != 0) return -1;
 
-            case 2:
-                cpy_dest = req->header->protocol;
-                break;
-
-            default: break;
-        }
-
-        strncpy(cpy_dest, ptr, MIN(strlen(ptr), field_max_length-1));
-
-        // Get next slice
-        ptr = strtok(NULL, delimiter);
-        request_line_field_num++;
+        if (http_add_header_field(req, name, value) != 0) return -1;
     }
-    free(request_line);
-
-    if (request_line_field_num != 3) return -1;
-
-    unsigned int emptyline = strstr(req_string, "\r\n\r\n") - req_string;
 
-    int header_string_len = emptyline - (endline_index + 2);
-    if (0 < header_string_len) {
-        char *header_string = calloc(header_string_len+1, sizeof(char));
-        strncpy(header_string, req_string + (endline_index + 2), header_string_len);
-
-        if (0 != http_parse_request_headers(header_string, req)) {
-            free(header_string);
-            return -1;
-        }
-
-        free(header_string);
+    // the body stays in the parser's buffer, which is kept until the request has been processed
+    if (parser->content_length > 0) {
+        req->body = parser->buf + parser->body_offset;
+        req->body_length = parser->content_length;
     }
 
-    int cl_field_index = -1;
-    if (http_has_header_field(req, "Content-Length", &cl_field_index) == 1) {
-        unsigned int content_length = strtol(req->header->fields[cl_field_index].value, NULL, 10);
+    return 0;
+}
 
-        if (content_length == 0) return 0;
+/**
+ * Determines whether the value of an If-None-Match field names the given ETag (or is "*").
+ * Weak tags (W/"...") are compared by their opaque tag.
+ * @return 1 if it does, 0 if not.
+ */
+static int http_etag_matches(const char *if_none_match, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = if_none_match;
 
-        char *body = req_string + (emptyline + 4); // body starts after emptyline
+    while (*p != '\0') {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
 
-        if (strlen(body) != content_length) {
-            debug_print("Content-Length does not match body length!");
-            return -1;
-        }
+        const char *end = strchr(p, ',');
+        if (end == NULL) end = p + strlen(p);
 
-        // reallocating body if it's too small
-        if (content_length > strlen(req->body)-1) { // -1 because of \0
-            unsigned int new_size = 2*strlen(body);
-            if (realloc(req->body,new_size * sizeof(char)) == NULL) return -1;
-            memset(req->body, 0, new_size);
-        }
+        size_t len = end - p;
+        while (len > 0 && p[len - 1] == ' ') len--;
+        if (len == etag_len && strncmp(p, etag, len) == 0) return 1;
 
-        strncpy(req->body, body, content_length);
+        p = end;
     }
 
     return 0;
@@ -355,10 +343,10 @@ int http_parse_request(char *req_string, http_request *req) {
  */
 int http_process_get(http_request *req, http_response *res, struct file_system *fs) {
     // validating request URI against filesystem
-    struct target_node *tnode = fs_find_target(fs, req->header->URI);
+    int target_index = fs_lookup(fs, req->header->URI);
 
     // the target (.../.../foo) exists
-    if (tnode == NULL) {
+    if (target_index == -1) {
         res->header->status_code = 404;
         return 0;
     }
@@ -366,18 +354,34 @@ int http_process_get(http_request *req, http_response *res, struct file_system *
     res->header->status_code = 200;
     strcpy(res->header->status_message, "Ok");
 
-    struct inode * target_inode = &(fs->inodes[tnode->target_index]);
+    struct inode * target_inode = &(fs->inodes[target_index]);
 
     if (target_inode->n_type == fil) { // target is a file not a directory
-        int file_size = 0;
-        uint8_t *file_contents = fs_readf(fs, req->header->URI, &file_size);
+        // the ETag names the file's version, every write creates a new one
+        char etag[24];
+        snprintf(etag, sizeof(etag), "\"%u\"", target_inode->generation);
+
+        int field_index;
+        if (http_has_header_field(req, "If-None-Match", &field_index)
+            && http_etag_matches(req->header->fields[field_index].value, etag)) {
+            res->header->status_code = 304;
+            strcpy(res->header->status_message, "Not Modified");
+            http_add_header_field(res, "ETag", etag);
+            return 0;
+        }
 
-        if (file_size > 0) memcpy(res->body, file_contents, file_size);
+        // the file's contents are streamed from its data blocks once the response is sent,
+        // the pin keeps them from being changed or freed until then
+        fs_pin(fs, target_index);
+        res->body_fs = fs;
+        res->body_inode = target_index;
+        res->body_generation = target_inode->generation;
+        res->body_length = target_inode->size;
 
-        free(file_contents);
+        snprintf(etag, sizeof(etag), "\"%u\"", res->body_generation);
+        http_add_header_field(res, "ETag", etag);
     }
 
-    fs_free_target_node(tnode);
     return 0;
 }
 
@@ -392,30 +396,25 @@ int http_process_put(http_request *req, http_response *res, struct file_system *
         return 0;
     }
 
-    //The access IS permitted
-    int mkfile_result = fs_mkfile(fs,req->header->URI);
-    struct target_node *tnode = fs_find_target(fs, req->header->URI);
-
-    if (mkfile_result == -1) {  // Failed to create a target
-        res->header->status_code = 400;
+    //The access IS permitted: the file is created or its contents are swapped in one pass
+    int replace_result = fs_replace(fs, req->header->URI, req->body, req->body_length);
 
-    } else if (mkfile_result == 0) {   //Successfully created the target
+    if (replace_result == 1) {   //Successfully created the target
         res->header->status_code = 201;
         strcpy(res->header->status_message, "Created");
-        fs_writef(fs,req->header->URI,req->body);
 
-    } else if (mkfile_result == -2 && fs->inodes[tnode->target_index].n_type == fil){ //Successfully overwrites the target with the correct type
+    } else if (replace_result == 0) { //Successfully overwrote the target
         res->header->status_code = 204;
         strcpy(res->header->status_message, "No Content");
-        fs_rm(fs, req->header->URI); //Do I remove the entire path?
-        fs_mkfile(fs, req->header->URI);
-        fs_writef(fs,req->header->URI,req->body);
 
-    } else { //None of the above (probably unnecessary: Damian want's to leave it out, I want to keep it :P)
+    } else if (replace_result == -2) { //The body doesn't fit into the filesystem
+        res->header->status_code = 507;
+        strcpy(res->header->status_message, "Insufficient Storage");
+
+    } else { //Invalid path or the target is a directory
         res->header->status_code = 400;
     }
 
-    if (tnode != NULL) fs_free_target_node(tnode);
     return 0;
 }
 
@@ -424,9 +423,9 @@ int http_process_put(http_request *req, http_response *res, struct file_system *
  * @return 0 on success, -1 on error.
  */
 int http_process_delete(http_request *req, http_response *res, struct file_system *fs) {
-    struct target_node *tnode = fs_find_target(fs, req->header->URI);
+    int target_index = fs_lookup(fs, req->header->URI);
 
-    if (tnode == NULL) { // The file doesn't exist
+    if (target_index == -1) { // The file doesn't exist
         res->header->status_code = 404;
         strcpy(res->header->status_message, "Not Found");
         return 0;
@@ -436,7 +435,7 @@ int http_process_delete(http_request *req, http_response *res, struct file_syste
         res->header->status_code = 403;
         strcpy(res->header->status_message, "Forbidden");
 
-    } else if (fs->inodes[tnode->target_index].n_type == fil) {
+    } else if (fs->inodes[target_index].n_type == fil) {
         if (fs_rm(fs, req->header->URI) != 0) return -1;
 
         res->header->status_code = 204;
@@ -444,7 +443,6 @@ int http_process_delete(http_request *req, http_response *res, struct file_syste
 
     } else res->header->status_code = 400;
 
-    fs_free_target_node(tnode);
     return 0;
 }
 
@@ -468,21 +466,144 @@ int http_redirect(http_response *res, unsigned int status_code, char *location)
     }
 
     res->header->status_code = status_code;
-    http_add_header_field(res, "Content-Length", "0");
     http_add_header_field(res, "Location", location);
 
     return 0;
 }
 
+/**
+ * Fills a response with an object from the object cache, or with 304 if the client's If-None-Match names it.
+ * The body isn't copied, the response takes over the reference on the entry and sends the entry's body.
+ * @param entry the acquired entry
+ * @param if_none_match the value of the request's If-None-Match, NULL if it has none
+ */
+static void http_cached_response(http_response *res, object_cache *cache, object_cache_entry *entry, const char *if_none_match) {
+    http_add_header_field(res, "ETag", entry->etag);
+
+    if (if_none_match != NULL && http_etag_matches(if_none_match, entry->etag)) {
+        res->header->status_code = 304;
+        strcpy(res->header->status_message, "Not Modified");
+        object_cache_release(cache, entry);
+        return;
+    }
+
+    res->header->status_code = 200;
+    strcpy(res->header->status_message, "Ok");
+    res->body_cache = cache;
+    res->body_entry = entry;
+    res->body_length = entry->body_length;
+}
+
+/**
+ * Answers a request for another node in proxy mode: from the object cache if its copy of the object is fresh,
+ * otherwise by forwarding the request to the responsible node, which revalidates a stale copy on the way.
+ * Writes through this node drop its copy.
+ * @param n the responsible node
+ * @return 0 if res has been filled, 1 if the request has been forwarded, -1 if it can't be forwarded.
+ */
+static int http_proxy_request(webserver *ws, open_socket *sock, http_response *res, http_request *req, dht_neighbor *n) {
+    object_cache_entry *cached = NULL;
+
+    if (ws->objects != NULL && strncmp(req->header->method, "GET", 3) == 0) {
+        unsigned short fresh = 0;
+        cached = object_cache_acquire(ws->objects, req->header->URI, &fresh);
+
+        if (cached != NULL && fresh) {
+            int field_index;
+            int conditional = http_has_header_field(req, "If-None-Match", &field_index);
+            http_cached_response(res, ws->objects, cached, conditional ? req->header->fields[field_index].value : NULL);
+            return 0;
+        }
+    } else if (ws->objects != NULL) object_cache_invalidate(ws->objects, req->header->URI);
+
+    // the upstream connection takes over the entry
+    if (proxy_forward(ws, sock, req, n, cached) == 0) return 1;
+
+    if (cached != NULL) object_cache_release(ws->objects, cached);
+    return -1;
+}
+
+/**
+ * Fills a response for a request this node is not responsible for,
+ * either redirecting to the responsible node (or forwarding the request to it in proxy mode)
+ * or, if it is unknown, looking it up.
+ * While the lookup is outstanding, the request is parked on its connection (if there is one)
+ * and processed again once the reply arrives; it is answered with 503 if none arrives in time.
+ * Has to be called with the node locked.
+ * @param node the (virtual) node of this webserver the request is routed from
+ * @param sock the request's connection, NULL if the request can't be parked
+ * @param h the hash of the request's URI
+ * @param responsibility the node's responsibility for h as returned by dht_node_is_responsible
+ * @return 0 on success, 1 if the request has been parked or forwarded, -1 on error.
+ */
+static int http_delegate_request(webserver *ws, dht_node *node, open_socket *sock, http_response *res, http_request *req, uint16_t h, unsigned short responsibility) {
+    dht_neighbor *n = NULL;
+    if (responsibility == 2) n = node->succ; // -> redirect to successor
+    else if (responsibility == 0) {
+        n = dht_node_find_finger(node, h);
+        if (n == NULL) n = dht_lookup_cache_find_node(node, h);
+    }
+    else return -1;
+
+    if (n != NULL) {
+        if (sock != NULL) webserver_unpark_socket(ws, sock);
+
+        // in proxy mode the response is fetched from the responsible node, unless the request has been proxied before
+        if (ws->proxy != NULL && sock != NULL && !http_has_header_field(req, "Via", NULL)) {
+            int ret = http_proxy_request(ws, sock, res, req, n);
+            if (ret >= 0) return ret;
+        }
+
+        unsigned int red_loc_len = 9 + strlen(n->IP) + strlen(n->PORT) + strlen(req->header->URI);
+        char *red_loc = calloc(red_loc_len, sizeof(char));
+        snprintf(red_loc, red_loc_len, "http://%s:%s%s", n->IP, n->PORT, req->header->URI);
+
+        http_redirect(res, 303, red_loc);
+        free(red_loc);
+        return 0;
+    }
+
+    if (sock != NULL && sock->parked) {
+        // woken up by the reply to another lookup, or the lookup timed out
+        if (time_now_ms() - sock->parked_since < LOOKUP_TIMEOUT) return 1;
+        webserver_unpark_socket(ws, sock);
+
+    } else {
+        // -> send lookup into DHT (via the closest known node), the responsible node is unknown
+        int udp_sock = ws->udp_server_fd;
+        dht_neighbor *next = dht_node_next_hop(node, h);
+
+        // without a node to ask, the request is answered with 503 right away
+        if (udp_sock != -1 && next != NULL) {
+            // requests for the same hash share one lookup, until it times out
+            if (dht_lookup_cache_add_hash(node, h) == 0) {
+                udp_packet packet;
+                udp_packet_init(&packet, LOOKUP, h, node->ID, &(node->addr));
+                if (udp_send_to_node(&udp_sock, &packet, next) < 0) {
+                    perror("Error sending to node.");
+                }
+            }
+
+            if (sock != NULL && webserver_park_socket(ws, sock) == 0) return 1;
+        }
+    }
+
+    strcpy(res->header->status_message, "Service Unavailable");
+    res->header->status_code = 503;
+    http_add_header_field(res, "Retry-After", "1");
+
+    return 0;
+}
+
 /**
  * Processes a request from a buffer, fills request and response objects.
- * @param content_length content-length predetermined as received from stream
+ * @param sock the request's connection, NULL if the request can't be parked
  * @param res the response object to be filled
  * @param req the request object to be filled
  * @param fs the filesystem to be used
- * @return 0 on success, -1 on error.
+ * @return 0 on success, 1 if the request has been parked or forwarded (res is left unfilled), -1 on error.
  */
-int http_process_request(webserver *ws, http_response *res, http_request *req, struct file_system *fs) {
+int http_process_request(webserver *ws, open_socket *sock, http_response *res, http_request *req, struct file_system *fs) {
     if (req == NULL) {
         res->header->status_code = 400;
         return 0;
@@ -490,106 +611,351 @@ int http_process_request(webserver *ws, http_response *res, http_request *req, s
 
     int h = hash(req->header->URI);
 
-    unsigned short responsibility;
-    if (ws->node == NULL) responsibility = 1;
-    else responsibility = dht_node_is_responsible(ws->node, h);
+    unsigned short responsibility = 1;
+    int ret = 0;
+
+    if (ws->node != NULL) {
+        // of several virtual nodes, the one following h may be responsible, otherwise the one preceding it routes the request
+        // (the nodes are shared with the other workers, so their neighbors may only be read under their locks)
+        dht_node *node = dht_nodes_following(ws->nodes, ws->num_nodes, h);
+        dht_node_lock(node);
+        responsibility = dht_node_is_responsible(node, h);
+
+        if (responsibility != 1 && ws->num_nodes > 1) {
+            dht_node_unlock(node);
+            node = dht_nodes_preceding(ws->nodes, ws->num_nodes, h);
+            dht_node_lock(node);
+            responsibility = dht_node_is_responsible(node, h);
+        }
+
+        if (responsibility != 1) ret = http_delegate_request(ws, node, sock, res, req, h, responsibility);
+        dht_node_unlock(node);
+    }
+
+    if (responsibility != 1) return ret;
 
-    if (responsibility == 1) {
-        if (strncmp(req->header->method, "GET", 3) == 0) {
-            return http_process_get(req, res, fs);
+    if (strncmp(req->header->method, "GET", 3) == 0) {
+        // GETs don't lock, writers never change what they may be reading
+        fs_read_begin(fs);
+        ret = http_process_get(req, res, fs);
+        fs_read_end(fs);
 
-        } else if (strncmp(req->header->method, "PUT", 3) == 0) {
-            return http_process_put(req, res, fs);
+    } else if (strncmp(req->header->method, "PUT", 3) == 0) {
+        fs_lock_write(fs);
+        ret = http_process_put(req, res, fs);
+        fs_unlock(fs);
 
-        } else if (strncmp(req->header->method, "DELETE", 6) == 0) {
-            return http_process_delete(req, res, fs);
+    } else if (strncmp(req->header->method, "DELETE", 6) == 0) {
+        fs_lock_write(fs);
+        ret = http_process_delete(req, res, fs);
+        fs_unlock(fs);
 
-        } else res->header->status_code = 501;
+    } else res->header->status_code = 501;
 
-        return 0;
+    return ret;
+}
+
+/**
+ * Sends as much of a connection's pending output as its socket takes right now.
+ * While output is left, the socket is additionally watched for POLLOUT.
+ * @return 0 on success, -1 on error.
+ */
+static int http_flush_output(webserver *ws, open_socket *sock) {
+    if (http_output_flush(sock->out, sock->fd) < 0) return -1;
+
+    short events = POLLIN;
+    if (sock->out->pending > 0) events |= POLLOUT;
+
+    if (events != sock->events) {
+        if (event_loop_modify(ws->loop, sock->fd, events, 1) < 0) return -1;
+        sock->events = events;
     }
 
-    if (responsibility == 2) { // -> redirect to successor
-        unsigned int red_loc_len = 9 + strlen(ws->node->succ->IP) + strlen(ws->node->succ->PORT) + strlen(req->header->URI);
-        char *red_loc = calloc(red_loc_len, sizeof(char));
-        snprintf(red_loc, red_loc_len, "http://%s:%s%s", ws->node->succ->IP, ws->node->succ->PORT, req->header->URI);
+    return 0;
+}
 
-        http_redirect(res, 303, red_loc);
-        return 0;
+/**
+ * Determines whether the connection may be kept open after the parser's current request.
+ * HTTP/1.1 connections are persistent unless "Connection: close" is sent,
+ * HTTP/1.0 connections only if "Connection: keep-alive" is sent.
+ * @return 1 if the connection is kept alive, 0 if not.
+ */
+static int http_keep_alive(http_parser *parser) {
+    http_parser_field *connection = http_parser_find_field(parser, "Connection");
+
+    if (parser->protocol.length == 8 && strncmp(parser->buf + parser->protocol.offset, "HTTP/1.0", 8) == 0) {
+        return http_parser_field_has_token(parser, connection, "keep-alive");
     }
 
-    if (responsibility == 0) {
-        dht_neighbor *n = dht_lookup_cache_find_node(ws->node, h);
-        if (n != NULL) {
-            unsigned int red_loc_len = 9 + strlen(ws->node->succ->IP) + strlen(ws->node->succ->PORT) + strlen(req->header->URI);
-            char *red_loc = calloc(red_loc_len, sizeof(char));
-            snprintf(red_loc, red_loc_len, "http://%s:%s%s", n->IP, n->PORT, req->header->URI);
+    return !http_parser_field_has_token(parser, connection, "close");
+}
 
-            http_redirect(res, 303, red_loc);
-            return 0;
-        }
+/**
+ * Determines whether a header field is hop-by-hop (or rewritten) and thus isn't passed on by the proxy.
+ * @return 1 if it isn't passed on, 0 if it is.
+ */
+static int http_proxy_skip_field(const char *name) {
+    return strcasecmp(name, "Connection") == 0 || strcasecmp(name, "Keep-Alive") == 0
+        || strcasecmp(name, "Content-Length") == 0 || strcasecmp(name, "Transfer-Encoding") == 0
+        || strcasecmp(name, "Host") == 0;
+}
 
-        // -> send lookup into DHT, the responsible node is unknown
-        int udp_sock = -1;
-        for (int i = 0; i < ws->num_open_sockets; i++) {
-            if (ws->open_sockets_config[i].is_server_socket == 1 && ws->open_sockets_config[i].protocol == 1) {
-                udp_sock = ws->open_sockets[i].fd;
-                break;
-            }
-        }
-        if (udp_sock == -1) return -1;
+/**
+ * Whether a field of a forwarded request is left out. The client's own condition is replaced by the one
+ * revalidating our copy (if there is one), it is checked against the copy once it has been confirmed.
+ */
+static int http_proxy_skip_request_field(const char *name, const char *etag) {
+    return http_proxy_skip_field(name) || (etag != NULL && strcasecmp(name, "If-None-Match") == 0);
+}
 
-        udp_packet *packet = udp_packet_create(LOOKUP, h, ws->node->ID, ws->HOST, ws->PORT);
-        if (udp_send_to_node(ws, &udp_sock, packet, ws->node->succ) < 0) {
-            perror("Error sending to node.");
-        }
-        udp_packet_free(packet);
+/**
+ * Applies the connection semantics of the client's current request to a response for it.
+ */
+static void http_proxy_connection(open_socket *sock, http_response *res) {
+    if (!http_keep_alive(sock->parser)) {
+        http_add_header_field(res, "Connection", "close");
+        sock->close_after_write = 1;
+    } else if (sock->parser->protocol.length == 8 && strncmp(sock->parser->buf + sock->parser->protocol.offset, "HTTP/1.0", 8) == 0) {
+        http_add_header_field(res, "Connection", "keep-alive");
+    }
+}
 
-        strcpy(res->header->status_message, "Service Unavailable");
-        res->header->status_code = 503;
-        http_add_header_field(res, "Retry-After", "1");
+int http_proxy_write_request(webserver *ws, http_request *req, dht_neighbor *peer, const char *etag, http_output *out) {
+    http_request_header *header = req->header;
+
+    char host[64];
+    char via[64];
+    char condition[OBJECT_CACHE_ETAG_LENGTH + 20];
+    char content_length[48];
+    int host_len = snprintf(host, sizeof(host), "Host: %s:%s\r\n", peer->IP, peer->PORT);
+    int via_len = snprintf(via, sizeof(via), "Via: 1.1 %s:%s\r\n", ws->HOST, ws->PORT);
+    int condition_len = (etag != NULL) ? snprintf(condition, sizeof(condition), "If-None-Match: %s\r\n", etag) : 0;
+    int content_length_len = snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n\r\n", req->body_length);
+
+    // the request is always sent as HTTP/1.1, so the connection stays open
+    size_t method_len = strlen(header->method);
+    size_t uri_len = strlen(header->URI);
+    size_t len = method_len + 1 + uri_len + 11 + host_len + via_len + condition_len + content_length_len;
+    for (int i = 0; i < header->num_fields; i++) {
+        if (header->fields[i].name[0] == '\0' || http_proxy_skip_request_field(header->fields[i].name, etag)) continue;
+        len += strlen(header->fields[i].name) + 2 + strlen(header->fields[i].value) + 2;
+    }
 
-        dht_lookup_cache_add_hash(ws->node, h);
-        return 0;
+    char *head = http_output_reserve_head(out, len);
+    if (head == NULL) return -1;
+
+    char *p = head;
+    p = http_put(p, header->method, method_len);
+    *p++ = ' ';
+    p = http_put(p, header->URI, uri_len);
+    p = http_put(p, " HTTP/1.1\r\n", 11);
+    p = http_put(p, host, host_len);
+    p = http_put(p, via, via_len);
+    p = http_put(p, condition, condition_len);
+
+    for (int i = 0; i < header->num_fields; i++) {
+        if (header->fields[i].name[0] == '\0' || http_proxy_skip_request_field(header->fields[i].name, etag)) continue;
+
+        p = http_put(p, header->fields[i].name, strlen(header->fields[i].name));
+        p = http_put(p, ": ", 2);
+        p = http_put(p, header->fields[i].value, strlen(header->fields[i].value));
+        p = http_put(p, "\r\n", 2);
     }
 
-    return -1;
+    p = http_put(p, content_length, content_length_len);
+    if (http_output_commit_head(out, p - head) < 0) return -1;
+
+    if (req->body_length == 0) return 0;
+
+    // the body lives in the client's parser, which may be gone before the request has been sent
+    char *body = malloc(req->body_length);
+    if (body == NULL) return -1;
+    memcpy(body, req->body, req->body_length);
+
+    return http_output_append_body(out, body, req->body_length);
 }
 
-int http_handle(int *in_fd, webserver *ws, file_system *fs) {
-    char *buf = calloc(MAX_DATA_SIZE, sizeof(char));
+int http_proxy_write_head(open_socket *sock, http_parser *upstream) {
+    http_response *res = http_response_create(0, NULL, NULL, NULL);
+    if (res == NULL) return -1;
 
-    int bytes_received = socket_receive_all(in_fd, buf, MAX_DATA_SIZE);
-    if (bytes_received <= 0) {
-        if (errno == ECONNRESET || errno == EINTR || errno == ETIMEDOUT) {
-            if (socket_shutdown(ws, in_fd) != 0) {
-                perror("Socket shutdown failed.");
-            }
+    res->header->status_code = upstream->status_code;
+    http_copy_span(upstream, upstream->reason, res->header->status_message, HEADER_FIELD_VALUE_LENGTH);
 
-            free(buf);
-        }
+    char name[HEADER_FIELD_NAME_LENGTH];
+    char value[HEADER_FIELD_VALUE_LENGTH];
+    for (int i = 0; i < upstream->num_fields; i++) {
+        if (http_copy_span(upstream, upstream->fields[i].name, name, HEADER_FIELD_NAME_LENGTH) != 0) continue;
+        if (http_copy_span(upstream, upstream->fields[i].value, value, HEADER_FIELD_VALUE_LENGTH) != 0) continue;
+        if (http_proxy_skip_field(name)) continue;
+
+        http_add_header_field(res, name, value);
+    }
 
+    http_proxy_connection(sock, res);
+
+    // the body follows as it arrives
+    res->body_length = upstream->content_length;
+    int ret = http_response_write_head(res, sock->out);
+    res->body_length = 0;
+
+    http_response_free(res);
+    return ret;
+}
+
+int http_proxy_write_cached(open_socket *sock, object_cache *cache, object_cache_entry *entry, const char *if_none_match) {
+    http_response *res = http_response_create(0, NULL, NULL, NULL);
+    if (res == NULL) {
+        object_cache_release(cache, entry);
         return -1;
     }
 
+    http_cached_response(res, cache, entry, if_none_match);
+    http_proxy_connection(sock, res);
+    int ret = http_response_write(res, sock->out);
+
+    http_response_free(res);
+    return ret;
+}
+
+int http_proxy_write_error(open_socket *sock, int status_code) {
+    http_response *res = http_response_create(status_code, NULL, NULL, NULL);
+    if (res == NULL) return -1;
+
+    http_proxy_connection(sock, res);
+    int ret = http_response_write(res, sock->out);
+
+    http_response_free(res);
+    return ret;
+}
+
+/**
+ * Processes the parser's current (complete) request and queues the response on the connection.
+ * @param parser the connection's parser, NULL to answer a malformed request.
+ * @return 0 on success, 1 if the request has been parked and is to be processed again later
+ * (or forwarded and is answered once the response arrives), -1 on error.
+ */
+static int http_handle_request(open_socket *sock, http_parser *parser, webserver *ws, file_system *fs) {
     http_request *req;
     req = request_create(NULL, NULL, NULL);
     if (req == NULL) perror("Error initializing request structure");
 
     http_response *res = http_response_create(0, NULL, NULL, NULL);
 
-    if (http_parse_request(buf, req) != 0) req = NULL;
+    if (parser == NULL || http_parse_request(parser, req) != 0) {
+        http_request_free(req);
+        req = NULL;
+    }
+
+    int processed = http_process_request(ws, sock, res, req, fs);
+    if (processed == 1) {
+        // the request stays in the parser until it is processed again
+        http_response_free(res);
+        http_request_free(req);
+        return 1;
+    }
+
+    if (processed < 0) {
+        // the request is answered all the same, pipelined requests behind it would wait forever otherwise
+        perror("Error processing request");
+        http_response_free(res);
+        res = http_response_create(500, NULL, NULL, NULL);
+        if (res == NULL) {
+            if (req != NULL) http_request_free(req);
+            return -1;
+        }
+    }
 
-    if (http_process_request(ws, res, req, fs) == 0) {
-        char *res_msg = http_response_stringify(res);
-        socket_send(ws, in_fd, res_msg, strlen(res_msg), NULL, 0);
-        free(res_msg);
+    // after an error, the connection's state is unknown
+    int keep_alive = (processed == 0 && req != NULL && http_keep_alive(parser));
+    if (!keep_alive) {
+        http_add_header_field(res, "Connection", "close");
+        sock->close_after_write = 1;
+    } else if (strncmp(req->header->protocol, "HTTP/1.0", 8) == 0) {
+        http_add_header_field(res, "Connection", "keep-alive");
+    }
 
-    } else perror("Error processing request");
+    int ret = http_response_write(res, sock->out);
 
     http_response_free(res);
     if (req != NULL) http_request_free(req);
 
-    free(buf);
+    return ret;
+}
+
+/**
+ * Serves all complete requests in the connection's parser, in the order they were received.
+ * Stops early when the connection is to be closed, too much output is pending
+ * or a request has been parked or forwarded to a peer.
+ * @return 0 on success, -1 on error.
+ */
+static int http_serve_pending(open_socket *sock, webserver *ws, file_system *fs) {
+    http_parser *parser = sock->parser;
+
+    while (!sock->close_after_write && sock->upstream == NULL && sock->out->pending < HTTP_OUTPUT_HIGH_WATER) {
+        http_parser_state state = http_parser_execute(parser);
+
+        if (state == HTTP_PARSER_ERROR) {
+            // the stream can't be resynchronized after a malformed request
+            return http_handle_request(sock, NULL, ws, fs);
+        }
+
+        if (state != HTTP_PARSER_DONE) break;
+
+        int ret = http_handle_request(sock, parser, ws, fs);
+        if (ret < 0) return -1;
+        if (ret == 1) break;
+        http_parser_next(parser);
+    }
+
+    return 0;
+}
+
+int http_handle(int *in_fd, webserver *ws, file_system *fs) {
+    open_socket *sock = ws->open_sockets[*in_fd];
+    webserver_touch_socket(ws, sock);
+
+    if (sock->parser == NULL) sock->parser = http_parser_create();
+    if (sock->out == NULL) sock->out = http_output_create();
+    if (sock->parser == NULL || sock->out == NULL) return -1;
+
+    http_parser *parser = sock->parser;
+
+    if (http_flush_output(ws, sock) < 0) return -1;
+
+    // The socket is non-blocking and edge-triggered, so it is drained completely,
+    // unless the connection is about to be closed, its output is backlogged
+    // (then reading resumes once the output has been flushed) or its request is parked
+    // (then reading resumes once the request has been answered) or forwarded to a peer
+    // (then reading resumes once the response has been relayed).
+    while (1) {
+        if (http_serve_pending(sock, ws, fs) < 0) return -1;
+        if (sock->close_after_write || sock->peer_closed || sock->parked || sock->upstream != NULL
+            || sock->out->pending >= HTTP_OUTPUT_HIGH_WATER) break;
+
+        size_t space = 0;
+        char *dest = http_parser_buffer(parser, &space);
+        if (dest == NULL) continue; // request too large, answered as malformed
+
+        long n_bytes = socket_receive(in_fd, dest, space);
+        if (n_bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+
+        if (n_bytes == 0) {
+            // the peer won't send any more requests, but may still wait for responses
+            sock->peer_closed = 1;
+            break;
+        }
+
+        http_parser_commit(parser, n_bytes);
+    }
+
+    if (http_flush_output(ws, sock) < 0) return -1;
+
+    if ((sock->close_after_write || sock->peer_closed) && !sock->parked && sock->upstream == NULL && sock->out->pending == 0) return -1;
+
     return 0;
 }
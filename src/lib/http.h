@@ -3,13 +3,15 @@
 
 #include "filesystem/filesystem.h"
 #include "../webserver.h"
+#include "http_output.h"
+#include "object_cache.h"
 
 #define HEADER_FIELD_MAX_COUNT 100
 #define HEADER_FIELD_NAME_LENGTH 128
 #define HEADER_FIELD_VALUE_LENGTH 1024
 #define HEADER_URI_LENGTH 2048
 #define HEADER_SPECS_LENGTH 9 // Lengths of technical specs in the req/response header (protocol & method)
-#define BODY_INITIAL_SIZE 1024
+#define HTTP_OUTPUT_HIGH_WATER (1024 * 1024) // Pending output (bytes) above which no further pipelined requests are served
 
 typedef struct http_header_field {
     char name[HEADER_FIELD_NAME_LENGTH];
@@ -36,22 +38,31 @@ typedef struct http_response_header {
 
 typedef struct http_request {
     struct http_request_header *header;
-    char *body;
+    const char *body; // not owned: points into the parser's buffer (or the caller's memory), may contain \0
+    size_t body_length;
 } http_request;
 
 typedef struct http_response {
     struct http_response_header *header;
-    char *body;
+    char *body; // NULL if the response has no body
+    size_t body_length;
+    // file whose contents are sent as the body instead (body_inode == -1 if none)
+    file_system *body_fs;
+    int body_inode;
+    uint32_t body_generation;
+    // acquired object cache entry whose body is sent instead (body_entry == NULL if none)
+    object_cache *body_cache;
+    object_cache_entry *body_entry;
 } http_response;
 
 /**
  * Creates a new empty request.
  * @param method the request method (e.g.: GET)
  * @param URI the request URI (e.g.: /static/foo)
- * @param body the request body (e.g.: Hello World!)
+ * @param body the request body (e.g.: Hello World!), referenced, not copied
  * @return the request object. NULL on error.
  */
-http_request* request_create(char *method, char *URI, char *body);
+http_request* request_create(char *method, char *URI, const char *body);
 
 /**
  * Frees the given request object.
@@ -85,11 +96,15 @@ int http_add_header_field(void *http_msg, char *name, char *value);
 int http_has_header_field(void *ptr, char *name, int *field_index);
 
 /**
- * Converts the given response object into a string.
- * @param res the response object to be converted.
- * @return the response string. NULL on error.
+ * Appends the given response to a connection's output.
+ * Status line and header (incl. Content-Length) are formatted into the output's buffer,
+ * the body is handed over without being copied (res->body is NULL afterwards).
+ * A body file is queued by reference and later sent straight from the file system.
+ * @param res the response object to be written.
+ * @param out the output the response is appended to.
+ * @return 0 on success, -1 on error.
  */
-char* http_response_stringify(http_response *res);
+int http_response_write(http_response *res, http_output *out);
 
 /**
  * Frees the given response object.
@@ -97,6 +112,46 @@ char* http_response_stringify(http_response *res);
  */
 void http_response_free(http_response *res);
 
+/**
+ * Appends a request that is forwarded to a peer (proxy mode) to an upstream connection's output.
+ * Hop-by-hop header fields are dropped, Host and Via (naming this webserver) are added.
+ * @param ws this webserver.
+ * @param req the request to be forwarded.
+ * @param peer the peer the request is forwarded to.
+ * @param etag ETag of a cached copy that is revalidated (If-None-Match), NULL if none.
+ * @param out the upstream connection's output.
+ * @return 0 on success, -1 on error.
+ */
+int http_proxy_write_request(webserver *ws, http_request *req, dht_neighbor *peer, const char *etag, http_output *out);
+
+/**
+ * Appends the head of a response received from a peer (proxy mode) to the output of the client
+ * whose request is still in its parser. The body has to be appended as it arrives.
+ * @param sock the client's connection.
+ * @param upstream the parser holding the response's head.
+ * @return 0 on success, -1 on error.
+ */
+int http_proxy_write_head(open_socket *sock, http_parser *upstream);
+
+/**
+ * Answers a client's forwarded request with a cached object the peer has confirmed (proxy mode),
+ * or with 304 if the client's own condition names it.
+ * @param sock the client's connection.
+ * @param cache the object cache.
+ * @param entry the acquired entry, the response takes over the reference.
+ * @param if_none_match the client's If-None-Match, NULL if it has none.
+ * @return 0 on success, -1 on error.
+ */
+int http_proxy_write_cached(open_socket *sock, object_cache *cache, object_cache_entry *entry, const char *if_none_match);
+
+/**
+ * Answers a client's forwarded request that didn't get a response from the peer (proxy mode).
+ * @param sock the client's connection.
+ * @param status_code 502 or 504.
+ * @return 0 on success, -1 on error.
+ */
+int http_proxy_write_error(open_socket *sock, int status_code);
+
 /**
  * Handles an incoming TCP connection via HTTP.
  * @param in_fd Socket File Descriptor of the accepted connection.
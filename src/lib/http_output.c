@@ -0,0 +1,274 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "utils.h"
+#include "filesystem/operations.h"
+#include "http_output.h"
+
+http_output *http_output_create(void) {
+    http_output *out = calloc(1, sizeof(http_output));
+    if (out == NULL) return NULL;
+
+    out->buf_capacity = HTTP_OUTPUT_INITIAL_SIZE;
+    out->buf = malloc(out->buf_capacity);
+    out->segments_capacity = HTTP_OUTPUT_INITIAL_SEGMENTS;
+    out->segments = calloc(out->segments_capacity, sizeof(http_output_segment));
+
+    if (out->buf == NULL || out->segments == NULL) {
+        http_output_free(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+/**
+ * Returns a new segment at the end of the queue, growing the queue if necessary.
+ * @return the segment, NULL on error.
+ */
+static http_output_segment *http_output_push(http_output *out) {
+    if (out->first + out->num_segments == out->segments_capacity) {
+        if (out->first > 0) {
+            // moving the unsent segments to the front
+            memmove(out->segments, out->segments + out->first, out->num_segments * sizeof(http_output_segment));
+            out->first = 0;
+        } else {
+            http_output_segment *new_segments = realloc(out->segments, 2 * out->segments_capacity * sizeof(http_output_segment));
+            if (new_segments == NULL) return NULL;
+
+            out->segments = new_segments;
+            out->segments_capacity *= 2;
+        }
+    }
+
+    http_output_segment *seg = &(out->segments[out->first + out->num_segments]);
+    memset(seg, 0, sizeof(http_output_segment));
+    out->num_segments++;
+    return seg;
+}
+
+char *http_output_reserve_head(http_output *out, size_t len) {
+    if (out->buf_len + len > out->buf_capacity) {
+        size_t new_capacity = out->buf_capacity;
+        while (new_capacity < out->buf_len + len) new_capacity *= 2;
+
+        // heads are referenced by offset, so moving the buffer is fine
+        char *new_buf = realloc(out->buf, new_capacity);
+        if (new_buf == NULL) return NULL;
+
+        out->buf = new_buf;
+        out->buf_capacity = new_capacity;
+    }
+
+    return out->buf + out->buf_len;
+}
+
+int http_output_commit_head(http_output *out, size_t len) {
+    if (len == 0) return 0;
+
+    // directly following heads (e.g. of pipelined, body-less responses) are sent as one segment
+    if (out->num_segments > 0) {
+        http_output_segment *last = &(out->segments[out->first + out->num_segments - 1]);
+        if (last->type == HTTP_SEGMENT_HEAD && last->offset + last->len == out->buf_len) {
+            last->len += len;
+            out->buf_len += len;
+            out->pending += len;
+            return 0;
+        }
+    }
+
+    http_output_segment *seg = http_output_push(out);
+    if (seg == NULL) return -1;
+
+    seg->type = HTTP_SEGMENT_HEAD;
+    seg->offset = out->buf_len;
+    seg->len = len;
+    out->buf_len += len;
+    out->pending += len;
+    return 0;
+}
+
+int http_output_append_body(http_output *out, char *body, size_t len) {
+    if (len == 0) {
+        free(body);
+        return 0;
+    }
+
+    http_output_segment *seg = http_output_push(out);
+    if (seg == NULL) {
+        free(body);
+        return -1;
+    }
+
+    seg->type = HTTP_SEGMENT_BODY;
+    seg->data = body;
+    seg->len = len;
+    out->pending += len;
+    return 0;
+}
+
+int http_output_append_file(http_output *out, file_system *fs, int ino, uint32_t generation, size_t len) {
+    if (len == 0) {
+        fs_unpin(fs, ino);
+        return 0;
+    }
+
+    http_output_segment *seg = http_output_push(out);
+    if (seg == NULL) {
+        fs_unpin(fs, ino);
+        return -1;
+    }
+
+    seg->type = HTTP_SEGMENT_FILE;
+    seg->fs = fs;
+    seg->ino = ino;
+    seg->generation = generation;
+    seg->len = len;
+    out->pending += len;
+    return 0;
+}
+
+int http_output_append_object(http_output *out, object_cache *cache, object_cache_entry *entry) {
+    if (entry->body_length == 0) {
+        object_cache_release(cache, entry);
+        return 0;
+    }
+
+    http_output_segment *seg = http_output_push(out);
+    if (seg == NULL) {
+        object_cache_release(cache, entry);
+        return -1;
+    }
+
+    seg->type = HTTP_SEGMENT_OBJECT;
+    seg->data = entry->body;
+    seg->cache = cache;
+    seg->entry = entry;
+    seg->len = entry->body_length;
+    out->pending += entry->body_length;
+    return 0;
+}
+
+/**
+ * Releases whatever a segment holds on to.
+ */
+static void http_output_segment_free(http_output_segment *seg) {
+    if (seg->type == HTTP_SEGMENT_BODY) free(seg->data);
+    if (seg->type == HTTP_SEGMENT_FILE) fs_unpin(seg->fs, seg->ino);
+    if (seg->type == HTTP_SEGMENT_OBJECT) object_cache_release(seg->cache, seg->entry);
+}
+
+/**
+ * Returns the start of a (HEAD, BODY or OBJECT) segment's bytes.
+ */
+static char *http_output_segment_data(http_output *out, http_output_segment *seg) {
+    if (seg->type == HTTP_SEGMENT_HEAD) return out->buf + seg->offset;
+    return seg->data;
+}
+
+/**
+ * Maps the unsent segments onto iovecs, in order. Stops at the first segment that doesn't fit completely.
+ * Queued files are pinned, so their blocks can be mapped (and sent) without locking the file system.
+ * @return number of filled iovecs, -1 if a queued file has been changed.
+ */
+static int http_output_map(http_output *out, struct iovec *iov) {
+    int iovcnt = 0;
+
+    for (int i = 0; i < out->num_segments && iovcnt < HTTP_OUTPUT_MAX_IOV; i++) {
+        http_output_segment *seg = &(out->segments[out->first + i]);
+        size_t skip = (i == 0) ? out->sent : 0;
+
+        if (seg->type != HTTP_SEGMENT_FILE) {
+            iov[iovcnt].iov_base = http_output_segment_data(out, seg) + skip;
+            iov[iovcnt].iov_len = seg->len - skip;
+            iovcnt++;
+            continue;
+        }
+
+        int n = fs_read_iov(seg->fs, seg->ino, seg->generation, skip, iov + iovcnt, HTTP_OUTPUT_MAX_IOV - iovcnt);
+        if (n < 0) {
+            debug_print("File changed while being sent.");
+            return -1;
+        }
+
+        size_t mapped = 0;
+        for (int j = iovcnt; j < iovcnt + n; j++) mapped += iov[j].iov_len;
+        iovcnt += n;
+
+        // the remaining blocks are mapped by the next writev
+        if (mapped < seg->len - skip) break;
+    }
+
+    return iovcnt;
+}
+
+/**
+ * Removes the first segment from the queue.
+ */
+static void http_output_pop(http_output *out) {
+    http_output_segment_free(&(out->segments[out->first]));
+
+    out->first++;
+    out->num_segments--;
+    out->sent = 0;
+
+    if (out->num_segments == 0) {
+        // everything has been sent -> the buffers are reused from the start
+        out->first = 0;
+        out->buf_len = 0;
+    }
+}
+
+int http_output_flush(http_output *out, int sockfd) {
+    while (out->num_segments > 0) {
+        struct iovec iov[HTTP_OUTPUT_MAX_IOV];
+
+        int iovcnt = http_output_map(out, iov);
+        if (iovcnt <= 0) {
+            // a file that has been changed can't be sent anymore, but its Content-Length has already been promised
+            return -1;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        long n_bytes = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+
+        if (n_bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        out->pending -= n_bytes;
+
+        // dropping all segments that have been sent completely
+        size_t left = n_bytes;
+        while (left > 0 && out->num_segments > 0) {
+            http_output_segment *seg = &(out->segments[out->first]);
+            size_t seg_left = seg->len - out->sent;
+
+            if (left < seg_left) {
+                out->sent += left;
+                break;
+            }
+
+            left -= seg_left;
+            http_output_pop(out);
+        }
+    }
+
+    return 0;
+}
+
+void http_output_free(http_output *out) {
+    for (int i = 0; i < out->num_segments; i++) http_output_segment_free(&(out->segments[out->first + i]));
+
+    free(out->segments);
+    free(out->buf);
+    free(out);
+}
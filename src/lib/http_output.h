@@ -0,0 +1,113 @@
+#ifndef RN_PRAXIS_HTTP_OUTPUT_H
+#define RN_PRAXIS_HTTP_OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "filesystem/filesystem.h"
+#include "object_cache.h"
+
+#define HTTP_OUTPUT_INITIAL_SIZE 1024
+#define HTTP_OUTPUT_INITIAL_SEGMENTS 16
+#define HTTP_OUTPUT_MAX_IOV 256 // Max. number of iovecs handed to one writev
+
+typedef enum http_output_segment_type {
+    HTTP_SEGMENT_HEAD, // status line & header, located in the output's buffer
+    HTTP_SEGMENT_BODY, // response body, owned by the output until it has been sent
+    HTTP_SEGMENT_FILE, // file contents, sent straight from the file system's data blocks
+    HTTP_SEGMENT_OBJECT // body of an object cache's entry, referenced until it has been sent
+} http_output_segment_type;
+
+typedef struct http_output_segment {
+    http_output_segment_type type;
+    size_t offset; // HEAD: offset into the output's buffer
+    char *data; // BODY/OBJECT: the body's memory
+    file_system *fs; // FILE: the file system the file lives in
+    int ino; // FILE: inode index of the file
+    uint32_t generation; // FILE: generation of the file when the segment was queued
+    object_cache *cache; // OBJECT: the cache the entry belongs to
+    object_cache_entry *entry; // OBJECT: the acquired entry
+    size_t len;
+} http_output_segment;
+
+/**
+ * Queue of a connection's pending output, in request order.
+ * Heads of responses are formatted into one reusable buffer, bodies are referenced, not copied.
+ * Everything is sent with writev.
+ */
+typedef struct http_output {
+    char *buf;
+    size_t buf_len;
+    size_t buf_capacity;
+    http_output_segment *segments;
+    int first; // index of the first unsent segment
+    int num_segments;
+    int segments_capacity;
+    size_t sent; // bytes of the first unsent segment that have already been sent
+    size_t pending; // total number of unsent bytes
+} http_output;
+
+/**
+ * Creates a new, empty output queue.
+ * @return the output queue, NULL on error.
+ */
+http_output *http_output_create(void);
+
+/**
+ * Reserves space for a response head at the end of the output's buffer.
+ * The head has to be written to the returned pointer and committed with http_output_commit_head.
+ * @param out the output queue.
+ * @param len the exact length of the head.
+ * @return pointer to write the head to, NULL on error.
+ */
+char *http_output_reserve_head(http_output *out, size_t len);
+
+/**
+ * Appends the head written to the space returned by http_output_reserve_head to the queue.
+ * @return 0 on success, -1 on error.
+ */
+int http_output_commit_head(http_output *out, size_t len);
+
+/**
+ * Appends a body to the queue. The output takes ownership of body and frees it once it has been sent.
+ * @return 0 on success, -1 on error (body is freed).
+ */
+int http_output_append_body(http_output *out, char *body, size_t len);
+
+/**
+ * Appends a file's contents to the queue. Nothing is copied: while the file is being sent, its data blocks
+ * are read directly, a window of at most HTTP_OUTPUT_MAX_IOV blocks per writev.
+ * The file has to be pinned (fs_pin), the output takes over the pin and releases it once the file has been sent.
+ * @param fs the file system the file lives in.
+ * @param ino inode index of the file.
+ * @param generation generation of the file, sending fails if it doesn't match.
+ * @param len size of the file.
+ * @return 0 on success, -1 on error.
+ */
+int http_output_append_file(http_output *out, file_system *fs, int ino, uint32_t generation, size_t len);
+
+/**
+ * Appends the body of an object cache's entry to the queue. Nothing is copied.
+ * The entry has to be acquired (object_cache_acquire), the output takes over the reference
+ * and releases it once the body has been sent.
+ * @param cache the cache the entry belongs to.
+ * @param entry the entry.
+ * @return 0 on success, -1 on error (the entry is released).
+ */
+int http_output_append_object(http_output *out, object_cache *cache, object_cache_entry *entry);
+
+/**
+ * Sends as much of the queued output as the (non-blocking) socket takes right now.
+ * @param out the output queue.
+ * @param sockfd the connected socket's file descriptor.
+ * @return 0 on success (the output may not be empty afterwards),
+ * -1 on error (incl. a queued file that has been changed before it was sent completely).
+ */
+int http_output_flush(http_output *out, int sockfd);
+
+/**
+ * Frees the given output queue including all unsent bodies.
+ * @param out the output queue to be freed.
+ */
+void http_output_free(http_output *out);
+
+#endif //RN_PRAXIS_HTTP_OUTPUT_H
@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "utils.h"
+#include "http_parser.h"
+
+http_parser *http_parser_create(void) {
+    http_parser *parser = calloc(1, sizeof(http_parser));
+    if (parser == NULL) return NULL;
+
+    parser->capacity = HTTP_PARSER_INITIAL_SIZE;
+    parser->buf = calloc(parser->capacity, sizeof(char));
+    if (parser->buf == NULL) {
+        free(parser);
+        return NULL;
+    }
+
+    parser->state = HTTP_PARSER_REQUEST_LINE;
+    return parser;
+}
+
+http_parser *http_parser_create_response(void) {
+    http_parser *parser = http_parser_create();
+    if (parser != NULL) parser->response = 1;
+
+    return parser;
+}
+
+/**
+ * Moves the unconsumed bytes (starting at parser->start) to the front of the buffer
+ * and adjusts all offsets accordingly.
+ */
+static void http_parser_compact(http_parser *parser) {
+    size_t delta = parser->start;
+    if (delta == 0) return;
+
+    memmove(parser->buf, parser->buf + delta, parser->size - delta);
+    parser->size -= delta;
+    parser->start = 0;
+    parser->pos -= delta;
+    parser->line_start -= delta;
+
+    if (parser->state == HTTP_PARSER_REQUEST_LINE) return;
+
+    // the current message has been (partially) parsed, so its spans have to be moved as well
+    parser->method.offset -= delta;
+    parser->URI.offset -= delta;
+    parser->protocol.offset -= delta;
+    parser->status.offset -= delta;
+    parser->reason.offset -= delta;
+    for (int i = 0; i < parser->num_fields; i++) {
+        parser->fields[i].name.offset -= delta;
+        parser->fields[i].value.offset -= delta;
+    }
+    if (parser->state == HTTP_PARSER_BODY || parser->state == HTTP_PARSER_DONE) parser->body_offset -= delta;
+}
+
+char *http_parser_buffer(http_parser *parser, size_t *space) {
+    if (parser->state == HTTP_PARSER_ERROR) return NULL;
+
+    if (parser->size == parser->capacity) {
+        if (parser->start > 0) {
+            http_parser_compact(parser);
+        } else if (parser->capacity >= HTTP_PARSER_MAX_SIZE) {
+            debug_print("Request too large.");
+            parser->state = HTTP_PARSER_ERROR;
+            return NULL;
+        } else {
+            size_t new_capacity = MIN(2 * parser->capacity, (size_t) HTTP_PARSER_MAX_SIZE);
+            char *new_buf = realloc(parser->buf, new_capacity);
+            if (new_buf == NULL) {
+                parser->state = HTTP_PARSER_ERROR;
+                return NULL;
+            }
+
+            parser->buf = new_buf;
+            parser->capacity = new_capacity;
+        }
+    }
+
+    *space = parser->capacity - parser->size;
+    return parser->buf + parser->size;
+}
+
+void http_parser_commit(http_parser *parser, size_t n) {
+    parser->size = MIN(parser->size + n, parser->capacity);
+}
+
+/**
+ * Removes leading and trailing spaces / tabs from a span.
+ */
+static http_parser_span http_parser_trim(http_parser *parser, size_t from, size_t to) {
+    while (from < to && (parser->buf[from] == ' ' || parser->buf[from] == '\t')) from++;
+    while (to > from && (parser->buf[to-1] == ' ' || parser->buf[to-1] == '\t')) to--;
+
+    http_parser_span span = {from, to - from};
+    return span;
+}
+
+/**
+ * Parses the request line "<method> <URI> <protocol>" located at [from, to).
+ * @return 0 on success, -1 if the line is malformed.
+ */
+static int http_parser_request_line(http_parser *parser, size_t from, size_t to) {
+    http_parser_span *parts[3] = {&(parser->method), &(parser->URI), &(parser->protocol)};
+    int num_parts = 0;
+
+    size_t part_start = from;
+    for (size_t i = from; i <= to; i++) {
+        if (i < to && parser->buf[i] != ' ') continue;
+
+        if (i == part_start || num_parts == 3) return -1; // empty or surplus part
+        parts[num_parts]->offset = part_start;
+        parts[num_parts]->length = i - part_start;
+        num_parts++;
+        part_start = i + 1;
+    }
+
+    return num_parts == 3 ? 0 : -1;
+}
+
+/**
+ * Parses the status line "<protocol> <status> <reason>" located at [from, to). The reason may contain spaces or be empty.
+ * @return 0 on success, -1 if the line is malformed.
+ */
+static int http_parser_status_line(http_parser *parser, size_t from, size_t to) {
+    char *space = memchr(parser->buf + from, ' ', to - from);
+    if (space == NULL || space == parser->buf + from) return -1;
+
+    size_t status_offset = space - parser->buf + 1;
+    if (to - status_offset < 3) return -1;
+    for (size_t i = status_offset; i < status_offset + 3; i++) {
+        if (parser->buf[i] < '0' || parser->buf[i] > '9') return -1;
+    }
+    if (to > status_offset + 3 && parser->buf[status_offset + 3] != ' ') return -1;
+
+    parser->protocol.offset = from;
+    parser->protocol.length = status_offset - 1 - from;
+    parser->status.offset = status_offset;
+    parser->status.length = 3;
+    parser->status_code = (parser->buf[status_offset] - '0') * 100 + (parser->buf[status_offset + 1] - '0') * 10
+                          + (parser->buf[status_offset + 2] - '0');
+    parser->reason = http_parser_trim(parser, MIN(status_offset + 4, to), to);
+
+    return 0;
+}
+
+/**
+ * Parses the header field "<name>: <value>" located at [from, to).
+ * @return 0 on success, -1 if the line is malformed.
+ */
+static int http_parser_header_line(http_parser *parser, size_t from, size_t to) {
+    char *colon = memchr(parser->buf + from, ':', to - from);
+    if (colon == NULL || colon == parser->buf + from) return -1;
+    if (parser->num_fields >= HTTP_PARSER_MAX_FIELDS) return -1;
+
+    size_t colon_offset = colon - parser->buf;
+    http_parser_field *field = &(parser->fields[parser->num_fields]);
+    field->name = http_parser_trim(parser, from, colon_offset);
+    field->value = http_parser_trim(parser, colon_offset + 1, to);
+    parser->num_fields++;
+
+    return 0;
+}
+
+/**
+ * Determines the length of the message's body from its Content-Length header.
+ * Transfer codings (e.g. chunked) aren't supported, so where the body ends could only be guessed:
+ * messages with a Transfer-Encoding header, as well as several Content-Length headers, are rejected.
+ * @return 0 on success, -1 if the header is invalid.
+ */
+static int http_parser_content_length(http_parser *parser) {
+    parser->content_length = 0;
+
+    if (http_parser_find_field(parser, "Transfer-Encoding") != NULL) return -1;
+
+    http_parser_field *field = NULL;
+    for (int i = 0; i < parser->num_fields; i++) {
+        http_parser_field *f = &(parser->fields[i]);
+        if (f->name.length != sizeof("Content-Length") - 1) continue;
+        if (strncasecmp(parser->buf + f->name.offset, "Content-Length", f->name.length) != 0) continue;
+
+        if (field != NULL) return -1;
+        field = f;
+    }
+
+    // responses to which no body belongs, whatever their Content-Length says
+    if (parser->response && (parser->status_code < 200 || parser->status_code == 204 || parser->status_code == 304)) return 0;
+
+    if (field == NULL) return 0;
+    if (field->value.length == 0) return -1;
+
+    size_t content_length = 0;
+    for (size_t i = 0; i < field->value.length; i++) {
+        char c = parser->buf[field->value.offset + i];
+        if (c < '0' || c > '9') return -1;
+
+        content_length = content_length * 10 + (c - '0');
+        if (content_length > HTTP_PARSER_MAX_SIZE) return -1;
+    }
+
+    parser->content_length = content_length;
+    return 0;
+}
+
+http_parser_state http_parser_execute(http_parser *parser) {
+    while (parser->state == HTTP_PARSER_REQUEST_LINE || parser->state == HTTP_PARSER_HEADERS) {
+        // only the bytes after pos are searched for the end of the current line
+        char *newline = memchr(parser->buf + parser->pos, '\n', parser->size - parser->pos);
+        if (newline == NULL) {
+            parser->pos = parser->size;
+            return parser->state;
+        }
+
+        size_t line_end = newline - parser->buf;
+        parser->pos = line_end + 1;
+
+        size_t line_start = parser->line_start;
+        parser->line_start = parser->pos;
+        if (line_end > line_start && parser->buf[line_end - 1] == '\r') line_end--;
+
+        if (parser->state == HTTP_PARSER_REQUEST_LINE) {
+            if (line_end == line_start) {
+                // empty lines preceding a request are ignored
+                parser->start = parser->pos;
+                continue;
+            }
+
+            int ret = parser->response ? http_parser_status_line(parser, line_start, line_end)
+                                       : http_parser_request_line(parser, line_start, line_end);
+            if (ret < 0) {
+                parser->state = HTTP_PARSER_ERROR;
+                break;
+            }
+
+            parser->state = HTTP_PARSER_HEADERS;
+            continue;
+        }
+
+        if (line_end > line_start) {
+            if (http_parser_header_line(parser, line_start, line_end) < 0) parser->state = HTTP_PARSER_ERROR;
+            continue;
+        }
+
+        // empty line -> end of the header
+        if (http_parser_content_length(parser) < 0) {
+            parser->state = HTTP_PARSER_ERROR;
+            break;
+        }
+
+        parser->body_offset = parser->pos;
+        parser->state = HTTP_PARSER_BODY;
+    }
+
+    if (parser->state == HTTP_PARSER_BODY && parser->size - parser->body_offset >= parser->content_length) {
+        parser->pos = parser->body_offset + parser->content_length;
+        parser->state = HTTP_PARSER_DONE;
+    }
+
+    return parser->state;
+}
+
+void http_parser_discard_body(http_parser *parser, size_t n) {
+    if (parser->state != HTTP_PARSER_BODY && parser->state != HTTP_PARSER_DONE) return;
+
+    size_t received = MIN(parser->size - parser->body_offset, parser->content_length);
+    n = MIN(n, received);
+
+    // only bytes following the body (e.g. of a pipelined message) have to be moved
+    char *body = parser->buf + parser->body_offset;
+    memmove(body, body + n, parser->size - parser->body_offset - n);
+    parser->size -= n;
+    parser->content_length -= n;
+    if (parser->state == HTTP_PARSER_DONE) parser->pos -= n;
+}
+
+void http_parser_next(http_parser *parser) {
+    if (parser->state != HTTP_PARSER_DONE) return;
+
+    parser->start = parser->pos;
+    parser->line_start = parser->pos;
+    parser->num_fields = 0;
+    parser->content_length = 0;
+    parser->body_offset = 0;
+    memset(&(parser->method), 0, sizeof(http_parser_span));
+    memset(&(parser->URI), 0, sizeof(http_parser_span));
+    memset(&(parser->protocol), 0, sizeof(http_parser_span));
+    memset(&(parser->status), 0, sizeof(http_parser_span));
+    memset(&(parser->reason), 0, sizeof(http_parser_span));
+    parser->status_code = 0;
+    parser->state = HTTP_PARSER_REQUEST_LINE;
+
+    // all received bytes are consumed, so the buffer can be reused from its beginning
+    if (parser->start == parser->size) {
+        parser->start = 0;
+        parser->pos = 0;
+        parser->line_start = 0;
+        parser->size = 0;
+    }
+}
+
+int http_parser_has_pending(http_parser *parser) {
+    return parser->size > parser->start;
+}
+
+http_parser_field *http_parser_find_field(http_parser *parser, const char *name) {
+    size_t name_len = strlen(name);
+
+    for (int i = 0; i < parser->num_fields; i++) {
+        http_parser_field *field = &(parser->fields[i]);
+        if (field->name.length != name_len) continue;
+
+        if (strncasecmp(parser->buf + field->name.offset, name, name_len) == 0) return field;
+    }
+
+    return NULL;
+}
+
+int http_parser_field_has_token(http_parser *parser, http_parser_field *field, const char *token) {
+    size_t token_len = strlen(token);
+    if (field == NULL || token_len == 0) return 0;
+
+    const char *value = parser->buf + field->value.offset;
+    const char *end = value + field->value.length;
+
+    // the value is a comma-separated list, the token has to match one element completely
+    while (value < end) {
+        const char *comma = memchr(value, ',', end - value);
+        const char *element_end = (comma != NULL) ? comma : end;
+
+        while (value < element_end && (*value == ' ' || *value == '\t')) value++;
+        const char *last = element_end;
+        while (last > value && (last[-1] == ' ' || last[-1] == '\t')) last--;
+
+        if ((size_t) (last - value) == token_len && strncasecmp(value, token, token_len) == 0) return 1;
+
+        value = element_end + 1;
+    }
+
+    return 0;
+}
+
+void http_parser_free(http_parser *parser) {
+    free(parser->buf);
+    free(parser);
+}
@@ -0,0 +1,128 @@
+#ifndef RN_PRAXIS_HTTP_PARSER_H
+#define RN_PRAXIS_HTTP_PARSER_H
+
+#include <stddef.h>
+
+#define HTTP_PARSER_INITIAL_SIZE 1024
+#define HTTP_PARSER_MAX_SIZE (64 * 1024 * 1024) // Max. size of one request (header + body)
+#define HTTP_PARSER_MAX_FIELDS 100
+
+typedef enum http_parser_state {
+    HTTP_PARSER_REQUEST_LINE,
+    HTTP_PARSER_HEADERS,
+    HTTP_PARSER_BODY,
+    HTTP_PARSER_DONE,
+    HTTP_PARSER_ERROR
+} http_parser_state;
+
+/**
+ * A slice of the parser's buffer.
+ */
+typedef struct http_parser_span {
+    size_t offset;
+    size_t length;
+} http_parser_span;
+
+typedef struct http_parser_field {
+    http_parser_span name;
+    http_parser_span value;
+} http_parser_field;
+
+/**
+ * Resumable HTTP request (or response) parser.
+ * Bytes are appended to its buffer as they arrive; every call to http_parser_execute
+ * continues where the previous one stopped, so no byte is scanned twice.
+ * All spans are relative to buf and stay valid until http_parser_next is called.
+ */
+typedef struct http_parser {
+    http_parser_state state;
+    unsigned short response; // 1 if responses are parsed, i.e. a status line instead of a request line
+    char *buf;
+    size_t size; // number of bytes in buf
+    size_t capacity;
+    size_t start; // offset of the first byte of the current message
+    size_t pos; // offset up to which the buffer has been parsed
+    size_t line_start; // offset of the header line currently being parsed
+    http_parser_span method;
+    http_parser_span URI;
+    http_parser_span protocol;
+    http_parser_span status; // responses only
+    http_parser_span reason; // responses only, may be empty
+    int status_code; // responses only
+    http_parser_field fields[HTTP_PARSER_MAX_FIELDS];
+    int num_fields;
+    size_t content_length;
+    size_t body_offset;
+} http_parser;
+
+/**
+ * Creates a new, empty parser.
+ * @return the parser, NULL on error.
+ */
+http_parser *http_parser_create(void);
+
+/**
+ * Creates a new, empty parser for responses ("<protocol> <status> <reason>" instead of a request line).
+ * @return the parser, NULL on error.
+ */
+http_parser *http_parser_create_response(void);
+
+/**
+ * Returns the free space at the end of the parser's buffer, growing it if necessary.
+ * @param parser the parser.
+ * @param space is set to the number of bytes that may be written.
+ * @return pointer to write received bytes to, NULL if the message is too large (the parser is set to HTTP_PARSER_ERROR).
+ */
+char *http_parser_buffer(http_parser *parser, size_t *space);
+
+/**
+ * Marks n bytes written to the space returned by http_parser_buffer as received.
+ */
+void http_parser_commit(http_parser *parser, size_t n);
+
+/**
+ * Parses the bytes received since the last call.
+ * @param parser the parser.
+ * @return HTTP_PARSER_DONE once a complete message is available, HTTP_PARSER_ERROR on malformed input,
+ * any other state when more bytes are needed.
+ */
+http_parser_state http_parser_execute(http_parser *parser);
+
+/**
+ * Drops the first n received bytes of the current message's body from the buffer, e.g. once they have been
+ * passed on, so a large body isn't held completely. content_length is reduced by the number of dropped bytes.
+ */
+void http_parser_discard_body(http_parser *parser, size_t n);
+
+/**
+ * Discards the current (complete) message and prepares the parser for the next one.
+ * Bytes following the message (e.g. a pipelined request) are kept.
+ */
+void http_parser_next(http_parser *parser);
+
+/**
+ * Returns whether there are received bytes that don't belong to an already parsed message.
+ * @return 1 if such bytes exist, 0 if not.
+ */
+int http_parser_has_pending(http_parser *parser);
+
+/**
+ * Finds a header field of the current message by name (case-insensitive).
+ * @return the field, NULL if the message has no such field.
+ */
+http_parser_field *http_parser_find_field(http_parser *parser, const char *name);
+
+/**
+ * Checks whether one of the comma-separated elements of a header field's value is the given token
+ * (case-insensitive, whitespace around it ignored), e.g. "close" in "Connection: TE, close".
+ * @return 1 if the token is found, 0 if not.
+ */
+int http_parser_field_has_token(http_parser *parser, http_parser_field *field, const char *token);
+
+/**
+ * Frees the given parser.
+ * @param parser the parser to be freed.
+ */
+void http_parser_free(http_parser *parser);
+
+#endif //RN_PRAXIS_HTTP_PARSER_H
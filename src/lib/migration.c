@@ -0,0 +1,344 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "utils.h"
+#include "socket.h"
+#include "migration.h"
+#include "filesystem/operations.h"
+
+#define MIGRATION_PATH_LENGTH (sizeof(MIGRATION_DIRECTORY) + NAME_MAX_LENGTH + 1)
+
+int migration_schedule(webserver *ws, uint16_t from, uint16_t to, const struct sockaddr_in *addr) {
+    migration *m = calloc(1, sizeof(migration));
+    if (m == NULL) return -1;
+
+    m->fd = -1;
+    m->addr = *addr;
+    m->from = from;
+    m->to = to;
+
+    // migrations are started in the order the nodes have joined
+    migration **p = &(ws->migrations);
+    while (*p != NULL) p = &((*p)->next_migration);
+    *p = m;
+
+    return 0;
+}
+
+/**
+ * Frees a migration's memory, files queued for sending are unpinned.
+ */
+static void migration_free(migration *m) {
+    if (m->out != NULL) http_output_free(m->out);
+    if (m->parser != NULL) http_parser_free(m->parser);
+    free(m->keys);
+    free(m);
+}
+
+/**
+ * Takes a migration out of the webserver's list.
+ */
+static void migration_unlink(webserver *ws, migration *m) {
+    migration **p = &(ws->migrations);
+    while (*p != NULL && *p != m) p = &((*p)->next_migration);
+    if (*p != NULL) *p = m->next_migration;
+}
+
+/**
+ * Writes the path of a file in MIGRATION_DIRECTORY, which is also its URI.
+ */
+static void migration_path(const char *name, char *path) {
+    snprintf(path, MIGRATION_PATH_LENGTH, "%s/%s", MIGRATION_DIRECTORY, name);
+}
+
+/**
+ * Collects the files whose keys are in the migration's range.
+ * @return the number of files found, -1 on error.
+ */
+static int migration_find_keys(migration *m, file_system *fs) {
+    int capacity = 0;
+
+    fs_lock_write(fs);
+
+    int dir_index = fs_lookup(fs, MIGRATION_DIRECTORY);
+    inode *dir_node = (dir_index != -1) ? &(fs->inodes[dir_index]) : NULL;
+    uint32_t count = (dir_node != NULL && dir_node->n_type == dir) ? fs_dir_count(dir_node) : 0;
+
+    for (uint32_t k = 0; k < count; k++) {
+        int child = fs_dir_entry(fs, dir_node, k);
+        if (child < 0 || fs->inodes[child].n_type != fil) continue;
+
+        char path[MIGRATION_PATH_LENGTH];
+        migration_path(fs->inodes[child].name, path);
+        if (!dht_in_range(hash(path), m->from, m->to)) continue;
+
+        if (m->num_keys == capacity) {
+            capacity = MAX(64, capacity * 2);
+            migration_key *keys = realloc(m->keys, capacity * sizeof(migration_key));
+            if (keys == NULL) {
+                fs_unlock(fs);
+                return -1;
+            }
+            m->keys = keys;
+        }
+
+        migration_key *key = &(m->keys[m->num_keys++]);
+        memcpy(key->name, fs->inodes[child].name, NAME_MAX_LENGTH);
+        key->name[NAME_MAX_LENGTH - 1] = '\0';
+        key->ino = -1;
+    }
+
+    fs_unlock(fs);
+    return m->num_keys;
+}
+
+/**
+ * Watches a migration's connection for POLLOUT while it is connecting or has unsent PUTs.
+ * @return 0 on success, -1 on error.
+ */
+static int migration_watch(webserver *ws, migration *m) {
+    open_socket *sock = ws->open_sockets[m->fd];
+
+    short events = POLLIN;
+    if (!m->connected || m->out->pending > 0) events |= POLLOUT;
+    if (events == sock->events) return 0;
+
+    if (event_loop_modify(ws->loop, m->fd, events, 1) < 0) return -1;
+    sock->events = events;
+    return 0;
+}
+
+/**
+ * Starts a scheduled migration: finds its files and opens a (non-blocking) connection to the new owner.
+ * @return 0 if the migration has been started, 1 if there is nothing to migrate, -1 on error.
+ */
+static int migration_start(webserver *ws, migration *m, file_system *fs) {
+    int num_keys = migration_find_keys(m, fs);
+    if (num_keys <= 0) return num_keys == 0 ? 1 : -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    if (socket_set_nonblocking(fd) < 0
+        || (connect(fd, (struct sockaddr *) &(m->addr), sizeof(m->addr)) < 0 && errno != EINPROGRESS)
+        || webserver_add_socket(ws, fd, MIGRATION, 0) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    m->fd = fd;
+    m->out = http_output_create();
+    m->parser = http_parser_create_response();
+    m->last_active = time_now_ms();
+    ws->open_sockets[fd]->migration = m;
+
+    // from here on, the migration is freed along with its socket
+    if (m->out == NULL || m->parser == NULL || migration_watch(ws, m) < 0) {
+        webserver_remove_socket(ws, fd);
+        return 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Queues a PUT of a key's file, its contents are streamed from the file system's data blocks.
+ * A file that has been deleted since it has been found is skipped.
+ * @return 1 if the PUT has been queued, 0 if the file has been skipped, -1 on error.
+ */
+static int migration_send_key(migration *m, migration_key *key, file_system *fs) {
+    char path[MIGRATION_PATH_LENGTH];
+    migration_path(key->name, path);
+
+    fs_lock_write(fs);
+    int ino = fs_lookup(fs, path);
+    if (ino == -1 || fs->inodes[ino].n_type != fil) {
+        fs_unlock(fs);
+        return 0;
+    }
+
+    // the version that is sent is the one deleted later on, the pin keeps it until it has been sent
+    fs_pin(fs, ino);
+    key->ino = ino;
+    key->generation = fs->inodes[ino].generation;
+    uint64_t size = fs->inodes[ino].size;
+    fs_unlock(fs);
+
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(m->addr.sin_addr), host, sizeof(host));
+
+    char head[MIGRATION_PATH_LENGTH + INET_ADDRSTRLEN + 80];
+    int len = snprintf(head, sizeof(head), "PUT %s HTTP/1.1\r\nHost: %s:%u\r\nContent-Length: %lu\r\n\r\n",
+                       path, host, ntohs(m->addr.sin_port), (unsigned long) size);
+
+    char *dest = http_output_reserve_head(m->out, len);
+    if (dest == NULL) {
+        fs_unpin(fs, ino);
+        return -1;
+    }
+    memcpy(dest, head, len);
+
+    if (http_output_commit_head(m->out, len) < 0) {
+        fs_unpin(fs, ino);
+        return -1;
+    }
+
+    return http_output_append_file(m->out, fs, ino, key->generation, size) < 0 ? -1 : 1;
+}
+
+/**
+ * Queues PUTs of further files until MIGRATION_MAX_PIPELINE of them are in flight.
+ * @return 0 on success, -1 on error.
+ */
+static int migration_send(migration *m, file_system *fs) {
+    while (m->next < m->num_keys && m->next - m->first < MIGRATION_MAX_PIPELINE) {
+        int ret = migration_send_key(m, &(m->keys[m->next]), fs);
+        if (ret < 0) return -1;
+
+        if (ret == 0 && m->next == m->first) m->first++; // nothing to wait for
+        m->next++;
+    }
+
+    return 0;
+}
+
+/**
+ * Deletes a file the new owner has stored, unless it has been changed since it was sent.
+ */
+static void migration_remove_key(migration *m, migration_key *key, file_system *fs) {
+    char path[MIGRATION_PATH_LENGTH];
+    migration_path(key->name, path);
+
+    fs_lock_write(fs);
+    if (fs_lookup(fs, path) == key->ino && fs->inodes[key->ino].generation == key->generation && fs_rm(fs, path) == 0) {
+        m->num_moved++;
+    }
+    fs_unlock(fs);
+}
+
+/**
+ * Processes the new owner's responses, in the order the PUTs have been sent.
+ * @return 0 on success, -1 if the connection has failed.
+ */
+static int migration_receive(migration *m, file_system *fs) {
+    while (1) {
+        http_parser_state state = http_parser_execute(m->parser);
+        if (state == HTTP_PARSER_ERROR) return -1;
+        if (state != HTTP_PARSER_DONE) return 0;
+
+        // a response nobody asked for
+        if (m->first == m->next) return -1;
+
+        // a file the new owner hasn't taken (e.g. because the ring has changed again) stays here
+        migration_key *key = &(m->keys[m->first++]);
+        if (m->parser->status_code >= 200 && m->parser->status_code < 300) migration_remove_key(m, key, fs);
+
+        // skipped files aren't waited for
+        while (m->first < m->next && m->keys[m->first].ino == -1) m->first++;
+
+        http_parser_next(m->parser);
+    }
+}
+
+int migration_handle(webserver *ws, open_socket *sock, file_system *fs) {
+    migration *m = sock->migration;
+    if (m == NULL) return -1;
+
+    if (!m->connected) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(m->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) return -1;
+        m->connected = 1;
+    }
+
+    // the socket is edge-triggered, so it is drained completely
+    int closed = 0;
+    while (1) {
+        size_t space = 0;
+        char *dest = http_parser_buffer(m->parser, &space);
+        if (dest == NULL) return -1;
+
+        long n_bytes = socket_receive(&(m->fd), dest, space);
+        if (n_bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) closed = 1;
+            break;
+        }
+
+        if (n_bytes == 0) {
+            closed = 1;
+            break;
+        }
+
+        http_parser_commit(m->parser, n_bytes);
+        m->last_active = time_now_ms();
+
+        if (migration_receive(m, fs) < 0) return -1;
+    }
+
+    // the migration is done once every file has been sent and answered
+    if (m->first == m->num_keys) return -1;
+    if (closed) return -1;
+
+    size_t pending = m->out->pending;
+    if (migration_send(m, fs) < 0 || http_output_flush(m->out, m->fd) < 0) return -1;
+    if (m->first == m->num_keys) return -1;
+
+    // a large file takes a while, the new owner is silent until it has been received
+    if (m->out->pending < pending) m->last_active = time_now_ms();
+
+    return migration_watch(ws, m);
+}
+
+void migration_tick(webserver *ws, file_system *fs) {
+    uint64_t now = time_now_ms();
+
+    // migrations may be freed on the way, so the next one is remembered
+    migration *m = ws->migrations;
+    while (m != NULL) {
+        migration *next = m->next_migration;
+
+        if (m->fd == -1) {
+            if (migration_start(ws, m, fs) != 0) {
+                migration_unlink(ws, m);
+                migration_free(m);
+            }
+        } else if (now - m->last_active >= MIGRATION_TIMEOUT) {
+            debug_print("Key migration timed out.");
+            webserver_remove_socket(ws, m->fd);
+        }
+
+        m = next;
+    }
+}
+
+void migration_release(webserver *ws, open_socket *sock) {
+    migration *m = sock->migration;
+    sock->migration = NULL;
+
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(m->addr.sin_addr), host, sizeof(host));
+
+    char message[INET_ADDRSTRLEN + 64];
+    snprintf(message, sizeof(message), "Handed %d of %d files over to %s:%u.", m->num_moved, m->num_keys, host, ntohs(m->addr.sin_port));
+    debug_print(message);
+
+    migration_unlink(ws, m);
+    migration_free(m);
+}
+
+void migration_free_scheduled(webserver *ws) {
+    migration *m = ws->migrations;
+    while (m != NULL) {
+        migration *next = m->next_migration;
+        if (m->fd == -1) {
+            migration_unlink(ws, m);
+            migration_free(m);
+        }
+        m = next;
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef RN_PRAXIS_MIGRATION_H
+#define RN_PRAXIS_MIGRATION_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "../webserver.h"
+
+#define MIGRATION_DIRECTORY "/dynamic" // Only the files stored via PUT are moved, they all live here
+#define MIGRATION_MAX_PIPELINE 32 // Max. number of PUTs in flight during a key migration
+#define MIGRATION_TIMEOUT 3000 // Max. time (ms) the new owner may stay silent while PUTs are in flight
+
+/**
+ * A file to be moved. It is named by its name, the file may be replaced (get a new inode) before it is sent.
+ */
+typedef struct migration_key {
+    char name[NAME_MAX_LENGTH];
+    int ino; // inode of the version that has been sent, -1 if it hasn't been sent (yet)
+    uint32_t generation; // generation of that version
+} migration_key;
+
+/**
+ * The hand-off of the files a node that has joined is responsible for now, over one connection to it.
+ * The files are sent as pipelined PUTs, each one is only deleted once the new owner has stored it (2xx).
+ */
+typedef struct migration {
+    int fd; // -1 until the migration has been started
+    struct sockaddr_in addr; // the node that has joined
+    uint16_t from; // the keys in (from, to] are moved
+    uint16_t to;
+    unsigned short connected;
+    migration_key *keys;
+    int num_keys;
+    int next; // first key that hasn't been sent yet
+    int first; // first key whose PUT hasn't been answered yet
+    int num_moved;
+    http_output *out; // PUTs that haven't been sent yet
+    http_parser *parser; // responses that haven't been processed yet
+    uint64_t last_active; // time (ms) of the last activity, for timeouts
+    struct migration *next_migration;
+} migration;
+
+/**
+ * Schedules the hand-off of the keys in (from, to] to a node that has joined.
+ * It is started by the next migration_tick. Only worker 0 migrates keys.
+ * @param ws the webserver.
+ * @param from the joined node's predecessor.
+ * @param to the joined node's ID.
+ * @param addr the joined node's address.
+ * @return 0 on success, -1 on error.
+ */
+int migration_schedule(webserver *ws, uint16_t from, uint16_t to, const struct sockaddr_in *addr);
+
+/**
+ * Starts scheduled migrations: finds the files whose keys have moved and connects to their new owner
+ * if there are any. Aborts migrations whose new owner has been silent for MIGRATION_TIMEOUT.
+ * The files of an aborted migration stay where they are.
+ * @param ws the webserver.
+ * @param fs the file system.
+ */
+void migration_tick(webserver *ws, file_system *fs);
+
+/**
+ * Handles an event on a migration's connection: sends further PUTs, deletes the files that have been stored.
+ * @param ws the webserver.
+ * @param sock the migration's socket.
+ * @param fs the file system.
+ * @return 0 when the migration goes on, -1 when it is finished (or has failed) and the socket has to be closed.
+ */
+int migration_handle(webserver *ws, open_socket *sock, file_system *fs);
+
+/**
+ * Frees a migration whose socket is about to be closed. Called by webserver_remove_socket.
+ * @param ws the webserver.
+ * @param sock the migration's socket.
+ */
+void migration_release(webserver *ws, open_socket *sock);
+
+/**
+ * Frees all migrations that haven't been started yet. The started ones are freed with their sockets.
+ * @param ws the webserver.
+ */
+void migration_free_scheduled(webserver *ws);
+
+#endif //RN_PRAXIS_MIGRATION_H
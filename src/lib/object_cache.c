@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "object_cache.h"
+
+object_cache *object_cache_create(size_t capacity, uint64_t ttl) {
+    object_cache *cache = calloc(1, sizeof(object_cache));
+    if (cache == NULL) return NULL;
+
+    cache->capacity = capacity;
+    cache->ttl = ttl;
+
+    // about one bucket per 4 KiB of memory
+    cache->num_buckets = 64;
+    while (cache->num_buckets < 65536 && (size_t) cache->num_buckets * 4096 < capacity) cache->num_buckets *= 2;
+
+    cache->buckets = calloc(cache->num_buckets, sizeof(object_cache_entry*));
+    if (cache->buckets == NULL || pthread_mutex_init(&(cache->lock), NULL) != 0) {
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/**
+ * Frees an entry's memory.
+ */
+static void object_cache_entry_free(object_cache_entry *entry) {
+    free(entry->URI);
+    free(entry->body);
+    free(entry);
+}
+
+void object_cache_free(object_cache *cache) {
+    object_cache_entry *entry = cache->lru_head;
+    while (entry != NULL) {
+        object_cache_entry *next = entry->lru_next;
+        object_cache_entry_free(entry);
+        entry = next;
+    }
+
+    pthread_mutex_destroy(&(cache->lock));
+    free(cache->buckets);
+    free(cache);
+}
+
+/**
+ * Hashes a URI (FNV-1a).
+ */
+static uint32_t object_cache_key(const char *URI) {
+    uint32_t key = 2166136261u;
+    for (const char *c = URI; *c != '\0'; c++) {
+        key ^= (uint8_t) *c;
+        key *= 16777619u;
+    }
+    return key;
+}
+
+/**
+ * Returns the memory an entry accounts for.
+ */
+static size_t object_cache_entry_size(object_cache_entry *entry) {
+    return sizeof(object_cache_entry) + strlen(entry->URI) + 1 + entry->body_length;
+}
+
+/**
+ * Finds the entry of a URI. Has to be called with the cache locked.
+ * @return the entry, NULL if there is none.
+ */
+static object_cache_entry *object_cache_find(object_cache *cache, const char *URI, uint32_t key) {
+    object_cache_entry *entry = cache->buckets[key & (cache->num_buckets - 1)];
+    while (entry != NULL && (entry->key != key || strcmp(entry->URI, URI) != 0)) entry = entry->bucket_next;
+    return entry;
+}
+
+/**
+ * Unlinks an entry from the cache's LRU list.
+ */
+static void object_cache_unlink(object_cache *cache, object_cache_entry *entry) {
+    if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+
+    if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+/**
+ * Links an entry in at the head of the cache's LRU list (most recently used).
+ */
+static void object_cache_link_head(object_cache *cache, object_cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+
+    if (cache->lru_head != NULL) cache->lru_head->lru_prev = entry;
+    else cache->lru_tail = entry;
+    cache->lru_head = entry;
+}
+
+/**
+ * Takes an entry out of the cache. It is freed right away unless it is still acquired,
+ * in which case the last release frees it. Has to be called with the cache locked.
+ */
+static void object_cache_remove(object_cache *cache, object_cache_entry *entry) {
+    object_cache_entry **p = &(cache->buckets[entry->key & (cache->num_buckets - 1)]);
+    while (*p != entry) p = &((*p)->bucket_next);
+    *p = entry->bucket_next;
+
+    object_cache_unlink(cache, entry);
+    cache->size -= object_cache_entry_size(entry);
+    entry->evicted = 1;
+
+    if (entry->refs == 0) object_cache_entry_free(entry);
+}
+
+object_cache_entry *object_cache_acquire(object_cache *cache, const char *URI, unsigned short *fresh) {
+    uint32_t key = object_cache_key(URI);
+
+    pthread_mutex_lock(&(cache->lock));
+
+    object_cache_entry *entry = object_cache_find(cache, URI, key);
+    if (entry == NULL) {
+        cache->misses++;
+        pthread_mutex_unlock(&(cache->lock));
+        return NULL;
+    }
+
+    *fresh = time_now_ms() - entry->validated < cache->ttl;
+    if (*fresh) cache->hits++;
+    else cache->revalidations++;
+
+    entry->refs++;
+    object_cache_unlink(cache, entry);
+    object_cache_link_head(cache, entry);
+
+    pthread_mutex_unlock(&(cache->lock));
+    return entry;
+}
+
+void object_cache_release(object_cache *cache, object_cache_entry *entry) {
+    pthread_mutex_lock(&(cache->lock));
+    int free_entry = --entry->refs == 0 && entry->evicted;
+    pthread_mutex_unlock(&(cache->lock));
+
+    if (free_entry) object_cache_entry_free(entry);
+}
+
+void object_cache_revalidated(object_cache *cache, object_cache_entry *entry) {
+    pthread_mutex_lock(&(cache->lock));
+    entry->validated = time_now_ms();
+    pthread_mutex_unlock(&(cache->lock));
+}
+
+int object_cache_admits(object_cache *cache, size_t body_length) {
+    return body_length <= cache->capacity / OBJECT_CACHE_MAX_FRACTION;
+}
+
+int object_cache_store(object_cache *cache, const char *URI, const char *etag, const char *body, size_t body_length) {
+    if (!object_cache_admits(cache, body_length) || strlen(etag) >= OBJECT_CACHE_ETAG_LENGTH) {
+        object_cache_invalidate(cache, URI);
+        return -1;
+    }
+
+    // the copy is made before locking, the entry isn't visible to anyone else yet
+    object_cache_entry *entry = calloc(1, sizeof(object_cache_entry));
+    if (entry != NULL) {
+        entry->URI = strdup(URI);
+        entry->body = malloc(MAX(body_length, 1));
+    }
+    if (entry == NULL || entry->URI == NULL || entry->body == NULL) {
+        if (entry != NULL) object_cache_entry_free(entry);
+        object_cache_invalidate(cache, URI);
+        return -1;
+    }
+
+    entry->key = object_cache_key(URI);
+    strcpy(entry->etag, etag);
+    memcpy(entry->body, body, body_length);
+    entry->body_length = body_length;
+    entry->validated = time_now_ms();
+    size_t size = object_cache_entry_size(entry);
+
+    pthread_mutex_lock(&(cache->lock));
+
+    object_cache_entry *old = object_cache_find(cache, URI, entry->key);
+    if (old != NULL) object_cache_remove(cache, old);
+
+    while (cache->size + size > cache->capacity && cache->lru_tail != NULL) {
+        object_cache_remove(cache, cache->lru_tail);
+        cache->evictions++;
+    }
+
+    uint32_t bucket = entry->key & (cache->num_buckets - 1);
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    object_cache_link_head(cache, entry);
+    cache->size += size;
+
+    pthread_mutex_unlock(&(cache->lock));
+    return 0;
+}
+
+void object_cache_invalidate(object_cache *cache, const char *URI) {
+    uint32_t key = object_cache_key(URI);
+
+    pthread_mutex_lock(&(cache->lock));
+    object_cache_entry *entry = object_cache_find(cache, URI, key);
+    if (entry != NULL) object_cache_remove(cache, entry);
+    pthread_mutex_unlock(&(cache->lock));
+}
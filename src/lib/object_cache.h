@@ -0,0 +1,117 @@
+#ifndef RN_PRAXIS_OBJECT_CACHE_H
+#define RN_PRAXIS_OBJECT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define OBJECT_CACHE_SIZE (16 * 1024 * 1024) // Default memory (bytes) for cached objects, can be overridden via env OBJECT_CACHE_SIZE (0 disables the cache)
+#define OBJECT_CACHE_TTL 1000 // Default time (ms) a cached object is served without asking its owner, can be overridden via env OBJECT_CACHE_TTL
+#define OBJECT_CACHE_MAX_FRACTION 8 // Objects larger than 1/8 of the cache's memory aren't cached
+#define OBJECT_CACHE_ETAG_LENGTH 64
+
+/**
+ * A copy of an object owned by another node, as received from it with its ETag.
+ * Entries are immutable once stored: a newer version is stored as a new entry.
+ */
+typedef struct object_cache_entry {
+    char *URI;
+    uint32_t key; // hash of the URI
+    char etag[OBJECT_CACHE_ETAG_LENGTH];
+    char *body;
+    size_t body_length;
+    uint64_t validated; // time (ms) the owner last confirmed the object
+    int refs; // users that have acquired the entry, it isn't freed before they have released it
+    unsigned short evicted; // 1 once the entry has been taken out of the cache
+    struct object_cache_entry *bucket_next;
+    // LRU list (most recently used first)
+    struct object_cache_entry *lru_prev;
+    struct object_cache_entry *lru_next;
+} object_cache_entry;
+
+/**
+ * Memory-capped cache of objects owned by other nodes, shared by all workers.
+ * Entries are found via a hash index (chained buckets) and evicted in LRU order when the memory is used up.
+ * Within ttl ms of its last validation, an object is served as is, afterwards it is revalidated with its owner.
+ */
+typedef struct object_cache {
+    pthread_mutex_t lock;
+    object_cache_entry **buckets; // first entry of each bucket, NULL if none
+    uint32_t num_buckets; // power of 2
+    object_cache_entry *lru_head;
+    object_cache_entry *lru_tail;
+    size_t size; // memory used by the entries in the cache
+    size_t capacity;
+    uint64_t ttl;
+    // statistics
+    uint64_t hits;
+    uint64_t revalidations;
+    uint64_t misses;
+    uint64_t evictions;
+} object_cache;
+
+/**
+ * Creates a new, empty object cache.
+ * @param capacity the memory (bytes) the cached objects may use.
+ * @param ttl the time (ms) an object is served without revalidation.
+ * @return the cache, NULL on error.
+ */
+object_cache *object_cache_create(size_t capacity, uint64_t ttl);
+
+/**
+ * Frees the given cache and all of its entries. No entry may be acquired anymore.
+ * @param cache the cache to be freed.
+ */
+void object_cache_free(object_cache *cache);
+
+/**
+ * Looks up the cached object of a URI and acquires it, so it stays valid until it is released.
+ * @param cache the cache.
+ * @param URI the object's URI.
+ * @param fresh set to 1 if the object may be served as is, 0 if it has to be revalidated first.
+ * @return the entry, NULL if the URI isn't cached.
+ */
+object_cache_entry *object_cache_acquire(object_cache *cache, const char *URI, unsigned short *fresh);
+
+/**
+ * Releases an entry acquired with object_cache_acquire.
+ * @param cache the cache.
+ * @param entry the entry.
+ */
+void object_cache_release(object_cache *cache, object_cache_entry *entry);
+
+/**
+ * Records that the owner has confirmed an acquired entry (304 Not Modified), so it is fresh again.
+ * @param cache the cache.
+ * @param entry the entry.
+ */
+void object_cache_revalidated(object_cache *cache, object_cache_entry *entry);
+
+/**
+ * Checks whether an object of the given size would be cached at all.
+ * @param cache the cache.
+ * @param body_length the length of the object's contents.
+ * @return 1 if it would, 0 if it is too large.
+ */
+int object_cache_admits(object_cache *cache, size_t body_length);
+
+/**
+ * Stores (a copy of) an object received from its owner, replacing the URI's previous version.
+ * Least recently used objects are evicted until it fits.
+ * @param cache the cache.
+ * @param URI the object's URI.
+ * @param etag the object's ETag.
+ * @param body the object's contents.
+ * @param body_length the length of the contents.
+ * @return 0 on success, -1 if the object isn't cached (too large, ETag too long or out of memory).
+ */
+int object_cache_store(object_cache *cache, const char *URI, const char *etag, const char *body, size_t body_length);
+
+/**
+ * Removes the cached object of a URI, e.g. because it has been changed or deleted.
+ * @param cache the cache.
+ * @param URI the object's URI.
+ */
+void object_cache_invalidate(object_cache *cache, const char *URI);
+
+#endif //RN_PRAXIS_OBJECT_CACHE_H
@@ -0,0 +1,441 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "utils.h"
+#include "socket.h"
+#include "proxy.h"
+
+proxy_pool *proxy_pool_create(void) {
+    return calloc(1, sizeof(proxy_pool));
+}
+
+void proxy_pool_free(proxy_pool *pool) {
+    proxy_peer *peer = pool->peers;
+    while (peer != NULL) {
+        proxy_peer *next = peer->next;
+        free(peer);
+        peer = next;
+    }
+
+    free(pool);
+}
+
+/**
+ * Finds the pool's entry of a peer, creating it if there is none yet.
+ * @return the peer, NULL on error.
+ */
+static proxy_peer *proxy_find_peer(proxy_pool *pool, const struct sockaddr_in *addr) {
+    for (proxy_peer *peer = pool->peers; peer != NULL; peer = peer->next) {
+        if (peer->addr.sin_addr.s_addr == addr->sin_addr.s_addr && peer->addr.sin_port == addr->sin_port) return peer;
+    }
+
+    proxy_peer *peer = calloc(1, sizeof(proxy_peer));
+    if (peer == NULL) return NULL;
+
+    peer->addr = *addr;
+    peer->next = pool->peers;
+    pool->peers = peer;
+    return peer;
+}
+
+/**
+ * Takes an upstream connection out of its peer's connections, so no further requests are forwarded over it.
+ */
+static void proxy_detach(proxy_upstream *up) {
+    proxy_peer *peer = up->peer;
+    if (peer == NULL) return;
+
+    for (int i = 0; i < peer->num_conns; i++) {
+        if (peer->conns[i] != up) continue;
+
+        peer->conns[i] = peer->conns[--peer->num_conns];
+        peer->conns[peer->num_conns] = NULL;
+        break;
+    }
+
+    up->peer = NULL;
+}
+
+/**
+ * Opens a new (non-blocking) upstream connection to a peer and registers it with the webserver.
+ * @return the connection, NULL on error.
+ */
+static proxy_upstream *proxy_connect(webserver *ws, proxy_peer *peer) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return NULL;
+
+    if (socket_set_nonblocking(fd) < 0
+        || (connect(fd, (struct sockaddr *) &(peer->addr), sizeof(peer->addr)) < 0 && errno != EINPROGRESS)
+        || webserver_add_socket(ws, fd, PROXY, 0) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    proxy_upstream *up = calloc(1, sizeof(proxy_upstream));
+    if (up != NULL) {
+        up->out = http_output_create();
+        up->parser = http_parser_create_response();
+    }
+
+    if (up == NULL || up->out == NULL || up->parser == NULL) {
+        if (up != NULL && up->out != NULL) http_output_free(up->out);
+        if (up != NULL && up->parser != NULL) http_parser_free(up->parser);
+        free(up);
+        webserver_remove_socket(ws, fd);
+        return NULL;
+    }
+
+    up->fd = fd;
+    up->peer = peer;
+    up->last_active = time_now_ms();
+    ws->open_sockets[fd]->proxy = up;
+    peer->conns[peer->num_conns++] = up;
+
+    return up;
+}
+
+/**
+ * Watches an upstream connection for POLLOUT while it is connecting or has unsent requests.
+ * @return 0 on success, -1 on error.
+ */
+static int proxy_watch(webserver *ws, proxy_upstream *up) {
+    open_socket *sock = ws->open_sockets[up->fd];
+
+    short events = POLLIN;
+    if (!up->connected || up->out->pending > 0) events |= POLLOUT;
+    if (events == sock->events) return 0;
+
+    if (event_loop_modify(ws->loop, up->fd, events, 1) < 0) return -1;
+    sock->events = events;
+    return 0;
+}
+
+int proxy_forward(webserver *ws, open_socket *sock, http_request *req, dht_neighbor *peer, object_cache_entry *cached) {
+    proxy_peer *p = proxy_find_peer(ws->proxy, &(peer->addr));
+    if (p == NULL) return -1;
+
+    // the least busy connection is used, another one is opened rather than pipelining behind a request in flight
+    proxy_upstream *up = NULL;
+    for (int i = 0; i < p->num_conns; i++) {
+        if (up == NULL || p->conns[i]->num_waiting < up->num_waiting) up = p->conns[i];
+    }
+    if ((up == NULL || up->num_waiting > 0) && p->num_conns < PROXY_MAX_CONNECTIONS) {
+        proxy_upstream *new_up = proxy_connect(ws, p);
+        if (new_up != NULL) up = new_up;
+    }
+    if (up == NULL || up->num_waiting >= PROXY_MAX_PIPELINE) return -1;
+
+    // the URI is kept for the object cache, the client (and with it the request) may be gone once the response arrives
+    char *URI = NULL;
+    if (ws->objects != NULL && (URI = strdup(req->header->URI)) == NULL) return -1;
+
+    // as is the client's condition, if it is replaced by the one revalidating the copy
+    char *if_none_match = NULL;
+    int field_index;
+    if (cached != NULL && http_has_header_field(req, "If-None-Match", &field_index)
+        && (if_none_match = strdup(req->header->fields[field_index].value)) == NULL) {
+        free(URI);
+        return -1;
+    }
+
+    if (http_proxy_write_request(ws, req, peer, (cached != NULL) ? cached->etag : NULL, up->out) < 0) {
+        free(URI);
+        free(if_none_match);
+        return -1;
+    }
+
+    if (up->num_waiting == 0) up->last_active = time_now_ms();
+    proxy_request *r = &(up->waiting[(up->first + up->num_waiting) % PROXY_MAX_PIPELINE]);
+    r->client = sock;
+    r->cached = cached;
+    r->URI = URI;
+    r->if_none_match = if_none_match;
+    r->is_get = strncmp(req->header->method, "GET", 3) == 0;
+    up->num_waiting++;
+    sock->upstream = up;
+
+    // an established connection takes the request right away, otherwise it is sent once the connection is writable
+    if (up->connected && http_output_flush(up->out, up->fd) < 0) debug_print("Could not send to upstream.");
+    proxy_watch(ws, up);
+
+    return 0;
+}
+
+/**
+ * Frees what a request in flight holds.
+ */
+static void proxy_request_clear(webserver *ws, proxy_request *r) {
+    if (r->cached != NULL) object_cache_release(ws->objects, r->cached);
+    free(r->URI);
+    free(r->if_none_match);
+    memset(r, 0, sizeof(proxy_request));
+}
+
+/**
+ * Ends the wait of an upstream connection's first client, which continues with its next request.
+ * @return the client, NULL if it has gone.
+ */
+static open_socket *proxy_pop(webserver *ws, proxy_upstream *up) {
+    open_socket *client = up->waiting[up->first].client;
+    proxy_request_clear(ws, &(up->waiting[up->first]));
+    up->first = (up->first + 1) % PROXY_MAX_PIPELINE;
+    up->num_waiting--;
+    up->head_relayed = 0;
+    up->body_kept = 0;
+    up->body_relayed = 0;
+
+    if (client != NULL) {
+        client->upstream = NULL;
+        http_parser_next(client->parser);
+    }
+
+    return client;
+}
+
+/**
+ * Serves a client again, e.g. after output has been appended or its wait has ended.
+ */
+static void proxy_resume(webserver *ws, open_socket *client, file_system *fs) {
+    int fd = client->fd;
+    if (http_handle(&fd, ws, fs) < 0) webserver_remove_socket(ws, fd);
+}
+
+/**
+ * Answers all requests in flight on an upstream connection that has failed and takes it out of the pool.
+ * A client whose response has been relayed partially already is closed, as its response can't be completed.
+ * The connection itself has to be closed by the caller.
+ */
+static void proxy_fail(webserver *ws, proxy_upstream *up, file_system *fs, int status_code) {
+    debug_print("Upstream connection failed.");
+    proxy_detach(up);
+
+    while (up->num_waiting > 0) {
+        int partial = up->head_relayed;
+        open_socket *client = up->waiting[up->first].client;
+        if (client != NULL && !partial) http_proxy_write_error(client, status_code);
+
+        client = proxy_pop(ws, up);
+        if (client == NULL) continue;
+
+        if (partial) webserver_remove_socket(ws, client->fd);
+        else proxy_resume(ws, client, fs);
+    }
+}
+
+/**
+ * Checks whether the response whose head has been parsed is stored in the object cache once it is complete:
+ * an object with an ETag received for a GET, if it isn't too large.
+ * @return 1 if it is, 0 if not.
+ */
+static int proxy_cacheable(webserver *ws, proxy_request *r, http_parser *parser) {
+    if (r->URI == NULL || !r->is_get || parser->status_code != 200) return 0;
+
+    http_parser_field *etag = http_parser_find_field(parser, "ETag");
+    return etag != NULL && etag->value.length < OBJECT_CACHE_ETAG_LENGTH && object_cache_admits(ws->objects, parser->content_length);
+}
+
+/**
+ * Updates the object cache with a complete response: a cacheable object is stored,
+ * any other response but a confirmation (304) drops the cached copy.
+ */
+static void proxy_cache_response(webserver *ws, proxy_upstream *up, proxy_request *r, http_parser *parser) {
+    if (parser->status_code == 304) return;
+
+    if (!up->body_kept) {
+        object_cache_invalidate(ws->objects, r->URI);
+        return;
+    }
+
+    http_parser_field *etag = http_parser_find_field(parser, "ETag");
+    char value[OBJECT_CACHE_ETAG_LENGTH];
+    memcpy(value, parser->buf + etag->value.offset, etag->value.length);
+    value[etag->value.length] = '\0';
+    object_cache_store(ws->objects, r->URI, value, parser->buf + parser->body_offset, parser->content_length);
+}
+
+/**
+ * Relays the responses received on an upstream connection to the waiting clients, the body as it arrives.
+ * A 304 confirming a cached copy is answered with the copy.
+ * @return 0 on success, -1 if the connection has failed.
+ */
+static int proxy_relay(webserver *ws, proxy_upstream *up, file_system *fs) {
+    http_parser *parser = up->parser;
+
+    while (1) {
+        http_parser_state state = http_parser_execute(parser);
+        if (state == HTTP_PARSER_ERROR) return -1;
+        if (state != HTTP_PARSER_BODY && state != HTTP_PARSER_DONE) return 0;
+
+        // a response nobody asked for
+        if (up->num_waiting == 0) return -1;
+
+        proxy_request *r = &(up->waiting[up->first]);
+        open_socket *client = r->client;
+        if (!up->head_relayed) {
+            // a response isn't relayed if it is larger than the parser would hold, even if its body isn't kept
+            if (parser->content_length > HTTP_PARSER_MAX_SIZE - parser->body_offset) return -1;
+
+            int confirmed = r->cached != NULL && parser->status_code == 304;
+            if (confirmed) object_cache_revalidated(ws->objects, r->cached);
+
+            int ret = 0;
+            if (client != NULL && confirmed) {
+                // the client's response takes over the reference on the copy
+                ret = http_proxy_write_cached(client, ws->objects, r->cached, r->if_none_match);
+                r->cached = NULL;
+            } else if (client != NULL) ret = http_proxy_write_head(client, parser);
+            if (ret < 0) {
+                webserver_remove_socket(ws, client->fd);
+                client = NULL;
+            }
+            up->head_relayed = 1;
+            up->body_kept = proxy_cacheable(ws, r, parser);
+        }
+
+        size_t received = MIN(parser->size - parser->body_offset, parser->content_length);
+        if (received > up->body_relayed) {
+            size_t len = received - up->body_relayed;
+            char *chunk = malloc(len);
+
+            if (client != NULL && chunk != NULL) {
+                memcpy(chunk, parser->buf + parser->body_offset + up->body_relayed, len);
+                if (http_output_append_body(client->out, chunk, len) < 0) webserver_remove_socket(ws, client->fd);
+            } else free(chunk);
+
+            up->body_relayed = received;
+
+            // a body the object cache doesn't need is dropped as it is relayed, so it isn't held twice
+            if (!up->body_kept) {
+                http_parser_discard_body(parser, received);
+                up->body_relayed = 0;
+            }
+        }
+
+        if (state != HTTP_PARSER_DONE) {
+            if (client != NULL && up->waiting[up->first].client == client) proxy_resume(ws, client, fs);
+            return 0;
+        }
+
+        if (r->URI != NULL) proxy_cache_response(ws, up, r, parser);
+
+        http_parser_next(parser);
+        client = proxy_pop(ws, up);
+        if (client != NULL) proxy_resume(ws, client, fs);
+    }
+}
+
+int proxy_handle(webserver *ws, open_socket *sock, file_system *fs) {
+    proxy_upstream *up = sock->proxy;
+    if (up == NULL) return -1;
+
+    if (!up->connected) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(up->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err != 0) {
+            proxy_fail(ws, up, fs, 502);
+            return -1;
+        }
+        up->connected = 1;
+    }
+
+    if (http_output_flush(up->out, up->fd) < 0) {
+        proxy_fail(ws, up, fs, 502);
+        return -1;
+    }
+
+    // the socket is edge-triggered, so it is drained completely
+    int closed = 0;
+    while (1) {
+        size_t space = 0;
+        char *dest = http_parser_buffer(up->parser, &space);
+        if (dest == NULL) break; // response too large, answered as failed below
+
+        long n_bytes = socket_receive(&(up->fd), dest, space);
+        if (n_bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) closed = 1;
+            break;
+        }
+
+        if (n_bytes == 0) {
+            closed = 1;
+            break;
+        }
+
+        http_parser_commit(up->parser, n_bytes);
+        up->last_active = time_now_ms();
+
+        if (proxy_relay(ws, up, fs) < 0) {
+            proxy_fail(ws, up, fs, 502);
+            return -1;
+        }
+    }
+
+    if (up->parser->state == HTTP_PARSER_ERROR || (closed && up->num_waiting > 0)) {
+        proxy_fail(ws, up, fs, 502);
+        return -1;
+    }
+
+    // a connection closed by the peer while idle is simply dropped
+    if (closed) {
+        proxy_detach(up);
+        return -1;
+    }
+
+    if (proxy_watch(ws, up) < 0) {
+        proxy_fail(ws, up, fs, 502);
+        return -1;
+    }
+
+    return 0;
+}
+
+void proxy_tick(webserver *ws, file_system *fs) {
+    uint64_t now = time_now_ms();
+
+    for (proxy_peer *peer = ws->proxy->peers; peer != NULL; peer = peer->next) {
+        // connections that are closed are taken out of the peer's list, so it is walked backwards
+        for (int i = peer->num_conns - 1; i >= 0; i--) {
+            if (i >= peer->num_conns) continue;
+            proxy_upstream *up = peer->conns[i];
+            int fd = up->fd;
+
+            if (up->num_waiting > 0 && now - up->last_active >= PROXY_TIMEOUT) {
+                proxy_fail(ws, up, fs, 504);
+                webserver_remove_socket(ws, fd);
+            } else if (up->num_waiting == 0 && now - up->last_active >= PROXY_IDLE_TIMEOUT) {
+                proxy_detach(up);
+                webserver_remove_socket(ws, fd);
+            }
+        }
+    }
+}
+
+void proxy_cancel(open_socket *sock) {
+    proxy_upstream *up = sock->upstream;
+    sock->upstream = NULL;
+
+    // the response is still received, but dropped
+    for (int i = 0; i < up->num_waiting; i++) {
+        int k = (up->first + i) % PROXY_MAX_PIPELINE;
+        if (up->waiting[k].client == sock) up->waiting[k].client = NULL;
+    }
+}
+
+void proxy_release(webserver *ws, open_socket *sock) {
+    proxy_upstream *up = sock->proxy;
+    sock->proxy = NULL;
+
+    proxy_detach(up);
+    for (int i = 0; i < up->num_waiting; i++) {
+        proxy_request *r = &(up->waiting[(up->first + i) % PROXY_MAX_PIPELINE]);
+        if (r->client != NULL) r->client->upstream = NULL;
+        proxy_request_clear(ws, r);
+    }
+
+    http_output_free(up->out);
+    http_parser_free(up->parser);
+    free(up);
+}
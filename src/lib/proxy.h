@@ -0,0 +1,118 @@
+#ifndef RN_PRAXIS_PROXY_H
+#define RN_PRAXIS_PROXY_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "../webserver.h"
+#include "http.h"
+#include "object_cache.h"
+
+#define PROXY_MAX_CONNECTIONS 4 // Max. number of upstream connections per peer and worker
+#define PROXY_MAX_PIPELINE 32 // Max. number of requests in flight on one upstream connection
+#define PROXY_TIMEOUT 1500 // Max. time (ms) an upstream connection may stay silent while requests are in flight
+#define PROXY_IDLE_TIMEOUT 2000 // Time (ms) after which idle upstream connections are closed (before the peer closes them)
+
+/**
+ * A request in flight on an upstream connection.
+ */
+typedef struct proxy_request {
+    open_socket *client; // NULL if the client has gone since
+    object_cache_entry *cached; // acquired copy of the object, revalidated by the request (NULL if none)
+    char *URI; // the request's URI if its response updates the object cache, NULL if it doesn't
+    char *if_none_match; // the client's own condition, checked against a confirmed copy (NULL if none)
+    unsigned short is_get;
+} proxy_request;
+
+/**
+ * A persistent connection to a peer, over which requests are pipelined.
+ * Its responses are relayed to the waiting clients in request order.
+ */
+typedef struct proxy_upstream {
+    int fd;
+    struct proxy_peer *peer; // NULL once the connection has been taken out of the pool
+    unsigned short connected;
+    http_output *out; // requests that haven't been sent yet
+    http_parser *parser; // responses that haven't been relayed yet
+    // requests waiting for responses, in request order (ring buffer)
+    proxy_request waiting[PROXY_MAX_PIPELINE];
+    int first;
+    int num_waiting;
+    unsigned short head_relayed; // 1 if the head of the current response has been relayed
+    unsigned short body_kept; // 1 if the current response's body is kept for the object cache until it is complete
+    size_t body_relayed; // bytes of the current response's body in the parser's buffer that have been relayed
+    uint64_t last_active; // time (ms) of the last activity, for timeouts
+} proxy_upstream;
+
+typedef struct proxy_peer {
+    struct sockaddr_in addr;
+    proxy_upstream *conns[PROXY_MAX_CONNECTIONS];
+    int num_conns;
+    struct proxy_peer *next;
+} proxy_peer;
+
+/**
+ * The upstream connections of one worker, grouped by peer.
+ */
+typedef struct proxy_pool {
+    proxy_peer *peers;
+} proxy_pool;
+
+/**
+ * Creates a new, empty pool.
+ * @return the pool, NULL on error.
+ */
+proxy_pool *proxy_pool_create(void);
+
+/**
+ * Frees the given pool. Its connections have to be closed (webserver_remove_socket) before.
+ * @param pool the pool to be freed.
+ */
+void proxy_pool_free(proxy_pool *pool);
+
+/**
+ * Forwards a client's request to a peer over one of the pool's connections to it, opening one if
+ * all are busy and the limit isn't reached yet. The client doesn't read any further requests until
+ * the response has been relayed to it. GET responses with an ETag are stored in the webserver's object cache.
+ * @param ws the webserver (its pool is used).
+ * @param sock the client's connection.
+ * @param req the request.
+ * @param peer the peer to forward the request to.
+ * @param cached acquired, stale copy of the requested object that is revalidated with the request, NULL if none.
+ * If the request is forwarded, the copy is released once the response has arrived.
+ * @return 0 if the request has been forwarded, -1 if it can't be (e.g. all connections to the peer are full).
+ */
+int proxy_forward(webserver *ws, open_socket *sock, http_request *req, dht_neighbor *peer, object_cache_entry *cached);
+
+/**
+ * Handles an event on an upstream connection: sends queued requests, relays received responses.
+ * @param ws the webserver.
+ * @param sock the upstream connection's socket.
+ * @param fs the file system, needed to serve the clients' further requests.
+ * @return 0 when the connection is still alive, -1 when the socket has to be closed.
+ */
+int proxy_handle(webserver *ws, open_socket *sock, file_system *fs);
+
+/**
+ * Answers the requests in flight on upstream connections that have been silent for PROXY_TIMEOUT
+ * with 504 and closes them, as well as connections that have been idle for PROXY_IDLE_TIMEOUT.
+ * @param ws the webserver.
+ * @param fs the file system.
+ */
+void proxy_tick(webserver *ws, file_system *fs);
+
+/**
+ * Detaches a client that is about to be closed from the upstream connection its request waits on.
+ * Called by webserver_remove_socket.
+ * @param sock the client's connection.
+ */
+void proxy_cancel(open_socket *sock);
+
+/**
+ * Frees the state of an upstream connection that is about to be closed, its remaining clients are detached.
+ * Called by webserver_remove_socket.
+ * @param ws the webserver.
+ * @param sock the upstream connection's socket.
+ */
+void proxy_release(webserver *ws, open_socket *sock);
+
+#endif //RN_PRAXIS_PROXY_H
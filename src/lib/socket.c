@@ -1,5 +1,11 @@
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg / sendmmsg
+#endif
 #include <string.h>
+#include <errno.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "utils.h"
 #include "socket.h"
 
@@ -11,8 +17,15 @@ int socket_accept(int *sockfd) {
     return accept(*sockfd, (struct sockaddr*) &in_addr, &in_addr_size);
 }
 
-int socket_open(webserver *ws, int socktype) {
-    if (ws->num_open_sockets >= MAX_NUM_OPEN_SOCKETS) {
+int socket_set_nonblocking(int sockfd) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0) return -1;
+
+    return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int socket_open(webserver *ws, int socktype, const char *port) {
+    if (ws->num_open_sockets >= ws->max_open_sockets) {
         perror("Maximum number of open open_sockets reached.");
         return -1;
     }
@@ -24,116 +37,157 @@ int socket_open(webserver *ws, int socktype) {
     hints.ai_socktype = socktype;
     hints.ai_flags = AI_PASSIVE;
 
-    if (getaddrinfo(ws->HOST, ws->PORT, &hints, &res) != 0) return -1;
+    if (getaddrinfo(ws->HOST, (port != NULL) ? port : ws->PORT, &hints, &res) != 0) return -1;
 
     int sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sockfd < 0) return -1;
+    if (sockfd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
 
     int option = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
 
-    if (bind(sockfd, res->ai_addr, res->ai_addrlen) < 0) return -1;
+    // every worker binds its own listener to the same port, the kernel balances connections between them
+    if (socktype == SOCK_STREAM && ws->num_workers > 1) {
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option));
+    }
 
-    if (socktype == SOCK_STREAM) {
-        listen(sockfd, BACKLOG_COUNT);
-        ws->open_sockets_config[ws->num_open_sockets].protocol = 0;
-    } else {
-        ws->open_sockets_config[ws->num_open_sockets].protocol = 1;
+    // the kernel caps it at its own maximum
+    if (socktype == SOCK_DGRAM) {
+        int bufsize = SOCKET_DGRAM_BUFFER;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
     }
 
-    ws->open_sockets[ws->num_open_sockets].fd = sockfd;
-    ws->open_sockets[ws->num_open_sockets].events = POLLIN | POLLOUT;
-    ws->open_sockets_config[ws->num_open_sockets].is_server_socket = 1;
-    ws->num_open_sockets++;
+    int bound = bind(sockfd, res->ai_addr, res->ai_addrlen);
     freeaddrinfo(res);
-    return 0;
+    if (bound < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    enum connection_protocol protocol = UDP;
+    if (socktype == SOCK_STREAM) {
+        // the listening socket is drained edge-triggered, so it must not block
+        if (socket_set_nonblocking(sockfd) < 0 || listen(sockfd, BACKLOG_COUNT) < 0) {
+            close(sockfd);
+            return -1;
+        }
+        protocol = TCP;
+    }
+
+    if (webserver_add_socket(ws, sockfd, protocol, 1) < 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
 }
 
-int socket_send(webserver *ws, int *sockfd, char *msg, unsigned int msg_len, char *dest_ip, char *dest_port) {
+int socket_send(int *sockfd, char *msg, unsigned int msg_len, const struct sockaddr_in *dest) {
     debug_printv("Sending message:", msg);
 
-    if (dest_ip == NULL) dest_ip = ws->HOST;
-    if (dest_port == NULL) dest_port = ws->PORT;
+    while (1) {
+        if (sendto(*sockfd, msg, msg_len, MSG_NOSIGNAL, (const struct sockaddr *) dest, sizeof(struct sockaddr_in)) >= 0) return 0;
+        if (errno == EINTR) continue;
 
-    struct addrinfo hints, *res;
+        // the socket's send buffer is full -> waiting until it can take more data
+        struct pollfd pfd = {*sockfd, POLLOUT, 0};
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && poll(&pfd, 1, SEND_TIMEOUT) > 0) continue;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_flags = AI_PASSIVE;
+        return -1;
+    }
+}
 
-    if (getaddrinfo(dest_ip, dest_port, &hints, &res) != 0) return -1;
+int socket_send_batch(int *sockfd, socket_datagram *dgrams, unsigned int num_dgrams) {
+    if (num_dgrams > SOCKET_BATCH_SIZE) num_dgrams = SOCKET_BATCH_SIZE;
+
+    int num_sent = 0;
+#ifdef __linux__
+    struct mmsghdr msgs[SOCKET_BATCH_SIZE];
+    struct iovec iovs[SOCKET_BATCH_SIZE];
+    memset(msgs, 0, num_dgrams * sizeof(struct mmsghdr));
+
+    for (unsigned int i = 0; i < num_dgrams; i++) {
+        iovs[i].iov_base = dgrams[i].data;
+        iovs[i].iov_len = dgrams[i].len;
+        msgs[i].msg_hdr.msg_name = &(dgrams[i].addr);
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &(iovs[i]);
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    unsigned long bytes_sent = 0;
-    while (bytes_sent < msg_len) {
-        int ret = sendto(*sockfd, msg + bytes_sent, msg_len - bytes_sent, 0, res->ai_addr, res->ai_addrlen);
-        if (ret < 0) return -1;
+    unsigned int i = 0;
+    while (i < num_dgrams) {
+        int ret = sendmmsg(*sockfd, msgs + i, num_dgrams - i, MSG_NOSIGNAL);
+        if (ret > 0) {
+            num_sent += ret;
+            i += ret;
+            continue;
+        }
 
-        bytes_sent += ret;
+        // the datagram at i couldn't be sent, sendto decides whether to wait or to skip it
+        if (socket_send(sockfd, dgrams[i].data, dgrams[i].len, &(dgrams[i].addr)) == 0) num_sent++;
+        i++;
+    }
+#else
+    for (unsigned int i = 0; i < num_dgrams; i++) {
+        if (socket_send(sockfd, dgrams[i].data, dgrams[i].len, &(dgrams[i].addr)) == 0) num_sent++;
     }
+#endif
 
-    return 0;
+    return num_sent;
 }
 
-int socket_receive_all(int *in_fd, char *buf, size_t bufsize) {
-    unsigned int bytes_received = 0;
-    unsigned int content_length = 0;
-    memset(buf, 0, bufsize);
-
-    long body_size = -1;
-    char *empty_line = NULL;
+int socket_receive_batch(int *sockfd, socket_datagram *dgrams, unsigned int num_dgrams) {
+    if (num_dgrams > SOCKET_BATCH_SIZE) num_dgrams = SOCKET_BATCH_SIZE;
+
+#ifdef __linux__
+    struct mmsghdr msgs[SOCKET_BATCH_SIZE];
+    struct iovec iovs[SOCKET_BATCH_SIZE];
+    memset(msgs, 0, num_dgrams * sizeof(struct mmsghdr));
+
+    for (unsigned int i = 0; i < num_dgrams; i++) {
+        iovs[i].iov_base = dgrams[i].data;
+        iovs[i].iov_len = dgrams[i].len;
+        msgs[i].msg_hdr.msg_name = &(dgrams[i].addr);
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &(iovs[i]);
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    // Receiving until buffer ends with CLRF (except last byte which is \0)
-    while (empty_line == NULL || body_size < content_length) {
-        if (bytes_received >= bufsize - 1) {
-            perror("Buffer full before entire package read.");
-            return -1;
-        }
+    int ret = recvmmsg(*sockfd, msgs, num_dgrams, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < ret; i++) {
+        dgrams[i].len = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? dgrams[i].len + 1 : msgs[i].msg_len;
+    }
+#else
+    int ret = 0;
+    for (; ret < (int) num_dgrams; ret++) {
+        struct iovec iov = {.iov_base = dgrams[ret].data, .iov_len = dgrams[ret].len};
+        struct msghdr msg = {0};
+        msg.msg_name = &(dgrams[ret].addr);
+        msg.msg_namelen = sizeof(struct sockaddr_in);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        long n_bytes = recvmsg(*sockfd, &msg, MSG_DONTWAIT);
+        if (n_bytes < 0) break;
+        dgrams[ret].len = (msg.msg_flags & MSG_TRUNC) ? dgrams[ret].len + 1 : (size_t) n_bytes;
+    }
+    if (ret == 0) return -1;
+#endif
 
-        debug_print("Receiving data...");
-        // Receiving data from stream once
-        int n_bytes = recvfrom(
-                        *in_fd,
-                        // buffer[0 - bytes_received-1] is full of data,
-                        // buffer[bytes_received] is where we want to continue to write (the next first byte)
-                        buf + bytes_received,
-                        // the size of the space from buffer[bytes_received] to buffer[bufsize-1]
-                        (bufsize-1) - bytes_received,
-                        0,
-                        NULL,
-                        NULL
-                    );
-        // printf("Received %d bytes.\n", n_bytes);
-
-        if (n_bytes == -1 || n_bytes == 0) return -1;
-
-        bytes_received += n_bytes;
-
-        // Catch existing Content-Length header and expect reading body
-        char *content_length_header_line = strstr(buf, "\r\nContent-Length: ");
-        if (content_length_header_line != NULL && content_length == 0) { // Request has content and content_length haven't been set yet
-            char *content_length_str = content_length_header_line + 18;
-
-            content_length = strtol(content_length_str, NULL, 10);
-            debug_printv("Found Content-Length Header: %d", content_length_str);
-            body_size = 0; // because of initial -2
-        }
+    if (ret > 0) debug_print("Received datagrams.");
+    return ret;
+}
 
-        empty_line = strstr(buf, "\r\n\r\n");
-        if (empty_line != NULL) {
-            if (content_length == 0) {
-                break; // Found empy line and no content length header -> end of message
-            } else {
-                body_size += bytes_received - ((empty_line+4) - buf);
-            }
-        }
-    }
+long socket_receive(int *in_fd, char *buf, size_t bufsize) {
+    if (bufsize == 0) return -1;
 
-    // Making sure buffer ends in \0 for safety
-    buf[bufsize-1] = '\0';
-    debug_printv("Full Message: \n------ \n", buf);
-    debug_print("\n-----\n");
+    long n_bytes = recv(*in_fd, buf, bufsize, 0);
+    if (n_bytes > 0) debug_print("Received data.");
 
-    return bytes_received;
+    return n_bytes;
 }
 
 int socket_shutdown(webserver *ws, int *sockfd) {
@@ -141,16 +195,9 @@ int socket_shutdown(webserver *ws, int *sockfd) {
 
     if (ws == NULL) return 0;
 
-    // remove socket from open_socket list
-    for (int i = 0; i < MAX_NUM_OPEN_SOCKETS; i++) {
-        if (ws->open_sockets[i].fd == *sockfd) {
-            ws->open_sockets[i].fd = -1;
-            ws->open_sockets[i].events = 0;
-            ws->open_sockets_config[i].is_server_socket = 0;
-            ws->num_open_sockets--;
-            debug_print("Shutting down socket...");
-        }
-    }
+    // remove socket from open_socket table
+    debug_print("Shutting down socket...");
+    webserver_remove_socket(ws, *sockfd);
 
     return 0;
 }
@@ -2,18 +2,39 @@
 #define RN_PRAXIS_SOCKET_H
 
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include "../webserver.h"
 
-#define BACKLOG_COUNT 10
+#define BACKLOG_COUNT SOMAXCONN
+#define SEND_TIMEOUT 1000 // Max. time (ms) to wait for a non-blocking socket to become writable
+#define SOCKET_BATCH_SIZE 32 // Max. number of datagrams received / sent by one batch
+#define SOCKET_DGRAM_BUFFER (1024 * 1024) // Requested receive buffer (bytes) of DGRAM sockets, absorbs bursts of DHT messages
+
+/**
+ * A datagram received or to be sent by a batch.
+ */
+typedef struct socket_datagram {
+    struct sockaddr_in addr; // the sender of a received, the destination of a sent datagram
+    char *data;
+    size_t len; // size of data, set to the number of bytes received by socket_receive_batch (size + 1 if truncated)
+} socket_datagram;
+
+/**
+ * Puts the given socket into non-blocking mode.
+ * @param sockfd the socket's file descriptor
+ * @return 0 on success, -1 on error
+ */
+int socket_set_nonblocking(int sockfd);
 
 /**
  * Opens a listening socket for the given webserver (which provides PORT & HOST).
- * The resulting socket's file descriptor is written to ws->open_sockets.
+ * The resulting socket is added to ws->open_sockets and registered with the webserver's event loop.
  * @param ws the webserver to open the socket for
  * @param socktype socket-type corresponding to the AI_SOCKTYPE of addrinfo
- * @return 0 on success, -1 on error
+ * @param port the port to bind to (e.g. a virtual node's), NULL for the webserver's PORT
+ * @return the socket's file descriptor on success, -1 on error
  */
-int socket_open(webserver *ws, int socktype);
+int socket_open(webserver *ws, int socktype, const char *port);
 
 /**
  * Accepts connections on a given socket and fills `in_fd` with the connection's file descriptor.
@@ -24,24 +45,45 @@ int socket_accept(int *sockfd);
 
 
 /**
- * Accepts connections on a given socket and fills `in_fd` with the connection's file descriptor.
- * @param ws this webserver
- * @param sockfd accepting socket's file descriptor
+ * Sends a datagram to the given address.
+ * @param sockfd the (DGRAM) socket's file descriptor
  * @param msg the message to be sent
- * @param dest_ip the destination address
- * @param dest_port the destination port
+ * @param msg_len the message's length
+ * @param dest the destination address
  * @return 0 on success, -1 on error (just like sys/send)
  */
-int socket_send(webserver *ws, int *sockfd, char *msg, unsigned int msg_len, char *dest_ip, char *dest_port);
+int socket_send(int *sockfd, char *msg, unsigned int msg_len, const struct sockaddr_in *dest);
+
+/**
+ * Sends a batch of datagrams with as few system calls as possible (sendmmsg where available).
+ * A datagram that can't be sent is skipped, the rest of the batch is still sent.
+ * @param sockfd the (DGRAM) socket's file descriptor
+ * @param dgrams the datagrams to be sent
+ * @param num_dgrams the number of datagrams, at most SOCKET_BATCH_SIZE
+ * @return the number of datagrams sent
+ */
+int socket_send_batch(int *sockfd, socket_datagram *dgrams, unsigned int num_dgrams);
+
+/**
+ * Receives the datagrams currently queued on a socket, without waiting for more
+ * (with recvmmsg where available). Datagrams longer than their buffer are truncated,
+ * their len is set to the buffer's size + 1, so they can be told apart from ones that fit exactly.
+ * @param sockfd the (DGRAM) socket's file descriptor
+ * @param dgrams buffers for the datagrams, filled with their senders and lengths
+ * @param num_dgrams the number of buffers, at most SOCKET_BATCH_SIZE
+ * @return the number of datagrams received, -1 on error (errno is EAGAIN / EWOULDBLOCK if none is queued)
+ */
+int socket_receive_batch(int *sockfd, socket_datagram *dgrams, unsigned int num_dgrams);
 
 /**
- * Receives data from an incoming socket, until CRLF is received.
+ * Receives the data currently available on a non-blocking socket, without waiting for more.
  * @param in_fd incoming socket file descriptor
  * @param buf char buffer to write data to
  * @param bufsize size of buf
- * @return number of bytes received on success, -1 on error
+ * @return number of bytes received, 0 if the peer closed the connection, -1 on error
+ * (errno is EAGAIN / EWOULDBLOCK if no data is available right now)
  */
-int socket_receive_all(int *in_fd, char *buf, size_t bufsize);
+long socket_receive(int *in_fd, char *buf, size_t bufsize);
 
 /**
  * Shuts both sides of a given socket down.
@@ -1,5 +1,6 @@
 #include "udp.h"
 #include "utils.h"
+#include "migration.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -7,127 +8,150 @@
 #include <arpa/inet.h>
 #include <errno.h>
 
-udp_packet* udp_packet_create(udp_packet_type type, uint16_t hash, uint16_t node_id, char *node_ip, char *node_port) {
-    udp_packet *pkt = calloc(1, sizeof(udp_packet));
-
-    pkt->bytesize = 0;
-    pkt->node_port = 0;
-    pkt->node_ip = calloc(HOSTNAME_MAX_LENGTH, sizeof(char));
-
-    if (node_ip != NULL) {
-        strncpy(pkt->node_ip, node_ip, MIN(HOSTNAME_MAX_LENGTH-1, strlen(node_ip)));
-    }
-    if (node_port != 0) {
-        pkt->node_port = strtol(node_port, NULL, 10);
-    }
-
+void udp_packet_init(udp_packet *pkt, udp_packet_type type, uint16_t hash, uint16_t node_id, const struct sockaddr_in *node_addr) {
     pkt->type = type;
     pkt->hash = hash;
     pkt->node_id = node_id;
+    pkt->node_ip = node_addr->sin_addr;
+    pkt->node_port = ntohs(node_addr->sin_port);
+}
+
+void udp_packet_encode(const udp_packet *pkt, char *buf) {
+    udp_wire_packet wire;
+    wire.type = pkt->type;
+    wire.hash = htons(pkt->hash);
+    wire.node_id = htons(pkt->node_id);
+    wire.node_ip = pkt->node_ip.s_addr;
+    wire.node_port = htons(pkt->node_port);
 
-    return pkt;
+    memcpy(buf, &wire, UDP_DATA_SIZE);
+}
+
+int udp_packet_decode(const char *buf, size_t len, udp_packet *pkt) {
+    // every message fits into one datagram, shorter (or longer) ones are malformed
+    if (len != UDP_DATA_SIZE) return -1;
+
+    udp_wire_packet wire;
+    memcpy(&wire, buf, UDP_DATA_SIZE);
+    if (wire.type > JOIN) return -1;
+
+    pkt->type = wire.type;
+    pkt->hash = ntohs(wire.hash);
+    pkt->node_id = ntohs(wire.node_id);
+    pkt->node_ip.s_addr = wire.node_ip;
+    pkt->node_port = ntohs(wire.node_port);
+
+    return 0;
 }
 
 /**
- * TODO: Doc this
+ * Fills a socket address with the address of the node named by a packet.
  */
-dht_neighbor* dht_neighbor_from_packet(udp_packet *pkt) {
-    dht_neighbor *n = calloc(1, sizeof(dht_neighbor));
-    n->PORT = calloc(7, sizeof(char));
-    n->IP = calloc(HOSTNAME_MAX_LENGTH, sizeof(char));
+static void udp_packet_address(const udp_packet *pkt, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr = pkt->node_ip;
+    addr->sin_port = htons(pkt->node_port);
+}
 
-    strcpy(n->IP, pkt->node_ip);
-    snprintf(n->PORT, 6, "%d", pkt->node_port);
-    n->ID = pkt->node_id;
+/**
+ * Creates a dht_neighbor-object for the node named by a packet.
+ * @return A dht_neighbor object on success, NULL on error.
+ */
+static dht_neighbor* dht_neighbor_from_packet(udp_packet *pkt) {
+    struct sockaddr_in addr;
+    udp_packet_address(pkt, &addr);
 
-    return n;
+    return dht_neighbor_create(pkt->node_id, &addr);
 }
 
 /**
- * Serializes a UDP packet into a byte-array.
- * @param pkt
- * @return
+ * Determines whether a packet names the given node.
+ * @return 1 if it does, 0 if not.
  */
-char* udp_packet_serialize(udp_packet *pkt) {
-    //uint16_t t = htons(pkt->type);
-    uint16_t h = htons(pkt->hash);
-    uint16_t id = htons(pkt->node_id);
-    uint32_t ip = inet_addr(pkt->node_ip);
-    uint16_t p = htons(pkt->node_port);
-
-    pkt->bytesize = UDP_DATA_SIZE;
-    char *msg = calloc(pkt->bytesize, sizeof(char));
-
-    // memcpy(msg, &(pkt->type), 1);
-    msg[0] = pkt->type;
-    memcpy(msg + 1, &h, 2);
-    memcpy(msg + 3, &id, 2);
-    memcpy(msg + 5, &ip, 4);
-    memcpy(msg + 9, &p, 2);
-
-    return msg;
+static int udp_is_self(dht_node *node, udp_packet *pkt) {
+    struct sockaddr_in *self = &(node->addr);
+    return pkt->node_id == node->ID && pkt->node_ip.s_addr == self->sin_addr.s_addr && htons(pkt->node_port) == self->sin_port;
 }
 
-void udp_packet_free(udp_packet *pkt) {
-    free(pkt->node_ip);
-    free(pkt);
+/**
+ * Determines whether an address is one of the webserver's own (virtual) nodes, which share its files.
+ * @return 1 if it is, 0 if not.
+ */
+static int udp_is_own_node(webserver *ws, const struct sockaddr_in *addr) {
+    for (int k = 0; k < ws->num_nodes; k++) {
+        struct sockaddr_in *own = &(ws->nodes[k]->addr);
+        if (own->sin_addr.s_addr == addr->sin_addr.s_addr && own->sin_port == addr->sin_port) return 1;
+    }
+    return 0;
 }
 
-int udp_send_to_node(webserver *ws, int *sockfd, udp_packet *packet, dht_neighbor *dest_node) {
-    char *msg = udp_packet_serialize(packet);
-    if (socket_send(ws, sockfd, msg, packet->bytesize, dest_node->IP, dest_node->PORT) < 0) return -1;
+/**
+ * Datagrams collected while handling the UDP socket, sent together by udp_batch_flush.
+ */
+typedef struct udp_batch {
+    socket_datagram dgrams[SOCKET_BATCH_SIZE];
+    char data[SOCKET_BATCH_SIZE][UDP_DATA_SIZE];
+    unsigned int num_dgrams;
+} udp_batch;
 
-    return 0;
+/**
+ * Sends all datagrams of a batch and empties it.
+ */
+static void udp_batch_flush(int *sockfd, udp_batch *batch) {
+    if (batch->num_dgrams == 0) return;
+
+    if (socket_send_batch(sockfd, batch->dgrams, batch->num_dgrams) < (int) batch->num_dgrams) {
+        perror("Error sending to node.");
+    }
+    batch->num_dgrams = 0;
 }
 
 /**
- * Validates the a UDP packet in string-form and fills a udp_packet object.
- * @param pkt_string request in string form as it came from the stream
- * @param pkt request object to be filled
- * @return 0 on success, -1 on error.
+ * Adds a packet to a batch, which is flushed first if it is full.
  */
-int udp_parse_packet(char *pkt_string, udp_packet *pkt) {
-    uint8_t t = 0;
-    uint16_t h = 0;
-    uint16_t id = 0;
-    uint32_t ip = 0;
-    uint16_t p = 0;
-
-    memcpy(&t, pkt_string, 1);
-    memcpy(&h, pkt_string+1, 2);
-    memcpy(&id, pkt_string+3, 2);
-    memcpy(&ip, pkt_string+5, 4);
-    memcpy(&p, pkt_string+9, 2);
-
-    pkt->type = t;
-    pkt->hash = ntohs(h);
-    pkt->node_id = ntohs(id);
-    pkt->node_port = ntohs(p);
-
-    struct in_addr ip_addr = {ip};
-    strcpy(pkt->node_ip, inet_ntoa(ip_addr));
+static void udp_batch_add(int *sockfd, udp_batch *batch, udp_packet *pkt, const struct sockaddr_in *dest) {
+    if (batch->num_dgrams == SOCKET_BATCH_SIZE) udp_batch_flush(sockfd, batch);
 
-    return 0;
+    socket_datagram *dgram = &(batch->dgrams[batch->num_dgrams]);
+    dgram->data = batch->data[batch->num_dgrams];
+    dgram->len = UDP_DATA_SIZE;
+    dgram->addr = *dest;
+    udp_packet_encode(pkt, dgram->data);
+
+    batch->num_dgrams++;
+}
+
+int udp_send_to_node(int *sockfd, udp_packet *packet, dht_neighbor *dest_node) {
+    char msg[UDP_DATA_SIZE];
+    udp_packet_encode(packet, msg);
+
+    return socket_send(sockfd, msg, UDP_DATA_SIZE, &(dest_node->addr)) < 0 ? -1 : 0;
 }
 
-int udp_process_packet(webserver *ws, udp_packet  *pkt_out, udp_packet *pkt_in) {
+/**
+ * Processes a packet received by one of the webserver's (virtual) nodes. Has to be called with the node locked.
+ * @param node the node the packet has been sent to
+ * @return 0 if pkt_out is to be sent to the node named by pkt_in, 1 if there is no answer, -1 on error.
+ */
+static int udp_process_packet(webserver *ws, dht_node *node, udp_packet *pkt_out, udp_packet *pkt_in) {
     if (pkt_in == NULL) return -1;
 
     if (pkt_in->type == LOOKUP || pkt_in->type == JOIN) {
         unsigned short responsibility;
-        if (ws->node == NULL) responsibility = 1;
-        else if (pkt_in->type == JOIN) responsibility = dht_node_is_responsible(ws->node, pkt_in->node_id);
-        else responsibility = dht_node_is_responsible(ws->node, pkt_in->hash);
-
-        if (responsibility == 0 || (pkt_in->type == JOIN && responsibility == 2)) { // -> forward message to successor
-            strcpy(pkt_out->node_ip, pkt_in->node_ip);
-            pkt_out->node_port = pkt_in->node_port;
-            pkt_out->node_id = pkt_in->node_id;
-            pkt_out->hash = pkt_in->hash;
-            pkt_out->type = pkt_in->type;
-
-            strcpy(pkt_in->node_ip, ws->node->succ->IP);
-            pkt_in->node_port = strtol(ws->node->succ->PORT, NULL, 10);
+        if (node == NULL) responsibility = 1;
+        else if (pkt_in->type == JOIN) responsibility = dht_node_is_responsible(node, pkt_in->node_id);
+        else responsibility = dht_node_is_responsible(node, pkt_in->hash);
+
+        if (responsibility == 0 || (pkt_in->type == JOIN && responsibility == 2)) { // -> forward message
+            // towards the responsible node: to the closest preceding finger, or the successor if it is responsible
+            dht_neighbor *next = node->succ;
+            if (responsibility == 0) next = dht_node_next_hop(node, pkt_in->type == JOIN ? pkt_in->node_id : pkt_in->hash);
+
+            *pkt_out = *pkt_in;
+
+            pkt_in->node_ip = next->addr.sin_addr;
+            pkt_in->node_port = ntohs(next->addr.sin_port);
             return 0;
         }
 
@@ -135,154 +159,269 @@ int udp_process_packet(webserver *ws, udp_packet  *pkt_out, udp_packet *pkt_in)
             pkt_out->type = NOTIFY;
             pkt_out->hash = 0;
         } else {
+            // a reply names the responsible node and its predecessor, i.e. the range the node is responsible for
             pkt_out->type = REPLY;
-            pkt_out->hash = ws->node->ID;
+            pkt_out->hash = node->ID;
+            if (responsibility == 1 && node->pred != NULL) pkt_out->hash = node->pred->ID;
         }
 
         if (responsibility == 1) {
-            pkt_out->node_id = ws->node->ID;
-            strcpy(pkt_out->node_ip, ws->HOST);
-            pkt_out->node_port = strtol(ws->PORT, NULL, 10);
+            pkt_out->node_id = node->ID;
+            pkt_out->node_ip = node->addr.sin_addr;
+            pkt_out->node_port = ntohs(node->addr.sin_port);
 
             if (pkt_in->type == JOIN) {
-                free(ws->node->pred);
-                ws->node->pred = dht_neighbor_from_packet(pkt_in);
+                // the joining node takes over the keys between the old predecessor and itself, with their files
+                struct sockaddr_in addr;
+                udp_packet_address(pkt_in, &addr);
+                uint16_t from = (node->pred != NULL) ? node->pred->ID : node->ID;
+                if (!udp_is_own_node(ws, &addr) && migration_schedule(ws, from, pkt_in->node_id, &addr) < 0) {
+                    debug_print("Could not schedule key migration.");
+                }
+
+                dht_neighbor_free(node->pred);
+                node->pred = dht_neighbor_from_packet(pkt_in);
+                node->pred_seen = time_now_ms();
 
-                if (ws->node->succ == NULL) {
-                    ws->node->succ = dht_neighbor_from_packet(pkt_in);
+                if (node->succ == NULL) {
+                    node->succ = dht_neighbor_from_packet(pkt_in);
                 }
+
+                // the ring has changed, cached responsibilities may be wrong now
+                dht_lookup_cache_invalidate(node);
             }
 
         } else if (responsibility == 2) {
-            pkt_out->node_id = ws->node->succ->ID;
-            strcpy(pkt_out->node_ip, ws->node->succ->IP);
-            pkt_out->node_port = strtol(ws->node->succ->PORT, NULL, 10);
+            pkt_out->node_id = node->succ->ID;
+            pkt_out->node_ip = node->succ->addr.sin_addr;
+            pkt_out->node_port = ntohs(node->succ->addr.sin_port);
 
         } else return -1;
 
         return 0;
 
     } else if (pkt_in->type == STABILIZE)  {
-        if (ws->node->pred == NULL) {
-            ws->node->pred = dht_neighbor_from_packet(pkt_in);
+        struct sockaddr_in addr;
+        udp_packet_address(pkt_in, &addr);
+        int from_pred = dht_neighbor_equals(node->pred, pkt_in->node_id, &addr);
+
+        // the sender takes the predecessor's place if it lies between it and this node (it has joined since),
+        // or if the predecessor hasn't stabilized for a while and has failed
+        if (node->pred == NULL || (!from_pred && (dht_node_is_responsible(node, pkt_in->node_id) == 1
+                || time_now_ms() - node->pred_seen >= PREDECESSOR_TIMEOUT))) {
+            dht_neighbor_free(node->pred);
+            node->pred = dht_neighbor_from_packet(pkt_in);
+            dht_lookup_cache_invalidate(node);
+            from_pred = 1;
         }
 
+        if (from_pred) node->pred_seen = time_now_ms();
+
         pkt_out->type = NOTIFY;
         pkt_out->hash = 0;
-        pkt_out->node_id = ws->node->pred->ID;
-        strcpy(pkt_out->node_ip, ws->node->pred->IP);
-        pkt_out->node_port = strtol(ws->node->pred->PORT, NULL, 10);
+        pkt_out->node_id = node->pred->ID;
+        pkt_out->node_ip = node->pred->addr.sin_addr;
+        pkt_out->node_port = ntohs(node->pred->addr.sin_port);
         return 0;
 
     } else if (pkt_in->type == NOTIFY) {
-        if (pkt_in->node_id != ws->node->ID || pkt_in->node_port != strtol(ws->PORT, NULL, 10) || strcmp(pkt_in->node_ip, ws->HOST) != 0) {
-            free(ws->node->succ);
-            ws->node->succ = dht_neighbor_from_packet(pkt_in);
+        // the outstanding STABILIZE has been answered, the successor is alive
+        node->stabilize_sent = 0;
+        node->stabilize_retries = 0;
+
+        struct sockaddr_in addr;
+        udp_packet_address(pkt_in, &addr);
+
+        // a successor that has just failed may still be named by nodes that haven't noticed yet
+        if (!udp_is_self(node, pkt_in) && !dht_neighbor_equals(node->succ, pkt_in->node_id, &addr)
+                && !dht_node_is_failed(node, pkt_in->node_id, &addr)) {
+            dht_neighbor_free(node->succ);
+            node->succ = dht_neighbor_from_packet(pkt_in);
+            dht_lookup_cache_invalidate(node);
         }
 
     } else if (pkt_in->type == REPLY) {
-        pkt_out->node_id = pkt_in->node_id;
-        strcpy(pkt_out->node_ip, pkt_in->node_ip);
-        pkt_out->node_port = pkt_in->node_port;
-
-        // writing responsible node to lookup-cache 
-        int i = dht_lookup_cache_find_empty(ws->node);
-        if (i != -1) {
-            ws->node->lookup_cache->nodes[i] = dht_neighbor_from_packet(pkt_out);
+        // the node is responsible for (pkt_in->hash, pkt_in->node_id], which may cover fingers and pending lookups
+        struct sockaddr_in addr;
+        udp_packet_address(pkt_in, &addr);
+        dht_node_update_fingers(node, pkt_in->hash, pkt_in->node_id, &addr);
+
+        // writing responsible node to lookup-cache
+        dht_lookup_cache_resolve(node, pkt_in->hash, pkt_in->node_id, &addr);
+
+        // a reply naming a known successor as predecessor names that successor's successor
+        dht_neighbor *s_k = node->succ;
+        for (int k = 0; k < SUCCESSOR_LIST_SIZE && s_k != NULL; s_k = node->succ_list[k++]) {
+            if (pkt_in->hash != s_k->ID) continue;
+
+            // the list ends where it wraps around the ring
+            if (udp_is_self(node, pkt_in) || pkt_in->node_id == s_k->ID) dht_node_truncate_successors(node, k);
+            else dht_node_set_successor(node, k, pkt_in->node_id, &addr);
+            break;
         }
+
+        // requests parked on this (or any other) worker may be answered now
+        webserver_wake_parked(ws);
     }
 
     return 1; // don't answer received replies / notfies
 }
 
-int udp_handle(short events, int *in_fd, webserver *ws) {
-    char *buf = calloc(UDP_DATA_SIZE+1, sizeof(char));
+/**
+ * Adds a STABILIZE to the node's successor to the batch. Has to be called with the node locked.
+ */
+static void udp_send_stabilize(dht_node *node, int *sockfd, udp_batch *batch) {
+    udp_packet packet;
+    udp_packet_init(&packet, STABILIZE, node->ID, node->ID, &(node->addr));
+    udp_batch_add(sockfd, batch, &packet, &(node->succ->addr));
 
-    udp_packet *pkt_in = udp_packet_create(0, 0, 0, NULL, NULL);
-    if (pkt_in == NULL) perror("Error initializing packet structure.");
+    node->stabilize_sent = time_now_ms();
+}
 
-    udp_packet *pkt_out = udp_packet_create(0, 0, 0, NULL, NULL);
-    if (pkt_out == NULL) perror("Error initializing packet structure.");
+/**
+ * Refreshes the node's successor list by asking each known successor for the node following it
+ * (a LOOKUP of its ID + 1, which it answers itself). Their replies are applied in udp_process_packet.
+ * Has to be called with the node locked.
+ */
+static void udp_refresh_successors(dht_node *node, int *sockfd, udp_batch *batch) {
+    dht_neighbor *s_k = node->succ;
+    for (int k = 0; k < SUCCESSOR_LIST_SIZE && s_k != NULL; s_k = node->succ_list[k++]) {
+        udp_packet packet;
+        udp_packet_init(&packet, LOOKUP, s_k->ID + 1, node->ID, &(node->addr));
+        udp_batch_add(sockfd, batch, &packet, &(s_k->addr));
+    }
+}
 
-    if (ws->node->status == JOINING) { // This node wants to join an existing DHT
-        pkt_out->type = JOIN;
-        pkt_out->hash = 0;
-        pkt_out->node_id = ws->node->ID;
-        strcpy(pkt_out->node_ip, ws->HOST);
-        pkt_out->node_port = strtol(ws->PORT, NULL, 10);
-        
-        strcpy(pkt_in->node_ip, ws->node->succ->IP);
-        pkt_in->node_port = strtol(ws->node->succ->PORT, NULL, 10);
-
-        ws->node->status = OK;
-
-    } else if (ws->node->status == STABILIZING) { // This node has to stabilize
-        if (ws->node->succ != NULL) {
-            pkt_out->type = STABILIZE;
-            pkt_out->hash = ws->node->ID;
-            pkt_out->node_id = ws->node->ID;
-            strcpy(pkt_out->node_ip, ws->HOST);
-            pkt_out->node_port = strtol(ws->PORT, NULL, 10);
-            
-            strcpy(pkt_in->node_ip, ws->node->succ->IP);
-            pkt_in->node_port = strtol(ws->node->succ->PORT, NULL, 10);
-        }
+/**
+ * Refreshes the node's finger table. Fingers this node or its successor are responsible for
+ * are set right away, the others are looked up via the successor (their replies are
+ * applied in udp_process_packet). Has to be called with the node locked.
+ */
+static void udp_fix_fingers(dht_node *node, int *sockfd, udp_batch *batch) {
+    if (node->succ == NULL) return;
 
-        ws->node->status = OK;
+    for (int i = 0; i < FINGER_TABLE_SIZE; i++) {
+        uint16_t start = dht_finger_start(node, i);
+        unsigned short responsibility = dht_node_is_responsible(node, start);
 
-    } else if (events & POLLIN) {
-        // TODO: refactor this into combined function in socket (ideally)
-        struct sockaddr_in addr;
-        socklen_t addr_len = sizeof(addr);
-        memset(&addr, 0, addr_len);
-
-        int n_bytes = 0;
-        while (n_bytes < UDP_DATA_SIZE && n_bytes >= 0) {
-            n_bytes = recvfrom(
-                    *in_fd,
-                    // buffer[0 - bytes_received-1] is full of data,
-                    // buffer[bytes_received] is where we want to continue to write (the next first byte)
-                    buf + n_bytes,
-                    // the size of the space from buffer[bytes_received] to buffer[bufsize-1]
-                    (UDP_DATA_SIZE) - n_bytes,
-                    0,
-                    (struct sockaddr *) &addr,
-                    &addr_len
-            );
+        if (responsibility == 1) {
+            dht_node_set_finger(node, i, node->ID, &(node->addr));
+        } else if (responsibility == 2) {
+            dht_node_set_finger(node, i, node->succ->ID, &(node->succ->addr));
+        } else {
+            udp_packet packet;
+            udp_packet_init(&packet, LOOKUP, start, node->ID, &(node->addr));
+            udp_batch_add(sockfd, batch, &packet, &(node->succ->addr));
         }
+    }
+}
 
-        if (n_bytes <= 0) {
-            if (errno == ECONNRESET || errno == EINTR || errno == ETIMEDOUT) {
-                if (socket_shutdown(ws, in_fd) != 0) perror("Socket shutdown failed.");
-                free(buf);
-            }
+/**
+ * Handles the UDP socket, see udp_handle. Has to be called with the node locked.
+ */
+static int udp_handle_locked(short events, int *in_fd, webserver *ws, dht_node *node, udp_batch *batch) {
+    if (node->status == JOINING) { // This node wants to join an existing DHT
+        udp_packet pkt_out;
+        udp_packet_init(&pkt_out, JOIN, 0, node->ID, &(node->addr));
+        udp_batch_add(in_fd, batch, &pkt_out, &(node->succ->addr));
+
+        node->status = OK;
+        return 0;
+
+    } else if (node->status == STABILIZING) { // This node has to stabilize
+        node->status = OK;
 
-            return -1;
+        if (node->succ != NULL) {
+            // an earlier STABILIZE that is still unanswered keeps its retries
+            uint64_t sent = node->stabilize_sent;
+            udp_send_stabilize(node, in_fd, batch);
+            if (sent != 0) node->stabilize_sent = sent;
+            else node->stabilize_retries = 0;
+
+            // the successor list and fingers are refreshed once per stabilize round, after the STABILIZE has been sent
+            udp_refresh_successors(node, in_fd, batch);
+            udp_fix_fingers(node, in_fd, batch);
         }
 
-        udp_parse_packet(buf, pkt_in);
-    
-        if (udp_process_packet(ws, pkt_out, pkt_in) != 0) {
-            udp_packet_free(pkt_in);
-            udp_packet_free(pkt_out);
-            free(buf);
-            return -1;
+        return 0;
+
+    } else if (!(events & POLLIN)) return 0;
+
+    // draining the datagrams queued on the socket, the answers are collected in the batch
+    socket_datagram dgrams[SOCKET_BATCH_SIZE];
+    char data[SOCKET_BATCH_SIZE][UDP_DATA_SIZE];
+    for (int i = 0; i < SOCKET_BATCH_SIZE; i++) {
+        dgrams[i].data = data[i];
+        dgrams[i].len = UDP_DATA_SIZE;
+    }
+
+    int num_dgrams = socket_receive_batch(in_fd, dgrams, SOCKET_BATCH_SIZE);
+    if (num_dgrams < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+        return -1;
+    }
+
+    for (int i = 0; i < num_dgrams; i++) {
+        udp_packet pkt_in, pkt_out;
+        if (udp_packet_decode(dgrams[i].data, dgrams[i].len, &pkt_in) != 0) continue;
+        if (udp_process_packet(ws, node, &pkt_out, &pkt_in) != 0) continue;
+
+        // the answer goes to the node named by pkt_in (the sender, or the next hop of a forwarded message)
+        struct sockaddr_in dest;
+        udp_packet_address(&pkt_in, &dest);
+        udp_batch_add(in_fd, batch, &pkt_out, &dest);
+    }
+
+    return 0;
+}
+
+int udp_check_successor(int *sockfd, dht_node *node) {
+    int ret = 0;
+
+    udp_batch batch;
+    batch.num_dgrams = 0;
+
+    dht_node_lock(node);
+    if (node->succ != NULL && node->stabilize_sent != 0 && time_now_ms() - node->stabilize_sent >= SUCCESSOR_TIMEOUT) {
+        if (node->stabilize_retries < SUCCESSOR_RETRIES) {
+            node->stabilize_retries++;
+            udp_send_stabilize(node, sockfd, &batch);
+
+        } else if (dht_node_replace_failed_successor(node) == 0) {
+            // the ring is repaired by stabilizing with the next successor right away
+            debug_print("Successor failed, replaced it by the next one.");
+            dht_lookup_cache_invalidate(node);
+            udp_send_stabilize(node, sockfd, &batch);
+            ret = 1;
+
+        } else {
+            // no other successor is known, it is tried again in the next stabilize round
+            node->stabilize_sent = 0;
+            node->stabilize_retries = 0;
         }
     }
+    dht_node_unlock(node);
+
+    udp_batch_flush(sockfd, &batch);
+    return ret;
+}
 
-    if (!(events & POLLOUT)) return 0;
+int udp_handle(short events, int *in_fd, webserver *ws) {
+    udp_batch batch;
+    batch.num_dgrams = 0;
 
-    char *res_msg = udp_packet_serialize(pkt_out);
+    // every virtual node has a socket of its own
+    dht_node *node = ws->node;
+    for (int i = 0; i < ws->num_nodes; i++) {
+        if (ws->nodes[i]->udp_fd == *in_fd) node = ws->nodes[i];
+    }
 
-    char *port_str = calloc(7, sizeof(char));
-    snprintf(port_str, 6, "%d", pkt_in->node_port);
-    socket_send(ws, in_fd, res_msg, pkt_out->bytesize, pkt_in->node_ip, port_str);
-    free(port_str);
-    free(res_msg);
+    dht_node_lock(node);
+    int ret = udp_handle_locked(events, in_fd, ws, node, &batch);
+    dht_node_unlock(node);
 
-    udp_packet_free(pkt_in);
-    udp_packet_free(pkt_out);
+    // the answers are sent after the node has been unlocked, UDP sockets are always writable
+    if (events & POLLOUT) udp_batch_flush(in_fd, &batch);
 
-    free(buf);
-    return 0;
+    return ret;
 }
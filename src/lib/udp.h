@@ -2,6 +2,7 @@
 #define RN_PRAXIS_UDP_H
 
 #include <stdlib.h>
+#include <netinet/in.h>
 #include "../webserver.h"
 #include "socket.h"
 
@@ -19,41 +20,72 @@ typedef struct udp_packet {
     udp_packet_type type;
     uint16_t hash;
     uint16_t node_id;
-    char* node_ip;
+    struct in_addr node_ip;
     uint16_t node_port;
-    unsigned int bytesize;
 } udp_packet;
 
 /**
- * Creates a new UDP packet and fills it with the given values (may be NULL / 0 etc.)
+ * A packet as it is sent, all fields in network byte order.
+ */
+typedef struct __attribute__((packed)) udp_wire_packet {
+    uint8_t type;
+    uint16_t hash;
+    uint16_t node_id;
+    uint32_t node_ip;
+    uint16_t node_port;
+} udp_wire_packet;
+
+_Static_assert(sizeof(udp_wire_packet) == UDP_DATA_SIZE, "udp_wire_packet has to match the message format");
+
+/**
+ * Fills a UDP packet with the given values.
+ * @param pkt The packet to fill.
  * @param type The packet's type.
  * @param hash The communicated hash. The first 16 Bits of a SHA256 hash.
  * @param node_id The ID of the communicated node (the first 16 Bits of a SHA256 hash).
- * @param node_ip The IP of the communicated node.
- * @param node_port The Port of the communicated node.
- * @return a UDP packet object, NULL on error.
+ * @param node_addr The address (IP and Port) of the communicated node.
  */
-udp_packet *udp_packet_create(udp_packet_type type, uint16_t hash, uint16_t node_id, char *node_ip, char *node_port);
+void udp_packet_init(udp_packet *pkt, udp_packet_type type, uint16_t hash, uint16_t node_id, const struct sockaddr_in *node_addr);
 
 /**
- * Frees the given UDP packet.
- * @param pkt the packet to be freed.
+ * Serializes a UDP packet into a buffer.
+ * @param pkt The packet to serialize.
+ * @param buf The buffer to write to, at least UDP_DATA_SIZE bytes.
  */
-void udp_packet_free(udp_packet *pkt);
+void udp_packet_encode(const udp_packet *pkt, char *buf);
+
+/**
+ * Validates a received datagram and fills a UDP packet from it.
+ * @param buf The datagram.
+ * @param len The datagram's length.
+ * @param pkt The packet to fill.
+ * @return 0 on success, -1 if the datagram isn't a valid packet.
+ */
+int udp_packet_decode(const char *buf, size_t len, udp_packet *pkt);
 
 /**
  * Sends a given UDP packet to a specific node (/client defined by IP and Port).
- * @param ws This webserver object.
  * @param sockfd The socket to send to (bound DGRAM socket).
  * @param packet The UDP packet to send.
  * @param dest_node The node to send the packet to.
  * @return 0 on success, -1 on error.
  */
-int udp_send_to_node(webserver *ws, int *sockfd, udp_packet *packet, dht_neighbor *dest_node);
+int udp_send_to_node(int *sockfd, udp_packet *packet, dht_neighbor *dest_node);
+
+/**
+ * Detects a failed successor: a STABILIZE that hasn't been answered with a NOTIFY within SUCCESSOR_TIMEOUT
+ * is sent again, after SUCCESSOR_RETRIES unanswered retries the successor is replaced by the next one of
+ * its successor list. Called for every (virtual) node on every tick of the webserver owning the UDP sockets.
+ * @param sockfd The node's UDP socket.
+ * @param node The node.
+ * @return 1 if the successor has been replaced, 0 else.
+ */
+int udp_check_successor(int *sockfd, dht_node *node);
 
 /**
- * Handles an incoming UDP connection.
- * @param in_fd Socket File Descriptor of the accepted connection.
+ * Handles the UDP socket of one of the webserver's (virtual) nodes: sends the messages the node's status requires
+ * (JOIN / STABILIZE) or drains up to SOCKET_BATCH_SIZE queued datagrams and processes them. All answers are sent together once the node is unlocked.
+ * @param in_fd Socket File Descriptor of the UDP socket.
  * @param ws Webserver object.
  * @param evemt The event(s) returned by poll.
  * @return 0 on success, -1 on error.
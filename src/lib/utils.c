@@ -3,7 +3,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include "utils.h"
 
 #define DEBUG 0
@@ -45,9 +47,117 @@ int string_ends_with_empty_line(char* str) {
     return 0;
 }
 
+static hash_algorithm hash_selected = HASH_SHA256;
+static EVP_MD *hash_sha256 = NULL; // fetched once, SHA256() looks the implementation up on every call
+
+int hash_init(hash_algorithm algorithm) {
+    hash_selected = algorithm;
+    if (algorithm != HASH_SHA256 || hash_sha256 != NULL) return 0;
+
+    hash_sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+    return hash_sha256 == NULL ? -1 : 0;
+}
+
 uint16_t hash(const char* str) {
+    if (hash_selected == HASH_XXH64) return xxh64(str, strlen(str), 0) >> 48;
+
     uint8_t digest[SHA256_DIGEST_LENGTH];
-    SHA256((uint8_t *)str, strlen(str), digest);
-    
-    return htons(*((uint16_t *)digest));
+    if (hash_sha256 == NULL || EVP_Digest(str, strlen(str), digest, NULL, hash_sha256, NULL) != 1) {
+        SHA256((uint8_t *)str, strlen(str), digest);
+    }
+
+    return (uint16_t) (digest[0] << 8 | digest[1]);
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * Reads little-endian words, independent of the host's byte order and alignment.
+ */
+static uint64_t xxh_read64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = v << 8 | p[i];
+    return v;
+}
+
+static uint32_t xxh_read32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        // four lanes of 8 bytes each
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else h = seed + XXH_PRIME64_5;
+
+    h += (uint64_t) len;
+
+    // the remaining bytes
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t) xxh_read32(p) * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+    }
+
+    // avalanche
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t time_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
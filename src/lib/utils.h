@@ -1,6 +1,7 @@
 #ifndef RN_PRAXIS_UTILS_H
 #define RN_PRAXIS_UTILS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
@@ -35,11 +36,43 @@ int str_is_uint16(const char *str);
 int string_ends_with_empty_line(char* str);
 
 /**
- * Hashes a given string using SHA256 from OpenSSL
+ * The hash functions keys and node IDs can be mapped onto the ring with.
+ * All nodes of a ring have to use the same one.
+ */
+typedef enum hash_algorithm {
+    HASH_SHA256, // the first 16 bits of SHA256, as defined by the protocol
+    HASH_XXH64, // the top 16 bits of XXH64 (seed 0), much cheaper but not part of the protocol
+} hash_algorithm;
+
+/**
+ * Selects the hash function used by hash() and prepares it, so it isn't set up again for every key.
+ * Has to be called before any other thread uses hash().
+ * @param algorithm the hash function.
+ * @return 0 on success, -1 on error.
+ */
+int hash_init(hash_algorithm algorithm);
+
+/**
+ * Hashes a given string using the hash function selected by hash_init (SHA256 from OpenSSL by default)
  * with a limited address-space of 16B (instead of 256B).
  * @param str input string to be hashed.
  * @return The hashed value, a 16-Bit Integer
  */
 uint16_t hash(const char* str);
 
+/**
+ * Computes the 64-bit xxHash (XXH64) of a buffer.
+ * @param data the buffer.
+ * @param len the buffer's length.
+ * @param seed the seed.
+ * @return the hash.
+ */
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+/**
+ * Returns the current time of a monotonic clock.
+ * @return the time in milliseconds (with an arbitrary starting point).
+ */
+uint64_t time_now_ms(void);
+
 #endif //RN_PRAXIS_UTILS_H
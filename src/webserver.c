@@ -2,13 +2,29 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <signal.h>
 #include "lib/utils.h"
 #include "lib/http.h"
 #include "lib/udp.h"
 #include "lib/socket.h"
+#include "lib/proxy.h"
+#include "lib/object_cache.h"
+#include "lib/migration.h"
 #include "lib/filesystem/operations.h"
+#include "lib/filesystem/persistence.h"
+#include "lib/filesystem/import.h"
 #include "webserver.h"
 
+typedef struct webserver_worker {
+    webserver *ws;
+    file_system *fs;
+    pthread_t thread;
+    volatile int quit;
+} webserver_worker;
+
 webserver* webserver_init(char* hostname, char* port_str) {
     webserver *ws = calloc(1, sizeof(webserver));
     if (!ws) return NULL;
@@ -17,23 +33,73 @@ webserver* webserver_init(char* hostname, char* port_str) {
 
     ws->HOST = calloc(HOSTNAME_MAX_LENGTH, sizeof(char));
     ws->PORT = calloc(port_str_len, sizeof(char));
-    ws->open_sockets = calloc(MAX_NUM_OPEN_SOCKETS, sizeof(struct pollfd));
-    ws->open_sockets_config = calloc(MAX_NUM_OPEN_SOCKETS, sizeof(open_socket));
+    ws->worker_id = 0;
+    ws->num_workers = 1;
     ws->num_open_sockets = 0;
+    ws->tcp_server_fd = -1;
+    ws->udp_server_fd = -1;
+    ws->wakeup_fd = -1;
+    ws->wakeup_write_fd = -1;
+
+    ws->max_open_sockets = MAX_NUM_OPEN_SOCKETS;
+    if (getenv("MAX_OPEN_SOCKETS") != NULL) {
+        int max = strtol(getenv("MAX_OPEN_SOCKETS"), NULL, 10);
+        if (max > 0) ws->max_open_sockets = max;
+    }
+
+    // Making sure the process may actually open as many sockets as configured
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < (rlim_t) ws->max_open_sockets + 16) {
+        fd_limit.rlim_cur = MIN(fd_limit.rlim_max, (rlim_t) ws->max_open_sockets + 16);
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    ws->idle_timeout = KEEP_ALIVE_TIMEOUT;
+    if (getenv("KEEP_ALIVE_TIMEOUT") != NULL) {
+        int timeout = strtol(getenv("KEEP_ALIVE_TIMEOUT"), NULL, 10);
+        if (timeout > 0) ws->idle_timeout = timeout;
+    }
+
+    // requests for other nodes are answered with the responsible node's response instead of a redirect
+    if (getenv("DHT_PROXY") != NULL && strcmp(getenv("DHT_PROXY"), "0") != 0) {
+        ws->proxy = proxy_pool_create();
+        if (ws->proxy == NULL) {
+            perror("Could not initialize proxy");
+            webserver_free(ws);
+            return NULL;
+        }
+    }
+
+    event_backend backend = EVENT_BACKEND_EPOLL;
+    if (getenv("EVENT_BACKEND") != NULL && strcmp(getenv("EVENT_BACKEND"), "poll") == 0) backend = EVENT_BACKEND_POLL;
+
+    ws->loop = event_loop_create(backend);
+    ws->open_sockets_capacity = EVENT_INITIAL_CAPACITY;
+    ws->open_sockets = calloc(ws->open_sockets_capacity, sizeof(open_socket*));
 
-    for (int i = 0; i < MAX_NUM_OPEN_SOCKETS; i++) {
-        ws->open_sockets[i].fd = -1;
-        ws->open_sockets_config[i].is_server_socket = 0;
+    if (ws->loop == NULL || ws->open_sockets == NULL) {
+        perror("Could not initialize event loop");
+        webserver_free(ws);
+        return NULL;
+    }
+
+    // the wakeup channel isn't an open socket, it is recognized by its fd in webserver_tick
+    if (event_wakeup_create(&(ws->wakeup_fd), &(ws->wakeup_write_fd)) < 0 || event_loop_add(ws->loop, ws->wakeup_fd, POLLIN, 0) < 0) {
+        perror("Could not initialize wakeup channel");
+        webserver_free(ws);
+        return NULL;
     }
 
-    if (strlen(hostname)+1 > HOSTNAME_MAX_LENGTH) {
+    if (ws->HOST == NULL || strlen(hostname)+1 > HOSTNAME_MAX_LENGTH) {
         perror("Invalid hostname");
+        webserver_free(ws);
         return NULL;
     }
     memcpy(ws->HOST, hostname, HOSTNAME_MAX_LENGTH * sizeof(char));
 
-    if (str_is_uint16(port_str) < 0) {
+    if (ws->PORT == NULL || !str_is_uint16(port_str)) {
         perror("Invalid port.");
+        webserver_free(ws);
         return NULL;
     }
     memcpy(ws->PORT, port_str, port_str_len * sizeof(char));
@@ -43,90 +109,339 @@ webserver* webserver_init(char* hostname, char* port_str) {
     return ws;
 }
 
+int webserver_add_socket(webserver *ws, int fd, enum connection_protocol protocol, unsigned short is_server_socket) {
+    if (fd < 0) return -1;
+
+    if (ws->num_open_sockets >= ws->max_open_sockets) {
+        debug_print("Maximum number of open sockets reached.");
+        return -1;
+    }
+
+    // growing the table so that it can be indexed by fd
+    if (fd >= ws->open_sockets_capacity) {
+        int new_capacity = ws->open_sockets_capacity;
+        while (new_capacity <= fd) new_capacity *= 2;
+
+        open_socket **new_table = realloc(ws->open_sockets, new_capacity * sizeof(open_socket*));
+        if (new_table == NULL) return -1;
+
+        memset(new_table + ws->open_sockets_capacity, 0, (new_capacity - ws->open_sockets_capacity) * sizeof(open_socket*));
+        ws->open_sockets = new_table;
+        ws->open_sockets_capacity = new_capacity;
+    }
+
+    if (ws->open_sockets[fd] != NULL) return -1;
+
+    open_socket *sock = calloc(1, sizeof(open_socket));
+    if (sock == NULL) return -1;
+
+    sock->fd = fd;
+    sock->protocol = protocol;
+    sock->is_server_socket = is_server_socket;
+    sock->events = POLLIN;
+
+    // TCP sockets are non-blocking and drained on every notification, so they can be edge-triggered.
+    int edge_triggered = (protocol != UDP);
+
+    if (event_loop_add(ws->loop, fd, POLLIN, edge_triggered) < 0) {
+        perror("Could not register socket with event loop");
+        free(sock);
+        return -1;
+    }
+
+    ws->open_sockets[fd] = sock;
+    ws->num_open_sockets++;
+
+    if (is_server_socket == 0 && protocol == TCP) webserver_touch_socket(ws, sock);
+
+    // of several server sockets (one per virtual node), the first one is the webserver's own
+    if (is_server_socket == 1) {
+        if (protocol == TCP && ws->tcp_server_fd == -1) ws->tcp_server_fd = fd;
+        else if (protocol == UDP && ws->udp_server_fd == -1) ws->udp_server_fd = fd;
+    }
+
+    return 0;
+}
+
+/**
+ * Unlinks a socket from the webserver's list of TCP client sockets.
+ */
+static void webserver_unlink_idle(webserver *ws, open_socket *sock) {
+    if (sock->idle_prev != NULL) sock->idle_prev->idle_next = sock->idle_next;
+    else if (ws->idle_head == sock) ws->idle_head = sock->idle_next;
+
+    if (sock->idle_next != NULL) sock->idle_next->idle_prev = sock->idle_prev;
+    else if (ws->idle_tail == sock) ws->idle_tail = sock->idle_prev;
+
+    sock->idle_prev = NULL;
+    sock->idle_next = NULL;
+}
+
+void webserver_touch_socket(webserver *ws, open_socket *sock) {
+    sock->last_active = time_now_ms();
+
+    // moving the socket to the end of the list keeps the list ordered by last activity
+    if (ws->idle_tail == sock) return;
+    webserver_unlink_idle(ws, sock);
+
+    sock->idle_prev = ws->idle_tail;
+    if (ws->idle_tail != NULL) ws->idle_tail->idle_next = sock;
+    ws->idle_tail = sock;
+    if (ws->idle_head == NULL) ws->idle_head = sock;
+}
+
+/**
+ * Closes all TCP client sockets that have been idle for longer than the webserver's idle timeout.
+ * Only the expired sockets at the head of the idle list are visited.
+ */
+static void webserver_close_idle(webserver *ws) {
+    uint64_t now = time_now_ms();
+
+    while (ws->idle_head != NULL && now - ws->idle_head->last_active >= ws->idle_timeout) {
+        debug_print("Closing idle connection.");
+        webserver_remove_socket(ws, ws->idle_head->fd);
+    }
+}
+
+int webserver_park_socket(webserver *ws, open_socket *sock) {
+    if (sock->parked) return 0;
+    if (ws->num_parked >= MAX_NUM_PARKED) return -1;
+
+    sock->parked = 1;
+    sock->parked_since = time_now_ms();
+
+    // appending keeps the list ordered by deadline, as all requests wait equally long
+    sock->parked_prev = ws->parked_tail;
+    sock->parked_next = NULL;
+    if (ws->parked_tail != NULL) ws->parked_tail->parked_next = sock;
+    ws->parked_tail = sock;
+    if (ws->parked_head == NULL) ws->parked_head = sock;
+    ws->num_parked++;
+
+    return 0;
+}
+
+void webserver_unpark_socket(webserver *ws, open_socket *sock) {
+    if (!sock->parked) return;
+
+    if (sock->parked_prev != NULL) sock->parked_prev->parked_next = sock->parked_next;
+    else ws->parked_head = sock->parked_next;
+
+    if (sock->parked_next != NULL) sock->parked_next->parked_prev = sock->parked_prev;
+    else ws->parked_tail = sock->parked_prev;
+
+    sock->parked_prev = NULL;
+    sock->parked_next = NULL;
+    sock->parked = 0;
+    ws->num_parked--;
+}
+
+void webserver_wake_parked(webserver *ws) {
+    if (ws->workers == NULL) {
+        event_wakeup_signal(ws->wakeup_write_fd);
+        return;
+    }
+
+    for (int i = 0; i < ws->num_workers; i++) event_wakeup_signal(ws->workers[i]->wakeup_write_fd);
+}
+
+/**
+ * Processes the requests of parked sockets again.
+ * @param ws the webserver.
+ * @param all 1 to retry every parked socket (a lookup has been answered), 0 to retry only expired ones.
+ */
+static void webserver_resume_parked(webserver *ws, file_system *fs, int all) {
+    uint64_t now = time_now_ms();
+
+    // sockets parked again while resuming are appended, so only the ones parked before are visited
+    int num = ws->num_parked;
+    open_socket *sock = ws->parked_head;
+    while (sock != NULL && num-- > 0) {
+        if (!all && now - sock->parked_since < LOOKUP_TIMEOUT) break;
+
+        open_socket *next = sock->parked_next;
+        int fd = sock->fd;
+        if (http_handle(&fd, ws, fs) < 0) webserver_remove_socket(ws, fd);
+        sock = next;
+    }
+}
+
+int webserver_remove_socket(webserver *ws, int fd) {
+    if (fd < 0 || fd >= ws->open_sockets_capacity || ws->open_sockets[fd] == NULL) return -1;
+
+    event_loop_remove(ws->loop, fd);
+    webserver_unlink_idle(ws, ws->open_sockets[fd]);
+    webserver_unpark_socket(ws, ws->open_sockets[fd]);
+    if (ws->open_sockets[fd]->upstream != NULL) proxy_cancel(ws->open_sockets[fd]);
+    if (ws->open_sockets[fd]->proxy != NULL) proxy_release(ws, ws->open_sockets[fd]);
+    if (ws->open_sockets[fd]->migration != NULL) migration_release(ws, ws->open_sockets[fd]);
+
+    if (fd == ws->tcp_server_fd) ws->tcp_server_fd = -1;
+    if (fd == ws->udp_server_fd) ws->udp_server_fd = -1;
+
+    if (ws->open_sockets[fd]->parser != NULL) http_parser_free(ws->open_sockets[fd]->parser);
+    if (ws->open_sockets[fd]->out != NULL) http_output_free(ws->open_sockets[fd]->out);
+    free(ws->open_sockets[fd]);
+    ws->open_sockets[fd] = NULL;
+    ws->num_open_sockets--;
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * Accepts all pending connections on a (non-blocking) TCP server socket
+ * and adds them to the webserver's open sockets.
+ * @param ws the webserver.
+ * @param sock the TCP server socket.
+ */
+static void webserver_accept_all(webserver *ws, open_socket *sock) {
+    while (1) {
+        int in_fd = socket_accept(&(sock->fd));
+        if (in_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("Socket failed to accept.");
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        if (socket_set_nonblocking(in_fd) < 0 || webserver_add_socket(ws, in_fd, TCP, 0) < 0) {
+            // shedding the connection, the limit of open sockets is reached
+            close(in_fd);
+        }
+    }
+}
+
 /**
- * TODO: Doc this
- * @return 0 when the connection is still alive, -1 when the socket's events have to be reevaluated
+ * Handles an event on an open (non-server TCP) socket.
+ * @return 0 when the connection is still alive, -1 when the socket has to be closed
  */
 int handle_connection(short events, int *in_fd, enum connection_protocol protocol, webserver *ws, file_system *fs) {
     if (protocol == TCP) {
         if (http_handle(in_fd, ws, fs) < 0) return -1;
+    } else if (protocol == PROXY) {
+        if (proxy_handle(ws, ws->open_sockets[*in_fd], fs) < 0) return -1;
+    } else if (protocol == MIGRATION) {
+        if (migration_handle(ws, ws->open_sockets[*in_fd], fs) < 0) return -1;
     } else if (protocol == UDP) {
-        udp_handle(events, in_fd, ws);
-        return -1;
+        // UDP sockets are always writable, so replies can be sent right away
+        udp_handle(events | POLLOUT, in_fd, ws);
     }
 
     return 0;
 }
 
 int webserver_tick(webserver *ws, file_system *fs) {
-    int ready = poll(ws->open_sockets, ws->num_open_sockets, 100);
-    if (ready == 0) return 0;
-    else if (ready == -1) {
-        perror("poll");
+    // Sending JOIN / STABILIZE messages when a node's status requires it
+    for (int k = 0; ws->worker_id == 0 && k < ws->num_nodes; k++) {
+        dht_node *node = ws->nodes[k];
+        if (node->udp_fd == -1) continue;
+
+        if (node->status == JOINING || node->status == STABILIZING) udp_handle(POLLOUT, &(node->udp_fd), ws);
+        udp_check_successor(&(node->udp_fd), node);
+    }
+
+    webserver_close_idle(ws);
+    if (ws->proxy != NULL) proxy_tick(ws, fs);
+    if (ws->migrations != NULL) migration_tick(ws, fs);
+
+    // waking up in time for the first parked request to expire
+    int timeout = TICK_INTERVAL;
+    if (ws->parked_head != NULL) {
+        uint64_t waited = time_now_ms() - ws->parked_head->parked_since;
+        timeout = waited >= LOOKUP_TIMEOUT ? 0 : MIN(TICK_INTERVAL, (int) (LOOKUP_TIMEOUT - waited));
+    }
+
+    event *ready = NULL;
+    int num_ready = event_loop_wait(ws->loop, timeout, &ready);
+    if (num_ready == 0) {
+        webserver_resume_parked(ws, fs, 0);
+        return 0;
+    } else if (num_ready == -1) {
+        if (errno == EINTR) return 0;
+        perror("event_loop_wait");
         return -1;
     }
 
-    // Deciding what to do for each open socket - are they listening or not?
-    for (int i = 0; i < ws->num_open_sockets; i++) {
-        struct pollfd *sock = &(ws->open_sockets[i]);
-        open_socket *sock_config = &(ws->open_sockets_config[i]);
+    // Only the sockets that are actually ready are visited
+    for (int i = 0; i < num_ready; i++) {
+        int fd = ready[i].fd;
 
-        if (!(sock->revents & (POLLIN | POLLOUT))) continue;
+        if (fd == ws->wakeup_fd) {
+            event_wakeup_drain(fd);
+            webserver_resume_parked(ws, fs, 1);
+            continue;
+        }
 
-        // Handle TCP server-sockets
-        if (sock_config->is_server_socket == 1 && sock_config->protocol == TCP) {
-            int in_fd = socket_accept(&(sock->fd));
-            if (in_fd < 0) {
-                perror("Socket failed to accept.");
-                continue;
-            }
+        if (fd < 0 || fd >= ws->open_sockets_capacity) continue;
 
-            // appending the client socket
-            for (int j = 0; j < MAX_NUM_OPEN_SOCKETS; j++) {
-                if (ws->open_sockets[j].fd == -1) {
-                    sock->events = 0;
-                    ws->open_sockets[j].fd = in_fd;
-                    ws->open_sockets[j].events = POLLIN;
-                    ws->open_sockets_config[j].protocol = sock_config->protocol;
-                    ws->num_open_sockets++;
-                    break;
-                }
-            }
+        open_socket *sock = ws->open_sockets[fd];
+        if (sock == NULL) continue; // closed while handling an earlier event of this batch
 
+        // Handle TCP server-sockets
+        if (sock->is_server_socket == 1 && sock->protocol == TCP) {
+            webserver_accept_all(ws, sock);
             continue;
         }
 
+        if (!(ready[i].events & (POLLIN | POLLOUT | POLLHUP | POLLERR))) continue;
+
         // Handle UDP server socket & all client sockets
-        if (handle_connection(sock->revents, &(sock->fd), sock_config->protocol, ws, fs) < 0) {
-            // Disableing all events
-            sock->events = 0;
-
-            if (sock_config->protocol == TCP) {
-                // Disabling the TCP client socket
-                sock->fd = -1;
-                sock_config->is_server_socket = 0;
-                sock_config->protocol = 0;
-
-                // re-enableing the TCP server socket
-                // TODO: Check if this is necessary
-            }
+        if (handle_connection(ready[i].events, &fd, sock->protocol, ws, fs) < 0 && sock->protocol != UDP) {
+            webserver_remove_socket(ws, fd);
         }
     }
 
+    webserver_resume_parked(ws, fs, 0);
+
     return 0;
 }
 
+/**
+ * Runs the event loop of one worker thread until it fails or is asked to quit.
+ * @param arg the worker's webserver_worker
+ */
+static void *webserver_worker_run(void *arg) {
+    webserver_worker *worker = arg;
+
+    while (!worker->quit) {
+        if (webserver_tick(worker->ws, worker->fs) != 0) break;
+    }
+
+    return NULL;
+}
+
 void webserver_free(webserver *ws) {
     free(ws->HOST);
     free(ws->PORT);
-    free(ws->open_sockets);
-    free(ws->open_sockets_config);
 
-    if (ws->node != NULL) dht_node_free(ws->node);
+    for (int fd = 0; ws->open_sockets != NULL && fd < ws->open_sockets_capacity; fd++) {
+        if (ws->open_sockets[fd] != NULL) webserver_remove_socket(ws, fd);
+    }
+    free(ws->open_sockets);
+    migration_free_scheduled(ws);
+    if (ws->proxy != NULL) proxy_pool_free(ws->proxy);
+    if (ws->loop != NULL) event_loop_free(ws->loop);
+    if (ws->wakeup_fd != -1) event_wakeup_free(ws->wakeup_fd, ws->wakeup_write_fd);
+
+    // the nodes are shared by all workers and owned by worker 0
+    if (ws->node != NULL && ws->worker_id == 0) {
+        for (int k = 0; k < ws->num_nodes; k++) dht_node_free(ws->nodes[k]);
+        free(ws->nodes);
+    }
 
     free(ws);
 }
 
+static volatile sig_atomic_t shutdown_requested = 0;
+
+/**
+ * Lets the main loop finish on SIGINT / SIGTERM, so the file system can be checkpointed.
+ */
+static void webserver_request_shutdown(int signum) {
+    (void) signum;
+    shutdown_requested = 1;
+}
+
 int main(int argc, char **argv) {
     if (argc != MIN_NUMBER_OF_PARAMS + 1 && argc != MAX_NUMBER_OF_PARAMS + 1) {
         perror("Wrong number of args. Usage: ./webserver {IP} {PORT} {Node ID} {? Anchor IP} {? Anchor PORT} ; When Anchor IP is set, Anchor PORT must be set as well.");
@@ -134,75 +449,260 @@ int main(int argc, char **argv) {
     }
 
     // initializing underlying filesystem
-    file_system *fs = fs_create(50);
-    fs_mkdir(fs, "/static");
-    fs_mkdir(fs, "/dynamic");
-    fs_mkfile(fs, "/static/foo");
-    fs_writef(fs, "/static/foo", "Foo");
-    fs_mkfile(fs, "/static/bar");
-    fs_writef(fs, "/static/bar", "Bar");
-    fs_mkfile(fs, "/static/baz");
-    fs_writef(fs, "/static/baz", "Baz");
-
-    // initializing webserver
-    webserver *ws = webserver_init(argv[1], argv[2]);
-    if (!ws) {
-        perror("Initialization of the webserver failed.");
+    long fs_num_blocks = FS_DEFAULT_NUM_BLOCKS;
+    if (getenv("FS_NUM_BLOCKS") != NULL) {
+        fs_num_blocks = strtol(getenv("FS_NUM_BLOCKS"), NULL, 10);
+        if (fs_num_blocks < 1 || fs_num_blocks > INT32_MAX / 2) {
+            perror("Invalid number of file system blocks.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // FS_IMAGE makes the file system persistent, its content survives restarts
+    file_system *fs;
+    if (getenv("FS_IMAGE") != NULL) {
+        fs = fs_open(getenv("FS_IMAGE"), fs_num_blocks);
+        if (fs == NULL) exit(EXIT_FAILURE);
+    } else fs = fs_create(fs_num_blocks);
+
+    // FS_IMPORT_DIR loads a host directory tree into the root of the file system
+    if (getenv("FS_IMPORT_DIR") != NULL) {
+        int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (getenv("FS_IMPORT_THREADS") != NULL) num_threads = strtol(getenv("FS_IMPORT_THREADS"), NULL, 10);
+
+        uint64_t start = time_now_ms();
+        int imported = fs_import_tree(fs, "/", getenv("FS_IMPORT_DIR"), num_threads);
+        if (imported < 0) {
+            perror("Could not import directory.");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Imported %d files in %lu ms.\n", imported, (unsigned long) (time_now_ms() - start));
+    }
+
+    if (fs_lookup(fs, "/static") == -1) {
+        fs_mkdir(fs, "/static");
+        fs_mkdir(fs, "/dynamic");
+        fs_mkfile(fs, "/static/foo");
+        fs_writef(fs, "/static/foo", "Foo", 3);
+        fs_mkfile(fs, "/static/bar");
+        fs_writef(fs, "/static/bar", "Bar", 3);
+        fs_mkfile(fs, "/static/baz");
+        fs_writef(fs, "/static/baz", "Baz", 3);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = webserver_request_shutdown;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int num_workers = 1;
+    if (getenv("WORKERS") != NULL) {
+        num_workers = strtol(getenv("WORKERS"), NULL, 10);
+        if (num_workers < 1 || num_workers > MAX_NUM_WORKERS) {
+            perror("Invalid number of workers.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // DHT_HASH=xxh64 maps keys onto the ring with a cheaper hash, all nodes of the ring have to agree on it
+    hash_algorithm algorithm = HASH_SHA256;
+    if (getenv("DHT_HASH") != NULL) {
+        if (strcmp(getenv("DHT_HASH"), "xxh64") == 0) algorithm = HASH_XXH64;
+        else if (strcmp(getenv("DHT_HASH"), "sha256") != 0) {
+            perror("Invalid hash function.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (hash_init(algorithm) != 0) {
+        perror("Initialization of the hash function failed.");
         exit(EXIT_FAILURE);
     }
 
+    dht_node *node;
     if (argc > 4) {
-        ws->node = dht_node_init(argv[3], argv[4], argv[5]);
-    } else ws->node = dht_node_init(argv[3], NULL, NULL);
+        node = dht_node_init(argv[3], argv[4], argv[5]);
+    } else node = dht_node_init(argv[3], NULL, NULL);
 
-    // opening UDP Socket
-    if (socket_open(ws, SOCK_DGRAM) < 0) {
-        perror("UDP Socket Creation failed.");
+    // the node names itself by the webserver's address in its messages
+    if (node == NULL || dht_address_resolve(argv[1], argv[2], &(node->addr)) != 0) {
+        perror("Initialization of the DHT node failed.");
         exit(EXIT_FAILURE);
     }
 
-    // opening TCP Socket
-    if (socket_open(ws, SOCK_STREAM) < 0) {
-        perror("TCP Socket Creation failed.");
+    // VIRTUAL_NODES lets the webserver take several places on the ring, virtual node k uses PORT + k
+    int num_nodes = 1;
+    if (getenv("VIRTUAL_NODES") != NULL) {
+        num_nodes = strtol(getenv("VIRTUAL_NODES"), NULL, 10);
+        if (num_nodes < 1 || num_nodes > MAX_NUM_VIRTUAL_NODES || strtol(argv[2], NULL, 10) + num_nodes - 1 > UINT16_MAX) {
+            perror("Invalid number of virtual nodes.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    dht_node **nodes = calloc(num_nodes, sizeof(dht_node*));
+    char (*node_ports)[12] = calloc(num_nodes, sizeof(*node_ports));
+    if (nodes == NULL || node_ports == NULL) {
+        perror("Initialization of the DHT node failed.");
         exit(EXIT_FAILURE);
     }
+    nodes[0] = node;
+    snprintf(node_ports[0], sizeof(node_ports[0]), "%s", argv[2]);
+
+    for (int k = 1; k < num_nodes; k++) {
+        snprintf(node_ports[k], sizeof(node_ports[k]), "%d", (int) strtol(argv[2], NULL, 10) + k);
+
+        // a virtual node's ID is the hash of its address, unique among the webserver's nodes
+        char name[64];
+        snprintf(name, sizeof(name), "%s:%s", argv[1], node_ports[k]);
+        uint16_t id = hash(name);
+        for (int j = 0; j < k; j++) {
+            if (nodes[j]->ID != id) continue;
+            id++;
+            j = -1;
+        }
+
+        // it joins the ring like any other node: via the anchor or, if there is none, via node 0
+        char id_str[8];
+        snprintf(id_str, sizeof(id_str), "%u", id);
+        nodes[k] = dht_node_init(id_str, (argc > 4) ? argv[4] : argv[1], (argc > 4) ? argv[5] : argv[2]);
+
+        if (nodes[k] == NULL || dht_address_resolve(argv[1], node_ports[k], &(nodes[k]->addr)) != 0) {
+            perror("Initialization of the DHT node failed.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // initializing one webserver per worker
+    webserver_worker *workers = calloc(num_workers, sizeof(webserver_worker));
+    webserver **worker_webservers = calloc(num_workers, sizeof(webserver*));
+    for (int i = 0; i < num_workers; i++) {
+        webserver *ws = webserver_init(argv[1], argv[2]);
+        if (!ws) {
+            perror("Initialization of the webserver failed.");
+            exit(EXIT_FAILURE);
+        }
+
+        ws->worker_id = i;
+        ws->num_workers = num_workers;
+        ws->node = node;
+        ws->nodes = nodes;
+        ws->num_nodes = num_nodes;
+        ws->workers = worker_webservers;
+        worker_webservers[i] = ws;
+        workers[i].ws = ws;
+        workers[i].fs = fs;
+
+        for (int k = 0; k < num_nodes; k++) {
+            const char *port = (k == 0) ? NULL : node_ports[k];
+
+            // opening UDP Socket, owned by worker 0
+            if (i == 0 && (nodes[k]->udp_fd = socket_open(ws, SOCK_DGRAM, port)) < 0) {
+                perror("UDP Socket Creation failed.");
+                exit(EXIT_FAILURE);
+            }
+
+            // opening TCP Socket, every virtual node's port serves all of the webserver's keys
+            if (socket_open(ws, SOCK_STREAM, port) < 0) {
+                perror("TCP Socket Creation failed.");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // the other workers send their lookups via worker 0's UDP socket
+        ws->udp_server_fd = workers[0].ws->udp_server_fd;
+    }
+
+    free(node_ports);
+
+    // in proxy mode, objects fetched from other nodes are cached and shared by all workers
+    object_cache *objects = NULL;
+    if (worker_webservers[0]->proxy != NULL) {
+        long objects_size = OBJECT_CACHE_SIZE;
+        if (getenv("OBJECT_CACHE_SIZE") != NULL) objects_size = strtol(getenv("OBJECT_CACHE_SIZE"), NULL, 10);
+
+        uint64_t objects_ttl = OBJECT_CACHE_TTL;
+        if (getenv("OBJECT_CACHE_TTL") != NULL && strtol(getenv("OBJECT_CACHE_TTL"), NULL, 10) >= 0) {
+            objects_ttl = strtol(getenv("OBJECT_CACHE_TTL"), NULL, 10);
+        }
+
+        if (objects_size > 0) {
+            objects = object_cache_create(objects_size, objects_ttl);
+            if (objects == NULL) {
+                perror("Could not initialize object cache.");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for (int i = 0; i < num_workers; i++) worker_webservers[i]->objects = objects;
+    }
+
+    for (int i = 1; i < num_workers; i++) {
+        if (pthread_create(&(workers[i].thread), NULL, webserver_worker_run, &(workers[i])) != 0) {
+            perror("Could not start worker.");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    webserver *ws = workers[0].ws;
 
     int should_stabilize = 0;
     if (getenv("NO_STABILIZE") == NULL) should_stabilize = 1;
 
-    int t = 0;
+    uint64_t last_stabilize = time_now_ms();
     int quit = 0;
-    while(!quit) {
-        t++;
-
-        for (int i = 0; i < ws->num_open_sockets; i++) {
-            struct pollfd *sock = &(ws->open_sockets[i]);
-            open_socket *sock_config = &(ws->open_sockets_config[i]);
-
-            if (sock_config->is_server_socket == 1) {
-                if ((ws->node->status == JOINING | ws->node->status == STABILIZING) && sock_config->protocol == UDP) {
-                    sock->events = POLLOUT;
-                    break;
-                } else if (ws->node->status == OK) {
-                    sock->events = POLLIN | POLLOUT;
-                }
+    while(!quit && !shutdown_requested) {
+        if (webserver_tick(ws, fs) != 0) quit = 1;
+
+        uint64_t now = time_now_ms();
+        if (should_stabilize == 1 && now - last_stabilize >= STABILIZE_INTERVAL && ws->node != NULL) {
+            for (int k = 0; k < num_nodes; k++) {
+                dht_node_lock(nodes[k]);
+                nodes[k]->status = STABILIZING;
+                dht_node_unlock(nodes[k]);
             }
+            last_stabilize = now;
         }
+    }
 
-        if (webserver_tick(ws, fs) != 0) quit = 1;
+    for (int i = 1; i < num_workers; i++) {
+        workers[i].quit = 1;
+        pthread_join(workers[i].thread, NULL);
+    }
 
-        if (should_stabilize == 1 && t % STABILIZE_INTERVAL == 0 && ws->node != NULL) {
-            ws->node->status = STABILIZING;
-            t = 0;
+    if (node != NULL) {
+        uint64_t hits = 0, misses = 0, evictions = 0;
+        for (int k = 0; k < num_nodes; k++) {
+            hits += nodes[k]->lookup_cache->hits;
+            misses += nodes[k]->lookup_cache->misses;
+            evictions += nodes[k]->lookup_cache->evictions;
         }
+        fprintf(stderr, "Lookup cache: %lu hits, %lu misses, %lu evictions.\n",
+                (unsigned long) hits, (unsigned long) misses, (unsigned long) evictions);
     }
 
-    for (int i = 0; i < ws->num_open_sockets; i++) {
-        int *sockfd = &(ws->open_sockets[i]).fd;
-        socket_shutdown(NULL, sockfd);
+    if (objects != NULL) {
+        fprintf(stderr, "Object cache: %lu hits, %lu revalidations, %lu misses, %lu evictions.\n",
+                (unsigned long) objects->hits, (unsigned long) objects->revalidations,
+                (unsigned long) objects->misses, (unsigned long) objects->evictions);
+    }
+
+    for (int i = num_workers - 1; i >= 0; i--) {
+        webserver *worker_ws = workers[i].ws;
+
+        for (int fd = 0; fd < worker_ws->open_sockets_capacity; fd++) {
+            if (worker_ws->open_sockets[fd] == NULL) continue;
+            socket_shutdown(NULL, &fd);
+        }
+
+        webserver_free(worker_ws);
     }
+    free(workers);
+    free(worker_webservers);
+    if (objects != NULL) object_cache_free(objects);
 
-    webserver_free(ws);
+    if (fs_checkpoint(fs) != 0) perror("Could not checkpoint the file system.");
     fs_free(fs);
 
     return 0;
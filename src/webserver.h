@@ -4,33 +4,87 @@
 #include <poll.h>
 #include "lib/filesystem/filesystem.h"
 #include "lib/dht.h"
+#include "lib/event.h"
+#include "lib/http_parser.h"
+#include "lib/http_output.h"
 
 #define HOSTNAME_MAX_LENGTH 16 // Max. hostname length INCLUDING \0
 #define MIN_NUMBER_OF_PARAMS 3
 #define MAX_NUMBER_OF_PARAMS 5
-#define MAX_NUM_OPEN_SOCKETS 10
+#define MAX_NUM_OPEN_SOCKETS 65536 // Default hard limit of open sockets, can be overridden via env MAX_OPEN_SOCKETS
+#define TICK_INTERVAL 100 // Max. time (ms) a webserver tick waits for events
+#define MAX_NUM_WORKERS 256 // Max. number of worker threads, configured via env WORKERS (default: 1)
+#define MAX_NUM_VIRTUAL_NODES 64 // Max. number of virtual nodes per webserver, configured via env VIRTUAL_NODES (default: 1)
+#define MAX_NUM_PARKED 1024 // Max. number of requests per worker waiting for a DHT lookup, further ones are answered with 503 right away
+#define KEEP_ALIVE_TIMEOUT 5000 // Default time (ms) after which idle connections are closed, can be overridden via env KEEP_ALIVE_TIMEOUT
 #define MAX_DATA_SIZE 1024
 #define RECEIVE_ATTEMPTS 1 // The amount of times the server should retry receiving from a socket if an error occurs
 
 enum connection_protocol {
     TCP,
-    UDP
+    UDP,
+    PROXY, // upstream connection to a peer (proxy mode)
+    MIGRATION // connection handing files over to a node that has joined
 };
 
 typedef struct open_socket {
+    int fd;
     enum connection_protocol protocol;
     unsigned short is_server_socket;
+    short events; // events the socket is currently watched for
+    http_parser *parser; // state of the request currently being received (TCP client sockets only)
+    http_output *out; // responses that have not been sent yet, in request order (TCP client sockets only)
+    unsigned short close_after_write; // 1 if the connection is closed once all output has been sent
+    unsigned short peer_closed; // 1 if the peer won't send any more requests
+    unsigned short parked; // 1 while the current request waits for the reply to a DHT lookup
+    uint64_t parked_since; // time (ms) the request was parked
+    struct proxy_upstream *upstream; // upstream connection the current request has been forwarded to, NULL if none
+    struct proxy_upstream *proxy; // the upstream connection's state (PROXY sockets only)
+    struct migration *migration; // the migration's state (MIGRATION sockets only)
+    uint64_t last_active; // time (ms) of the last activity, for idle timeouts
+    // List of TCP client sockets, ordered by last activity (least recent first)
+    struct open_socket *idle_prev;
+    struct open_socket *idle_next;
+    // List of parked TCP client sockets, ordered by the time they were parked
+    struct open_socket *parked_prev;
+    struct open_socket *parked_next;
 } open_socket;
 
+/**
+ * One webserver object exists per worker thread. Each one owns its event loop and TCP listeners
+ * (bound with SO_REUSEPORT when there are several workers); the dht_nodes are shared between them.
+ * Only worker 0 owns the UDP sockets and drives the DHT (JOIN / STABILIZE).
+ */
 typedef struct webserver {
     char* HOST;
     char* PORT;
-    // Array of file descriptors (int) of currently open sockets. Length: MAX_NUM_OPEN_SOCKETS
-    struct pollfd* open_sockets;
-    open_socket* open_sockets_config;
-    // ^ Indices of open_sockets_config corresponding to the open_sockets array.
+    int worker_id;
+    int num_workers;
+    event_loop *loop;
+    // Table of currently open sockets, indexed by file descriptor. NULL where no socket is open.
+    open_socket** open_sockets;
+    int open_sockets_capacity;
     int num_open_sockets;
+    int max_open_sockets;
+    int tcp_server_fd;
+    int udp_server_fd;
+    open_socket *idle_head;
+    open_socket *idle_tail;
+    uint64_t idle_timeout;
+    open_socket *parked_head;
+    open_socket *parked_tail;
+    int num_parked;
+    // wakeup channel through which worker 0 tells this worker that a lookup has been answered
+    int wakeup_fd;
+    int wakeup_write_fd;
+    struct webserver **workers; // all workers' webservers (shared), indexed by worker_id
+    struct proxy_pool *proxy; // upstream connections to peers, NULL unless proxy mode is enabled via env DHT_PROXY
+    struct object_cache *objects; // objects of other nodes (shared), NULL unless proxy mode is enabled
+    struct migration *migrations; // hand-offs of files to nodes that have joined (worker 0 only)
     dht_node *node;
+    // all (virtual) nodes of this webserver (shared), nodes[0] == node; node k > 0 uses PORT + k
+    dht_node **nodes;
+    int num_nodes;
 } webserver;
 
 /**
@@ -41,6 +95,56 @@ typedef struct webserver {
  */
 webserver* webserver_init(char* hostname, char* port_str);
 
+/**
+ * Adds a socket to the webserver's table of open sockets and registers it with the event loop.
+ * Server sockets are watched edge-triggered and have to be non-blocking.
+ * @param ws the webserver.
+ * @param fd the socket's file descriptor.
+ * @param protocol the socket's protocol.
+ * @param is_server_socket 1 if fd is a listening (TCP) or bound (UDP) server socket, 0 for client connections.
+ * @return 0 on success, -1 on error (e.g. when the limit of open sockets is reached).
+ */
+int webserver_add_socket(webserver *ws, int fd, enum connection_protocol protocol, unsigned short is_server_socket);
+
+/**
+ * Removes a socket from the webserver's table of open sockets and the event loop and closes it.
+ * @param ws the webserver.
+ * @param fd the socket's file descriptor.
+ * @return 0 on success, -1 if the socket is not open.
+ */
+int webserver_remove_socket(webserver *ws, int fd);
+
+/**
+ * Marks a TCP client socket as active, postponing its idle timeout.
+ * @param ws the webserver.
+ * @param sock the socket.
+ */
+void webserver_touch_socket(webserver *ws, open_socket *sock);
+
+/**
+ * Parks a TCP client socket whose current request waits for the reply to a DHT lookup.
+ * The socket isn't read from while it is parked; its request is processed again once
+ * a reply arrives or LOOKUP_TIMEOUT has passed.
+ * @param ws the webserver.
+ * @param sock the socket.
+ * @return 0 on success, -1 if too many requests are parked already.
+ */
+int webserver_park_socket(webserver *ws, open_socket *sock);
+
+/**
+ * Unparks a socket parked with webserver_park_socket. Does nothing if it isn't parked.
+ * @param ws the webserver.
+ * @param sock the socket.
+ */
+void webserver_unpark_socket(webserver *ws, open_socket *sock);
+
+/**
+ * Wakes all workers that have parked sockets, so their requests are processed again.
+ * Called when a lookup has been answered. Safe to call from any worker.
+ * @param ws the calling worker's webserver.
+ */
+void webserver_wake_parked(webserver *ws);
+
 /**
  * Executes one lifetime-tick of the given webserver
  * @param ws the webserver to tickle.
@@ -49,7 +153,7 @@ webserver* webserver_init(char* hostname, char* port_str);
 int webserver_tick(webserver *ws, file_system *fs);
 
 /**
- * Frees the given webserver-object
+ * Frees the given webserver-object, which may also be a partially initialized one (webserver_init cleans up with it)
  * @param ws The webserver to be freed.
  */
 void webserver_free(webserver *ws);
@@ -0,0 +1,549 @@
+import contextlib
+import os
+import signal
+import socket
+import time
+from http.client import HTTPConnection
+
+import pytest
+
+import dht
+from util import KillOnExit, randbytes
+
+
+STABILIZE_INTERVAL = 1.0
+
+
+@pytest.fixture
+def webserver(request):
+    """Return a function for spawning webservers (DHT nodes) with extra environment variables
+    """
+    def runner(*args, env=None):
+        """Spawn a webserver
+        """
+        return KillOnExit(
+            [request.config.getoption('executable'), *args],
+            env={**os.environ, **(env or {})}
+        )
+
+    return runner
+
+
+@pytest.fixture
+def image(tmp_path):
+    """Return the path of a file system image that doesn't exist yet
+    """
+    return str(tmp_path / 'fs.img')
+
+
+def request(conn, method, uri, body=None):
+    """Send a request on a (kept-alive) connection and return the response's status and body
+    """
+    conn.request(method, uri, body)
+    response = conn.getresponse()
+    return response.status, response.read()
+
+
+def neighbor_env(predecessor, successor, **extra):
+    """Return the environment of a node with the given (mocked) neighbors that doesn't stabilize
+    """
+    return {
+        'NO_STABILIZE': '1',
+        'PRED_ID': f'{predecessor.id}', 'PRED_IP': predecessor.ip, 'PRED_PORT': f'{predecessor.port}',
+        'SUCC_ID': f'{successor.id}', 'SUCC_IP': successor.ip, 'SUCC_PORT': f'{successor.port}',
+        **extra
+    }
+
+
+def ring_env(ids, ports, k, **extra):
+    """Return the environment of the k-th node of a ring of nodes with the given IDs and ports
+    """
+    pred, succ = (k - 1) % len(ids), (k + 1) % len(ids)
+    return {
+        'PRED_ID': f'{ids[pred]}', 'PRED_IP': '127.0.0.1', 'PRED_PORT': f'{ports[pred]}',
+        'SUCC_ID': f'{ids[succ]}', 'SUCC_IP': '127.0.0.1', 'SUCC_PORT': f'{ports[succ]}',
+        **extra
+    }
+
+
+def redirect_port(conn, uri):
+    """Return the port a GET is redirected to, None if it isn't redirected
+    """
+    conn.request('GET', uri)
+    response = conn.getresponse()
+    response.read()
+    location = response.getheader('Location')
+    return int(location.split(':')[2].split('/')[0]) if response.status == 303 else None
+
+
+def stop(server):
+    """Stop a webserver gracefully, so it checkpoints its file system
+    """
+    server.send_signal(signal.SIGTERM)
+    server.wait(timeout=5)
+
+
+def test_image_restart(webserver, port, image):
+    """
+    Test that files survive a restart and new files don't reuse the blocks of replaced ones
+    """
+
+    with webserver('127.0.0.1', f'{port}', '1', env={'FS_IMAGE': image}) as server:
+        conn = HTTPConnection('localhost', port, timeout=2)
+        assert request(conn, 'PUT', '/dynamic/a', b'A' * 5000)[0] == 201
+        assert request(conn, 'PUT', '/dynamic/a', b'B' * 3000)[0] == 204
+        conn.close()
+        stop(server)
+
+    with webserver('127.0.0.1', f'{port}', '1', env={'FS_IMAGE': image}):
+        conn = HTTPConnection('localhost', port, timeout=2)
+        assert request(conn, 'PUT', '/dynamic/b', b'hi')[0] == 201
+        assert request(conn, 'PUT', '/dynamic/c', b'C' * 4000)[0] == 201
+
+        for uri, content in [('/dynamic/a', b'B' * 3000), ('/dynamic/b', b'hi'), ('/dynamic/c', b'C' * 4000)]:
+            assert request(conn, 'GET', uri) == (200, content)
+
+
+def test_overwrite_full(webserver, port):
+    """
+    Test that overwriting files reuses the blocks of their earlier versions,
+    and that an overwrite that doesn't fit next to the published version keeps it
+    """
+
+    with webserver('127.0.0.1', f'{port}', '1', env={'FS_NUM_BLOCKS': '200'}):
+        conn = HTTPConnection('localhost', port, timeout=2)
+        for k in range(10):
+            assert request(conn, 'PUT', '/dynamic/big', bytes([65 + k]) * 80_000)[0] in (201, 204)
+            assert request(conn, 'GET', '/dynamic/big') == (200, bytes([65 + k]) * 80_000)
+
+        assert request(conn, 'DELETE', '/dynamic/big')[0] == 204
+        assert request(conn, 'PUT', '/dynamic/big', b'A' * 120_000)[0] == 201
+        assert request(conn, 'PUT', '/dynamic/big', b'B' * 120_000)[0] == 507
+        assert request(conn, 'GET', '/dynamic/big') == (200, b'A' * 120_000)
+
+
+def test_connection_tokens(webserver, port):
+    """
+    Test that the Connection header's tokens are matched completely
+    """
+
+    with webserver('127.0.0.1', f'{port}', '1'):
+        conn = HTTPConnection('localhost', port, timeout=2)
+        conn.request('GET', '/dynamic/none', headers={'Connection': 'x-close'})
+        response = conn.getresponse()
+        response.read()
+        assert response.getheader('Connection') != 'close'
+
+        conn.request('GET', '/dynamic/none', headers={'Connection': 'TE, Close'})
+        response = conn.getresponse()
+        response.read()
+        assert response.getheader('Connection') == 'close'
+
+
+def test_import_symlinks(webserver, port, tmp_path):
+    """
+    Test that links to files are imported, while links to dirs (here forming a cycle) are skipped
+    """
+
+    (tmp_path / 'sub').mkdir()
+    (tmp_path / 'sub' / 'file').write_bytes(b'content')
+    (tmp_path / 'sub' / 'cycle').symlink_to(tmp_path)
+    (tmp_path / 'link').symlink_to(tmp_path / 'sub' / 'file')
+
+    with webserver('127.0.0.1', f'{port}', '1', env={'FS_IMPORT_DIR': str(tmp_path)}):
+        conn = HTTPConnection('localhost', port, timeout=2)
+        assert request(conn, 'GET', '/sub/file') == (200, b'content')
+        assert request(conn, 'GET', '/link') == (200, b'content')
+        assert request(conn, 'GET', '/sub/cycle/link')[0] == 404
+
+
+def test_pipelining(webserver, port):
+    """
+    Test that requests pipelined on a kept-alive connection are answered in order
+    """
+
+    with webserver('127.0.0.1', f'{port}', '1'), socket.create_connection(('localhost', port), timeout=2) as conn:
+        conn.sendall(
+            b'PUT /dynamic/p HTTP/1.1\r\nContent-Length: 5\r\n\r\nfirst'
+            b'GET /dynamic/p HTTP/1.1\r\n\r\n'
+            b'PUT /dynamic/p HTTP/1.1\r\nContent-Length: 6\r\n\r\nsecond'
+            b'GET /dynamic/p HTTP/1.1\r\n\r\n'
+        )
+
+        reader = conn.makefile('rb')
+        for status, body in [(201, b''), (200, b'first'), (204, b''), (200, b'second')]:
+            line = reader.readline().split(b' ')
+            assert int(line[1]) == status
+
+            length = 0
+            while (field := reader.readline()) != b'\r\n':
+                name, value = field.split(b':', 1)
+                if name.lower() == b'content-length':
+                    length = int(value)
+                assert (name.lower(), value.strip().lower()) != (b'connection', b'close')
+
+            assert reader.read(length) == body
+
+        # the connection is still open for further requests
+        conn.sendall(b'GET /dynamic/p HTTP/1.1\r\n\r\n')
+        assert reader.readline().split(b' ')[1] == b'200'
+
+
+def test_binary_large(webserver, port):
+    """
+    Test that binary content larger than the direct blocks (12 KiB) is stored and returned unchanged
+    """
+
+    content = bytes(range(256)) * 40 + randbytes(300_000) + b'\0' * 5000
+
+    with webserver('127.0.0.1', f'{port}', '1'):
+        conn = HTTPConnection('localhost', port, timeout=2)
+        assert request(conn, 'PUT', '/dynamic/binary', content)[0] == 201
+        assert request(conn, 'GET', '/dynamic/binary') == (200, content)
+
+        assert request(conn, 'PUT', '/dynamic/binary', content[:20_000])[0] == 204
+        assert request(conn, 'GET', '/dynamic/binary') == (200, content[:20_000])
+
+
+def test_proxy_revalidation(webserver, port):
+    """
+    Test that a proxying node serves its copy of another node's object while it is fresh,
+    revalidates it by ETag afterwards and picks up changes
+    """
+
+    # the proxy (ID 100) forwards requests for keys in (100, 60000] to the owner (ID 60000)
+    uri = next(f'/dynamic/k{i}' for i in range(100) if 100 < dht.hash(f'/dynamic/k{i}'.encode()) <= 60000)
+    proxy_port, owner_port = port, port + 1
+
+    def env(peer_id, peer_port):
+        return {
+            'DHT_PROXY': '1', 'OBJECT_CACHE_TTL': '500', 'NO_STABILIZE': '1',
+            'PRED_ID': peer_id, 'PRED_IP': '127.0.0.1', 'PRED_PORT': f'{peer_port}',
+            'SUCC_ID': peer_id, 'SUCC_IP': '127.0.0.1', 'SUCC_PORT': f'{peer_port}',
+        }
+
+    with webserver('127.0.0.1', f'{proxy_port}', '100', env=env('60000', owner_port)), \
+            webserver('127.0.0.1', f'{owner_port}', '60000', env=env('100', proxy_port)) as owner:
+        time.sleep(.5)
+        proxy = HTTPConnection('localhost', proxy_port, timeout=2)
+        direct = HTTPConnection('localhost', owner_port, timeout=2)
+
+        def get(conn, headers={}):
+            conn.request('GET', uri, headers=headers)
+            response = conn.getresponse()
+            return response.status, response.getheader('ETag'), response.read()
+
+        assert request(direct, 'PUT', uri, b'v1')[0] == 201
+        status, etag, content = get(proxy)
+        assert (status, content) == (200, b'v1') and etag is not None
+
+        # a fresh copy is served without asking the owner
+        owner.send_signal(signal.SIGSTOP)
+        try:
+            assert get(proxy) == (200, etag, b'v1')
+            assert get(proxy, {'If-None-Match': etag})[:2] == (304, etag)
+        finally:
+            owner.send_signal(signal.SIGCONT)
+
+        # a stale copy is revalidated (and stays fresh for a while again)
+        time.sleep(.6)
+        assert get(proxy) == (200, etag, b'v1')
+        owner.send_signal(signal.SIGSTOP)
+        try:
+            assert get(proxy) == (200, etag, b'v1')
+        finally:
+            owner.send_signal(signal.SIGCONT)
+
+        # the client's own condition is checked against the confirmed copy
+        time.sleep(.6)
+        assert get(proxy, {'If-None-Match': etag})[:2] == (304, etag)
+        time.sleep(.6)
+        assert get(proxy, {'If-None-Match': '"other"'}) == (200, etag, b'v1')
+
+        # a changed object replaces the stale copy
+        assert request(direct, 'PUT', uri, b'v2')[0] == 204
+        time.sleep(.6)
+        status, new_etag, content = get(proxy, {'If-None-Match': etag})
+        assert (status, content) == (200, b'v2') and new_etag != etag
+
+
+def test_proxy_large_body(webserver, port):
+    """
+    Test that a body too large for the object cache is relayed completely
+    and the upstream connection stays usable for the responses after it
+    """
+
+    uris = [f'/dynamic/l{i}' for i in range(200) if 100 < dht.hash(f'/dynamic/l{i}'.encode()) <= 60000][:2]
+    large = randbytes(1024 * 1024)
+    proxy, owner = dht.Peer(100, '127.0.0.1', port), dht.Peer(60000, '127.0.0.1', port + 1)
+
+    with webserver(proxy.ip, f'{proxy.port}', f'{proxy.id}', env=neighbor_env(owner, owner, DHT_PROXY='1', OBJECT_CACHE_SIZE='1024')), \
+            webserver(owner.ip, f'{owner.port}', f'{owner.id}', env=neighbor_env(proxy, proxy)):
+        time.sleep(.5)
+        direct = HTTPConnection('localhost', owner.port, timeout=2)
+        assert request(direct, 'PUT', uris[0], large)[0] == 201
+        assert request(direct, 'PUT', uris[1], b'small')[0] == 201
+
+        conn = HTTPConnection('localhost', proxy.port, timeout=5)
+        for uri, content in [(uris[0], large), (uris[1], b'small'), (uris[0], large)]:
+            assert request(conn, 'GET', uri) == (200, content)
+
+
+def test_join_migration(webserver, port):
+    """
+    Test that the files a joining node is responsible for are handed over to it
+    """
+
+    files = {f'/dynamic/m{k}': b'%d' % k * (1 + k) for k in range(40)}
+
+    def responsible(uri):
+        # the joining node (ID 20000) takes over the keys in (50000, 20000]
+        h = dht.hash(uri.encode())
+        return 'joined' if h > 50000 or h <= 20000 else 'anchor'
+
+    assert set(map(responsible, files)) == {'joined', 'anchor'}
+
+    with webserver('127.0.0.1', f'{port}', '50000'):
+        time.sleep(.2)
+        anchor = HTTPConnection('localhost', port, timeout=2)
+        for uri, content in files.items():
+            assert request(anchor, 'PUT', uri, content)[0] == 201
+
+        with webserver('127.0.0.1', f'{port + 1}', '20000', '127.0.0.1', f'{port}'):
+            joined = HTTPConnection('localhost', port + 1, timeout=2)
+
+            def handed_over():
+                return all(
+                    request(joined, 'GET', uri) == (200, content)
+                    for uri, content in files.items() if responsible(uri) == 'joined'
+                )
+
+            deadline = time.time() + 10
+            while not handed_over() and time.time() < deadline:
+                time.sleep(.2)
+
+            for uri, content in files.items():
+                if responsible(uri) == 'joined':
+                    assert request(joined, 'GET', uri) == (200, content)
+                    assert request(anchor, 'GET', uri)[0] == 303
+                else:
+                    assert request(anchor, 'GET', uri) == (200, content)
+
+
+@pytest.mark.parametrize('header', [
+    b'Transfer-Encoding: chunked\r\n',
+    b'Content-Length: 7\r\nContent-Length: 7\r\n',
+    b'Content-Length: 7\r\nContent-Length: 0\r\n',
+])
+def test_ambiguous_body(webserver, port, header):
+    """
+    Test that requests whose body can't be delimited by a single Content-Length are rejected
+    and their connection is closed, instead of parsing the body as the next request
+    """
+
+    with webserver('127.0.0.1', f'{port}', '1'), socket.create_connection(('localhost', port), timeout=2) as conn:
+        conn.sendall(b'PUT /dynamic/te HTTP/1.1\r\n' + header + b'\r\n'
+                     b'7\r\nGET / HTTP/1.1\r\n\r\n0\r\n\r\n')
+
+        reader = conn.makefile('rb')
+        assert reader.readline().split(b' ')[1] == b'400'
+        head = b''
+        while (field := reader.readline()) != b'\r\n':
+            head += field.lower()
+        assert b'connection: close' in head
+
+        reader.read()
+        assert conn.recv(1) == b''
+
+
+def test_udp_length(webserver, port):
+    """
+    Test that DHT messages are only processed if their datagram has exactly the message's length
+    """
+
+    peer = dht.Peer(60000, '127.0.0.1', port + 1)
+    with dht.peer_socket(peer, timeout=.5) as sock, webserver('127.0.0.1', f'{port}', '1000', env=neighbor_env(peer, peer)):
+        time.sleep(.2)
+        lookup = dht.serialize(dht.Message(dht.Flags.lookup, 30000, peer))
+
+        for data in [lookup + b'\0' * 8, lookup[:-1]]:
+            sock.sendto(data, ('127.0.0.1', port))
+            with pytest.raises(socket.timeout):
+                sock.recv(1024)
+
+        sock.sendto(lookup, ('127.0.0.1', port))
+        assert dht.deserialize(sock.recv(1024)) == dht.Message(dht.Flags.reply, 1000, peer)
+
+
+def test_successor_failure(webserver, port):
+    """
+    Test that a node whose successor fails routes the successor's keys to the next node
+    within one stabilize period of noticing the failure
+    """
+
+    ids, ports = [10000, 30000, 50000], [port, port + 1, port + 2]
+    uri = next(f'/dynamic/k{i}' for i in range(100) if 10000 < dht.hash(f'/dynamic/k{i}'.encode()) <= 30000)
+
+    with contextlib.ExitStack() as stack:
+        nodes = [
+            stack.enter_context(webserver('127.0.0.1', f'{ports[k]}', f'{ids[k]}', env=ring_env(ids, ports, k)))
+            for k in range(3)
+        ]
+
+        # the first stabilize rounds tell each node its successor's successor
+        time.sleep(2.5)
+        conn = HTTPConnection('localhost', ports[0], timeout=2)
+        assert redirect_port(conn, uri) == ports[1]
+
+        nodes[1].send_signal(signal.SIGSTOP)
+        try:
+            # unanswered STABILIZEs are resent SUCCESSOR_RETRIES (2) times, SUCCESSOR_TIMEOUT (300 ms) apart
+            failed = time.time()
+            while redirect_port(conn, uri) != ports[2] and time.time() - failed < 5:
+                time.sleep(.05)
+            assert redirect_port(conn, uri) == ports[2]
+            assert time.time() - failed < STABILIZE_INTERVAL + 3 * .3 + .3
+
+            # the next node takes over the keys once its predecessor has been silent for PREDECESSOR_TIMEOUT (2.5 s)
+            conn = HTTPConnection('localhost', ports[2], timeout=2)
+            while request(conn, 'GET', uri)[0] != 404 and time.time() - failed < 5:
+                time.sleep(.1)
+            assert request(conn, 'GET', uri)[0] == 404
+        finally:
+            nodes[1].send_signal(signal.SIGCONT)
+
+
+def test_parked_lookup(webserver, port):
+    """
+    Test that a GET for a key of an unknown node waits for its lookup's reply and is redirected right after it,
+    and that it is answered with 503 if no reply arrives within LOOKUP_TIMEOUT (500 ms)
+    """
+
+    self = dht.Peer(10000, '127.0.0.1', port)
+    successor = dht.Peer(30000, '127.0.0.1', port + 1)
+    responsible = dht.Peer(50000, '127.0.0.1', port + 2)
+    uris = [f'/dynamic/k{i}' for i in range(200) if 30000 < dht.hash(f'/dynamic/k{i}'.encode()) <= 50000][:2]
+    with dht.peer_socket(successor, timeout=1) as succ_mock, \
+            webserver(self.ip, f'{self.port}', f'{self.id}', env=neighbor_env(responsible, successor)):
+        time.sleep(.2)
+        conn = HTTPConnection('localhost', port, timeout=2)
+
+        # no reply
+        start = time.time()
+        conn.request('GET', uris[0])
+        assert dht.deserialize(succ_mock.recv(1024)).flags == dht.Flags.lookup
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 503 and response.getheader('Retry-After') == '1'
+        assert time.time() - start >= .4
+
+        # the reply arrives after one (here negligible) round trip
+        start = time.time()
+        conn.request('GET', uris[1])
+        lookup = dht.deserialize(succ_mock.recv(1024))
+        assert lookup == dht.Message(dht.Flags.lookup, dht.hash(uris[1].encode()), self)
+        succ_mock.sendto(dht.serialize(dht.Message(dht.Flags.reply, successor.id, responsible)), (self.ip, self.port))
+
+        response = conn.getresponse()
+        response.read()
+        assert response.status == 303
+        assert response.getheader('Location') == f'http://{responsible.ip}:{responsible.port}{uris[1]}'
+        assert time.time() - start < .25
+
+
+def test_lookup_cache(webserver, port):
+    """
+    Test that looked up nodes are cached for LOOKUP_CACHE_TTL and dropped when the ring changes
+    """
+
+    self = dht.Peer(10000, '127.0.0.1', port)
+    successor = dht.Peer(30000, '127.0.0.1', port + 1)
+    responsible = dht.Peer(50000, '127.0.0.1', port + 2)
+    joining = dht.Peer(5000, '127.0.0.1', port + 3)
+    # (not covered by the finger starting at 10000 + 2^15, which the reply sets as well)
+    uri = next(f'/dynamic/k{i}' for i in range(200) if 30000 < dht.hash(f'/dynamic/k{i}'.encode()) < 42768)
+    env = neighbor_env(responsible, successor, LOOKUP_CACHE_TTL='500')
+
+    with dht.peer_socket(successor, timeout=.3) as succ_mock, dht.peer_socket(joining) as join_mock, \
+            webserver(self.ip, f'{self.port}', f'{self.id}', env=env):
+        time.sleep(.2)
+        conn = HTTPConnection('localhost', port, timeout=2)
+
+        def get(uri):
+            """GET uri, answering its lookup if one is sent. Return the port it is redirected to and whether it was looked up
+            """
+            conn.request('GET', uri)
+            try:
+                assert dht.deserialize(succ_mock.recv(1024)).flags == dht.Flags.lookup
+                succ_mock.sendto(dht.serialize(dht.Message(dht.Flags.reply, successor.id, responsible)), (self.ip, self.port))
+                looked_up = True
+            except socket.timeout:
+                looked_up = False
+
+            response = conn.getresponse()
+            response.read()
+            assert response.status == 303
+            return int(response.getheader('Location').split(':')[2].split('/')[0]), looked_up
+
+        assert get(uri) == (responsible.port, True)
+        assert get(uri) == (responsible.port, False)
+
+        # expired
+        time.sleep(.6)
+        assert get(uri) == (responsible.port, True)
+        assert get(uri) == (responsible.port, False)
+
+        # a node joins in front of this one
+        join_mock.sendto(dht.serialize(dht.Message(dht.Flags.join, 0, joining)), (self.ip, self.port))
+        assert dht.deserialize(join_mock.recv(1024)).flags == dht.Flags.notify
+        assert get(uri) == (responsible.port, True)
+
+
+def test_virtual_nodes(webserver, port):
+    """
+    Test that the virtual nodes of two webservers join one ring, on which every virtual node (listening on PORT + k)
+    answers requests for the keys of its webserver's nodes and redirects the others to the responsible virtual node
+    """
+
+    num_nodes = 3
+    servers = [(1000, port), (40000, port + 10)]
+
+    # node 0 has the given ID, virtual node k the hash of its address
+    nodes = []
+    for server, (node_id, server_port) in enumerate(servers):
+        ids = [node_id]
+        for k in range(1, num_nodes):
+            virtual_id = dht.hash(f'127.0.0.1:{server_port + k}'.encode())
+            while virtual_id in ids:
+                virtual_id += 1
+            ids.append(virtual_id)
+        nodes += [(ids[k], server, server_port + k) for k in range(num_nodes)]
+    nodes.sort()
+
+    def responsible(h):
+        return next((node for node in nodes if h <= node[0]), nodes[0])
+
+    uris = [f'/dynamic/v{k}' for k in range(50)]
+
+    def converged():
+        for i, uri in enumerate(uris):
+            server = i % len(servers)
+            conn = HTTPConnection('localhost', servers[server][1] + i % num_nodes, timeout=2)
+            conn.request('GET', uri)
+            response = conn.getresponse()
+            response.read()
+
+            _, owner, owner_port = responsible(dht.hash(uri.encode()))
+            if owner == server and response.status != 404:
+                return False
+            if owner != server and (response.status, response.getheader('Location')) != (303, f'http://127.0.0.1:{owner_port}{uri}'):
+                return False
+        return True
+
+    env = {'VIRTUAL_NODES': f'{num_nodes}'}
+    with webserver('127.0.0.1', f'{port}', '1000', env=env), \
+            webserver('127.0.0.1', f'{port + 10}', '40000', '127.0.0.1', f'{port}', env=env):
+        deadline = time.time() + 15
+        while not converged() and time.time() < deadline:
+            time.sleep(.5)
+        assert converged()